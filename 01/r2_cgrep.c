@@ -1,10 +1,13 @@
 #define _POSIX_C_SOURCE 200809L
-#include <unistd.h>     /* write */
+#include <unistd.h>     /* read, write, pread, lseek */
 #include <fcntl.h>      /* openat */
-#include <string.h>     /* strlen */
+#include <string.h>     /* strlen, memchr, memcpy */
+#include <stdlib.h>     /* malloc, free */
+#include <stdbool.h>    /* bool */
 #include <assert.h>     /* assert */
 #include <err.h>        /* err, warn */
 #include <errno.h>      /* errno, ENOENT */
+#include <stdio.h>      /* snprintf */
 
 /* Implementujte podprogram ‹cgrep›, která vypíše všechny řádky ze
  * vstupu ‹fd_in›, které obsahují znak ‹c›. Tyto řádky vypište na
@@ -14,7 +17,228 @@
  *
  * Návratová hodnota: 0 – úspěch; 1 – systémová chyba. */
 
-int cgrep( int fd_in, char c, int fd_out );
+/* The input is read in blocks of ‹CG_BLOCK› bytes and searched for
+ * the first byte which is either ‹c› or a newline – whichever comes
+ * first decides whether the current line is printed, so a line is
+ * only scanned once. The search compares 32 (AVX2) or 16 (SSE2)
+ * bytes at a time, depending on what the processor supports; after
+ * a match, the end of the line is found by ‹memchr›. Lines which
+ * contain ‹c› are collected in an output buffer and written in
+ * blocks, too. Only the current line is ever needed again, and only
+ * if it is longer than what is left of the block: it is then read
+ * again with ‹pread›, starting at its offset, which is why the input
+ * must be seekable. */
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#include <immintrin.h>
+#define CG_X86 1
+#endif
+
+#define CG_BLOCK 65536
+
+static const char *scan2_scalar( const char *p, const char *end,
+                                 char a, char b )
+{
+    while ( p < end && *p != a && *p != b )
+        ++p;
+
+    return p;
+}
+
+#ifdef CG_X86
+__attribute__(( target( "sse2" ) ))
+static const char *scan2_sse2( const char *p, const char *end,
+                               char a, char b )
+{
+    const __m128i va = _mm_set1_epi8( a ), vb = _mm_set1_epi8( b );
+
+    for ( ; end - p >= 16; p += 16 )
+    {
+        __m128i x = _mm_loadu_si128( ( const __m128i * ) p );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( x, va ),
+                                                    _mm_cmpeq_epi8( x, vb ) ) );
+        if ( mask )
+            return p + __builtin_ctz( mask );
+    }
+
+    return scan2_scalar( p, end, a, b );
+}
+
+__attribute__(( target( "avx2" ) ))
+static const char *scan2_avx2( const char *p, const char *end,
+                               char a, char b )
+{
+    const __m256i va = _mm256_set1_epi8( a ), vb = _mm256_set1_epi8( b );
+
+    for ( ; end - p >= 32; p += 32 )
+    {
+        __m256i x = _mm256_loadu_si256( ( const __m256i * ) p );
+        __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( x, va ),
+                                       _mm256_cmpeq_epi8( x, vb ) );
+        unsigned mask = _mm256_movemask_epi8( hit );
+        if ( mask )
+            return p + __builtin_ctz( mask );
+    }
+
+    return scan2_scalar( p, end, a, b );
+}
+#endif
+
+/* Find the first byte in [p, end) equal to ‹a› or ‹b›; returns ‹end›
+ * if there is none. */
+static const char *scan2( const char *p, const char *end, char a, char b )
+{
+#ifdef CG_X86
+    if ( __builtin_cpu_supports( "avx2" ) )
+        return scan2_avx2( p, end, a, b );
+    if ( __builtin_cpu_supports( "sse2" ) )
+        return scan2_sse2( p, end, a, b );
+#endif
+    return scan2_scalar( p, end, a, b );
+}
+
+struct cg_out
+{
+    int fd;
+    size_t len;
+    char buf[ CG_BLOCK ];
+};
+
+static int cg_flush( struct cg_out *out )
+{
+    for ( size_t done = 0; done < out->len; )
+    {
+        ssize_t bytes = write( out->fd, out->buf + done, out->len - done );
+        if ( bytes == -1 )
+            return -1;
+        done += bytes;
+    }
+
+    out->len = 0;
+    return 0;
+}
+
+static int cg_put( struct cg_out *out, const char *data, size_t size )
+{
+    while ( size > 0 )
+    {
+        if ( out->len == CG_BLOCK && cg_flush( out ) == -1 )
+            return -1;
+
+        size_t chunk = CG_BLOCK - out->len;
+        if ( chunk > size )
+            chunk = size;
+
+        memcpy( out->buf + out->len, data, chunk );
+        out->len += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+/* Copy bytes [from, to) of the input into the output buffer. */
+static int cg_reread( struct cg_out *out, int fd_in, off_t from, off_t to )
+{
+    while ( from < to )
+    {
+        if ( out->len == CG_BLOCK && cg_flush( out ) == -1 )
+            return -1;
+
+        size_t chunk = CG_BLOCK - out->len;
+        if ( ( off_t ) chunk > to - from )
+            chunk = to - from;
+
+        ssize_t bytes = pread( fd_in, out->buf + out->len, chunk, from );
+        if ( bytes <= 0 )
+            return -1;
+
+        out->len += bytes;
+        from += bytes;
+    }
+
+    return 0;
+}
+
+int cgrep( int fd_in, char c, int fd_out )
+{
+    char *in = malloc( CG_BLOCK );
+    struct cg_out *out = malloc( sizeof *out );
+    off_t base = lseek( fd_in, 0, SEEK_CUR );   /* offset of ‹in[ 0 ]› */
+    off_t line;                                 /* start of current line */
+    bool matched = false;
+    ssize_t bytes;
+    int rv = 1;
+
+    if ( !in || !out || base == -1 )
+        goto out;
+
+    out->fd = fd_out;
+    out->len = 0;
+    line = base;
+
+    while ( ( bytes = read( fd_in, in, CG_BLOCK ) ) > 0 )
+    {
+        const char *p = in, *end = in + bytes;
+
+        while ( p < end )
+        {
+            if ( !matched )
+            {
+                p = scan2( p, end, c, '\n' );
+
+                if ( p == end )
+                    break;
+
+                if ( *p != c )
+                {
+                    line = base + ( ++p - in );
+                    continue;
+                }
+
+                /* the line matches: output what came before ‹p› */
+                const char *start = in;
+
+                if ( line < base )
+                {
+                    if ( cg_reread( out, fd_in, line, base ) == -1 )
+                        goto out;
+                }
+                else
+                    start = in + ( line - base );
+
+                if ( cg_put( out, start, p - start ) == -1 )
+                    goto out;
+
+                matched = true;
+            }
+
+            const char *nl = memchr( p, '\n', end - p );
+            const char *stop = nl ? nl + 1 : end;
+
+            if ( cg_put( out, p, stop - p ) == -1 )
+                goto out;
+
+            p = stop;
+
+            if ( nl )
+            {
+                matched = false;
+                line = base + ( p - in );
+            }
+        }
+
+        base += bytes;
+    }
+
+    if ( bytes == 0 && cg_flush( out ) == 0 )
+        rv = 0;
+out:
+    free( in );
+    free( out );
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -85,6 +309,50 @@ static int check_cgrep( int dir_fd, const char *str, char c,
     return strcmp( expected, buffer );
 }
 
+/* Lines longer than the blocks in which the input is read. */
+
+static void check_long( int dir_fd )
+{
+    const char *in_name  = "zt.r2_test_in";
+    const char *out_name = "zt.r2_test_out";
+    static char input[ 300000 ], expected[ 300000 ], output[ 300000 ];
+    int len = 0, expected_len = 0;
+
+    memset( input, 'a', 200000 );
+    len += 200000;
+    len += snprintf( input + len, sizeof input - len, "x\nb\n" );
+    memcpy( expected, input, 200002 );
+    expected_len = 200002;
+
+    memset( input + len, 'a', 70000 );
+    len += 70000;
+    len += snprintf( input + len, sizeof input - len, "\nend x" );
+    memcpy( expected + expected_len, "end x", 5 );
+    expected_len += 5;
+
+    int fd = create_file( dir_fd, in_name );
+    if ( write( fd, input, len ) != len )
+        err( 2, "writing %s", in_name );
+    if ( lseek( fd, 0, SEEK_SET ) == -1 )
+        err( 1, "seeking in %s", in_name );
+
+    int out_fd = create_file( dir_fd, out_name );
+    assert( cgrep( fd, 'x', out_fd ) == 0 );
+
+    if ( lseek( out_fd, 0, SEEK_SET ) == -1 )
+        err( 1, "seeking in %s", out_name );
+
+    int got = 0, bytes;
+    while ( ( bytes = read( out_fd, output + got, sizeof output - got ) ) > 0 )
+        got += bytes;
+
+    assert( got == expected_len );
+    assert( memcmp( output, expected, got ) == 0 );
+
+    close_or_warn( fd, in_name );
+    close_or_warn( out_fd, out_name );
+}
+
 int main( void )
 {
     int dir_fd = openat( AT_FDCWD, ".", O_DIRECTORY );
@@ -95,6 +363,13 @@ int main( void )
     assert( check_cgrep( dir_fd, "x\ny\n", 'x', "x\n" ) == 0 );
     assert( check_cgrep( dir_fd, "x y\ny\n", 'x', "x y\n" ) == 0 );
     assert( check_cgrep( dir_fd, "xx\nxy\n", 'x', "xx\nxy\n" ) == 0 );
+    assert( check_cgrep( dir_fd, "ab\ncd\nd", 'd', "cd\nd" ) == 0 );
+    assert( check_cgrep( dir_fd, "a\n\nb", '\n', "a\n\n" ) == 0 );
+    assert( check_cgrep( dir_fd, "0123456789abcdefghijklmnopqrstuvwxyz\n"
+                                 "0123456789abcdefghijklmnopqrstuvwxyz!\n",
+                         '!',
+                         "0123456789abcdefghijklmnopqrstuvwxyz!\n" ) == 0 );
+    check_long( dir_fd );
 
     close_or_warn( dir_fd, "working directory" );
     return 0;
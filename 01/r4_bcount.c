@@ -1,7 +1,14 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* madvise */
 
 #include <unistd.h>     /* write, read, close, unlink */
 #include <fcntl.h>      /* open */
+#include <string.h>     /* memset */
+#include <stdint.h>     /* uint8_t, uint64_t */
+#include <stdbool.h>    /* bool */
+#include <stdlib.h>     /* malloc, free */
+#include <sys/stat.h>   /* fstat */
+#include <sys/mman.h>   /* mmap, munmap, madvise */
 #include <assert.h>     /* assert */
 #include <errno.h>      /* errno */
 #include <err.h>        /* NONPOSIX: err */
@@ -10,7 +17,91 @@
  * v souboru. Tento počet v případě úspěchu vrátí, jinak vrátí
  * hodnotu -1. */
 
-int count_distinct( int dir_fd, const char *file );
+/* Every byte of the file is marked in a table of 256 flags. The input
+ * is marked ‹BC_MARK_BLOCK› bytes at a time, and after each block the
+ * table is checked: once all 256 values have been seen, the rest of
+ * the file cannot change the result and is not looked at. Regular
+ * files are mapped into memory (with ‹MADV_SEQUENTIAL›), anything
+ * else is read in blocks of ‹BC_BLOCK› bytes. */
+
+#define BC_BLOCK      (1 << 20)
+#define BC_MARK_BLOCK (64 * 1024)
+
+struct byte_seen {
+    bool all;
+    uint8_t seen[256];
+};
+
+static void bc_mark(struct byte_seen *s, const uint8_t *p, size_t n) {
+    while (n > 0 && !s->all) {
+        size_t chunk = n < BC_MARK_BLOCK ? n : BC_MARK_BLOCK;
+        for (size_t i = 0; i < chunk; ++i) {
+            s->seen[p[i]] = 1;
+        }
+        p += chunk;
+        n -= chunk;
+
+        s->all = true;
+        for (int c = 0; c < 256; ++c) {
+            s->all = s->all && s->seen[c];
+        }
+    }
+}
+
+/* Mark the bytes of ‹fd›, which was just opened; returns 0 or -1 on
+ * error. */
+static int bc_mark_fd(int fd, struct byte_seen *s) {
+    struct stat st;
+
+    memset(s, 0, sizeof *s);
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = st.st_size;
+        uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            bc_mark(s, map, size);
+            munmap(map, size);
+            return 0;
+        }
+    }
+
+    uint8_t *buf = malloc(BC_BLOCK);
+    ssize_t bytes = 0;
+
+    if (!buf) {
+        return -1;
+    }
+    while (!s->all && (bytes = read(fd, buf, BC_BLOCK)) > 0) {
+        bc_mark(s, buf, bytes);
+    }
+    free(buf);
+    return bytes == -1 ? -1 : 0;
+}
+
+int count_distinct( int dir_fd, const char *file ) {
+    struct byte_seen stats;
+    int fd = openat(dir_fd, file, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    int rv = bc_mark_fd(fd, &stats);
+    if (close(fd) == -1) {
+        rv = -1;
+    }
+    if (rv == -1) {
+        return -1;
+    }
+
+    int distinct = 0;
+    for (int c = 0; c < 256; ++c) {
+        distinct += stats.seen[c];
+    }
+    return distinct;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -28,8 +119,13 @@ static void mk_tmp( const char* str, int len )
     if ( fd == -1 )
         err( 2, "creating %s", name );
 
-    if ( write( fd, str, len ) == -1 )
-        err( 2, "writing %s", name );
+    for ( int done = 0; done < len; )
+    {
+        int bytes = write( fd, str + done, len - done );
+        if ( bytes == -1 )
+            err( 2, "writing %s", name );
+        done += bytes;
+    }
 
     close_or_warn( fd, name );
 }
@@ -71,6 +167,33 @@ int main( void )
     mk_tmp( data, sizeof data );
     assert( count_distinct( dir_fd, tmp_file ) == 9 );
 
+    mk_tmp( "", 0 );
+    assert( count_distinct( dir_fd, tmp_file ) == 0 );
+    assert( count_distinct( dir_fd, "zt.r4_does_not_exist" ) == -1 );
+
+    /* larger than one marking block; first only 200 of the byte
+     * values, then all of them (the last one at the very end) */
+    int big_size = 9 * 1024 * 1024 + 3;
+    char *big = malloc( big_size );
+
+    if ( !big )
+        err( 1, "allocating" );
+
+    srand( 152 );
+    for ( int i = 0; i < big_size; ++i )
+        big[ i ] = 28 + rand() % 200;
+
+    mk_tmp( big, big_size );
+    assert( count_distinct( dir_fd, tmp_file ) == 200 );
+
+    big[ big_size - 1 ] = 0;
+    for ( int i = 1; i < 256; ++i )
+        big[ i * 4099 ] = i;
+
+    mk_tmp( big, big_size );
+    assert( count_distinct( dir_fd, tmp_file ) == 256 );
+    free( big );
+
     unlink_if_exists( dir_fd, tmp_file );
     close_or_warn( dir_fd, "working directory" );
     return 0;
@@ -3,6 +3,10 @@
 #include <assert.h>         /* assert */
 #include <errno.h>          /* errno */
 #include <unistd.h>         /* read, write, fork, close */
+#include <sys/uio.h>        /* readv */
+#include <stdlib.h>         /* malloc, free */
+#include <stdint.h>         /* SIZE_MAX */
+#include <string.h>         /* memcpy */
 #include <err.h>
 
 /* Při použití rour nebo spojovaných socketů musíme počítat s tím,
@@ -37,6 +41,180 @@ int read_buffer( int fd, char *buffer, int nbytes ) {
     return offset;
 }
 
+/* Protocols with small messages (a 4-byte length, a 1-byte
+ * acknowledgement, …) would pay a system call for each such field
+ * with ‹read_buffer›. A buffered stream reads ahead instead: each
+ * ‹read› fills as much of a ring buffer as the descriptor has ready,
+ * and small requests are then served from memory.
+ *
+ *  • ‹rstream_init› creates a stream reading from ‹fd› with a buffer
+ *    of (at least) ‹capacity› bytes (the descriptor is not owned by
+ *    the stream),
+ *  • ‹rstream_peek› waits until ‹nbytes› bytes are buffered (or the
+ *    other side ends the communication) and points ‹*data› at them
+ *    without copying; the bytes stay in the buffer until
+ *    ‹rstream_consume›. It returns the number of bytes available (less
+ *    than ‹nbytes› only at the end of input), or -1 on error,
+ *  • ‹rstream_read› is ‹read_buffer› on top of the buffer: buffered
+ *    bytes are copied out, and a large remainder is read straight into
+ *    the caller's memory – together with more read-ahead, using a
+ *    single ‹readv›,
+ *  • ‹rstream_fini› frees the stream; data read ahead is lost.
+ *
+ * The free part of the ring may wrap around its end, so it is filled
+ * with ‹readv› of (up to) two pieces. For ‹rstream_peek› to return
+ * contiguous memory, the buffer has a spare area of the same size
+ * behind the ring: when the requested bytes wrap around, their
+ * beginning at the start of the ring is copied there. */
+
+struct rstream {
+    int fd, eof;
+    char *ring;       /* capacity + capacity bytes */
+    size_t capacity;  /* a power of two */
+    size_t head;      /* stream offset of the first buffered byte */
+    size_t tail;      /* stream offset just past the last one */
+};
+
+void *rstream_init(int fd, int capacity) {
+    /* The ring is rounded up to a power of two and allocated twice;
+     * both must fit a ‹size_t›. */
+    if (capacity <= 0 || (size_t) capacity > SIZE_MAX / 4) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct rstream *s = calloc(1, sizeof *s);
+    if (!s) {
+        return NULL;
+    }
+    s->fd = fd;
+    s->capacity = 4096;
+    while (s->capacity < (size_t) capacity) {
+        s->capacity *= 2;
+    }
+    if (!(s->ring = malloc(2 * s->capacity))) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* The free part of the ring as at most two iovecs, starting at
+ * ‹iov[0]›. */
+static int rstream_space(struct rstream *s, struct iovec *iov) {
+    size_t used = s->tail - s->head, free_ = s->capacity - used;
+    size_t at = s->tail & (s->capacity - 1);
+    size_t first = s->capacity - at < free_ ? s->capacity - at : free_;
+    int n = 0;
+
+    if (first > 0) {
+        iov[n++] = (struct iovec) { s->ring + at, first };
+    }
+    if (free_ > first) {
+        iov[n++] = (struct iovec) { s->ring, free_ - first };
+    }
+    return n;
+}
+
+/* A single read (or readv, with ‹extra› in front of the ring) of as
+ * much as is ready. Returns the number of bytes which went to ‹extra›,
+ * or -1. */
+static ssize_t rstream_fill(struct rstream *s, char *extra, size_t len) {
+    struct iovec iov[3];
+    int n = 0;
+
+    if (len > 0) {
+        iov[n++] = (struct iovec) { extra, len };
+    }
+    n += rstream_space(s, iov + n);
+    if (n == 0) {
+        return 0;
+    }
+
+    ssize_t got;
+    while ((got = readv(s->fd, iov, n)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (got == -1) {
+        return -1;
+    }
+    if (got == 0) {
+        s->eof = 1;
+    }
+
+    size_t direct = (size_t) got < len ? (size_t) got : len;
+    s->tail += got - direct;
+    return direct;
+}
+
+int rstream_peek(void *handle, int nbytes, const char **data) {
+    struct rstream *s = handle;
+
+    if (nbytes < 0 || (size_t) nbytes > s->capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (s->tail - s->head < (size_t) nbytes && !s->eof) {
+        if (rstream_fill(s, NULL, 0) == -1) {
+            return -1;
+        }
+    }
+
+    size_t avail = s->tail - s->head;
+    size_t len = avail < (size_t) nbytes ? avail : (size_t) nbytes;
+    size_t at = s->head & (s->capacity - 1);
+    if (at + len > s->capacity) {
+        memcpy(s->ring + s->capacity, s->ring, at + len - s->capacity);
+    }
+    *data = s->ring + at;
+    return len;
+}
+
+void rstream_consume(void *handle, int nbytes) {
+    struct rstream *s = handle;
+    size_t avail = s->tail - s->head;
+    s->head += (size_t) nbytes < avail ? (size_t) nbytes : avail;
+}
+
+int rstream_read(void *handle, char *buffer, int nbytes) {
+    struct rstream *s = handle;
+    int done = 0;
+
+    while (done < nbytes) {
+        size_t avail = s->tail - s->head;
+        if (avail > 0) {
+            size_t at = s->head & (s->capacity - 1);
+            size_t want = nbytes - done;
+            size_t len = want < avail ? want : avail;
+            size_t first = s->capacity - at < len ? s->capacity - at : len;
+            memcpy(buffer + done, s->ring + at, first);
+            memcpy(buffer + done + first, s->ring, len - first);
+            s->head += len;
+            done += len;
+            continue;
+        }
+        if (s->eof) {
+            break;
+        }
+
+        /* The buffer is empty: a request at least as large as the
+         * buffer goes directly to the caller's memory. */
+        size_t want = nbytes - done;
+        ssize_t direct = rstream_fill(s, buffer + done,
+                                      want >= s->capacity ? want : 0);
+        if (direct == -1) {
+            return -1;
+        }
+        done += direct;
+    }
+    return done;
+}
+
+void rstream_fini(void *handle) {
+    struct rstream *s = handle;
+    free(s->ring);
+    free(s);
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <sys/wait.h>
@@ -88,6 +266,119 @@ static void writer( int fd )
     close( fd );
 }
 
+/* Messages of a 4-byte length and that many bytes (0, 1, 2, …),
+ * followed by a large blob. */
+
+enum { messages = 20000, blob_size = 100000 };
+
+static int message_size( int i )
+{
+    return ( i * 7919 ) % 301;
+}
+
+static void message_writer( int fd )
+{
+    char buffer[ blob_size ];
+
+    for ( int i = 0; i < blob_size; ++i )
+        buffer[ i ] = i % 251;
+
+    for ( int i = 0; i < messages; ++i )
+    {
+        int size = message_size( i );
+        write_or_die( fd, ( char * ) &size, 4 );
+        write_or_die( fd, buffer, size );
+    }
+
+    write_or_die( fd, buffer, blob_size );
+    close( fd );
+}
+
+static void test_stream( void )
+{
+    int fds[ 2 ];
+
+    if ( pipe( fds ) == -1 )
+        err( 1, "pipe" );
+
+    int writer_pid = fork();
+
+    if ( writer_pid == -1 )
+        err( 1, "fork" );
+
+    if ( writer_pid == 0 )
+    {
+        close_or_warn( fds[ 0 ], "reader end of a pipe" );
+        message_writer( fds[ 1 ] );
+        exit( 0 );
+    }
+
+    close_or_warn( fds[ 1 ], "writer end of a pipe" );
+
+    void *s = rstream_init( fds[ 0 ], 1000 );
+    const char *data;
+    char copy[ 512 ];
+    int size;
+
+    assert( s );
+
+    for ( int i = 0; i < messages; ++i )
+    {
+        if ( i % 3 == 0 )
+        {
+            assert( rstream_read( s, ( char * ) &size, 4 ) == 4 );
+        }
+        else
+        {
+            assert( rstream_peek( s, 4, &data ) == 4 );
+            memcpy( &size, data, 4 );
+            rstream_consume( s, 4 );
+        }
+
+        assert( size == message_size( i ) );
+
+        if ( i % 2 == 0 )
+        {
+            assert( rstream_peek( s, size, &data ) == size );
+        }
+        else
+        {
+            assert( rstream_read( s, copy, size ) == size );
+            data = copy;
+        }
+
+        for ( int j = 0; j < size; ++j )
+            assert( data[ j ] == ( char )( j % 251 ) );
+
+        if ( i % 2 == 0 )
+            rstream_consume( s, size );
+    }
+
+    /* a peek is limited by the size of the buffer */
+    assert( rstream_peek( s, 1 << 20, &data ) == -1 );
+    assert( errno == EINVAL );
+
+    char *blob = malloc( blob_size + 1 );
+    assert( blob );
+    assert( rstream_read( s, blob, blob_size + 1 ) == blob_size );
+
+    for ( int i = 0; i < blob_size; ++i )
+        assert( blob[ i ] == ( char )( i % 251 ) );
+
+    assert( rstream_peek( s, 4, &data ) == 0 );
+    assert( rstream_read( s, blob, 4 ) == 0 );
+
+    free( blob );
+    rstream_fini( s );
+
+    assert( !rstream_init( fds[ 0 ], 0 ) );
+    assert( errno == EINVAL );
+    assert( !rstream_init( fds[ 0 ], -1 ) );
+    assert( errno == EINVAL );
+    close_or_warn( fds[ 0 ], "reader end of a pipe" );
+    assert( reap( writer_pid ) == 0 );
+}
+
 int main()
 {
     int fds[ 2 ];
@@ -149,5 +440,7 @@ int main()
     close_or_warn( reader_fd, "reader end of a pipe" );
     close_or_warn( fd_wronly, "/dev/null" );
 
+    test_stream();
+
     return 0;
 }
@@ -4,6 +4,10 @@
 #include <string.h>  /* memcmp */
 #include <poll.h> /* poll */
 #include <stdlib.h>
+#include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+#include <fcntl.h>      /* fcntl */
+#include <errno.h>
+#include <stdint.h>     /* uint64_t */
 
 /* Uvažme situaci, kdy potřebujeme číst data z několika zdrojů
  * zároveň, přitom tato data přichází různou rychlostí. Navrhněte a
@@ -77,10 +81,191 @@ int collect( int count, int *fds, char **buffers,
     return rv;
 }
 
+/* With ‹poll›, every call hands the whole array of descriptors to the
+ * kernel, which checks each of them – the cost of a call grows with
+ * ‹count› even when a single pipe has data. For many descriptors,
+ * the following engine keeps them registered in an ‹epoll› instance
+ * between calls instead:
+ *
+ *  • ‹collect_init› registers the descriptors (which must be
+ *    distinct) in edge-triggered mode and switches them to
+ *    non-blocking mode,
+ *  • ‹collect_next› behaves like ‹collect›, reading directly into
+ *    ‹buffers› of the chosen descriptor,
+ *  • ‹collect_fini› restores the original flags and frees the
+ *    engine.
+ *
+ * An edge-triggered event only says that a descriptor became
+ * readable, so the engine remembers readable descriptors in a bitmap
+ * until a read says otherwise: ‹EAGAIN›, or (for pipes and other
+ * streams) a short read. Choosing the descriptor for ‹pivot› is then
+ * a scan of the bitmap, 64 descriptors per step. All per-descriptor
+ * state lives in a single allocation. */
+
+#define COLLECT_EVENTS 256
+
+struct collector {
+    int epfd, count;
+    uint64_t *ready;              /* bitmap, one bit per index */
+    struct epoll_event *events;   /* COLLECT_EVENTS of them */
+    int *fds, *flags;             /* flags as found by collect_init */
+};
+
+static void collect_restore(struct collector *c, int upto) {
+    for (int i = 0; i < upto; ++i) {
+        fcntl(c->fds[i], F_SETFL, c->flags[i]);
+    }
+}
+
+void *collect_init(int count, int *fds) {
+    if (count < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t words = ((size_t) count + 63) / 64;
+    size_t size = sizeof(struct collector) + words * sizeof(uint64_t) +
+                  COLLECT_EVENTS * sizeof(struct epoll_event) +
+                  2 * (size_t) count * sizeof(int);
+    struct collector *c = calloc(1, size);
+    if (!c) {
+        return NULL;
+    }
+
+    c->count = count;
+    c->ready = (uint64_t *) (c + 1);
+    c->events = (struct epoll_event *) (c->ready + words);
+    c->fds = (int *) (c->events + COLLECT_EVENTS);
+    c->flags = c->fds + count;
+    memcpy(c->fds, fds, count * sizeof(int));
+
+    if ((c->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        free(c);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET,
+                                  .data.u32 = i };
+        c->flags[i] = fcntl(fds[i], F_GETFL);
+        if (c->flags[i] == -1 ||
+            fcntl(fds[i], F_SETFL, c->flags[i] | O_NONBLOCK) == -1 ||
+            epoll_ctl(c->epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            int saved = errno;
+            collect_restore(c, c->flags[i] == -1 ? i : i + 1);
+            close(c->epfd);
+            free(c);
+            errno = saved;
+            return NULL;
+        }
+    }
+    return c;
+}
+
+/* Mark descriptors reported by epoll as readable; ‹timeout› only
+ * applies to the first wait. */
+static int collect_harvest(struct collector *c, int timeout) {
+    int n;
+    do {
+        if ((n = epoll_wait(c->epfd, c->events, COLLECT_EVENTS,
+                            timeout)) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint32_t idx = c->events[i].data.u32;
+            c->ready[idx / 64] |= UINT64_C(1) << idx % 64;
+        }
+        timeout = 0;
+    } while (n == COLLECT_EVENTS);
+    return 0;
+}
+
+/* Lowest ready index in [from, to), or -1. */
+static int collect_first(struct collector *c, int from, int to) {
+    if (from >= to) {
+        return -1;
+    }
+    int w = from / 64, last = (to - 1) / 64;
+    uint64_t bits = c->ready[w] & (~UINT64_C(0) << from % 64);
+    while (!bits && w < last) {
+        bits = c->ready[++w];
+    }
+    if (!bits) {
+        return -1;
+    }
+    int idx = w * 64 + __builtin_ctzll(bits);
+    return idx < to ? idx : -1;
+}
+
+int collect_next(void *handle, char **buffers, int *sizes, int pivot) {
+    struct collector *c = handle;
+
+    if (collect_harvest(c, 0) == -1) {
+        return -1;
+    }
+
+    for (;;) {
+        int i = collect_first(c, pivot, c->count);
+        if (i == -1) {
+            i = collect_first(c, 0, pivot < c->count ? pivot : c->count);
+        }
+        if (i == -1) {
+            if (collect_harvest(c, -1) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* A read of 0 bytes does not tell whether there is data;
+         * ask directly, so that the answer is the same as with poll. */
+        if (sizes[i] == 0) {
+            struct pollfd pfd = { .fd = c->fds[i], .events = POLLIN };
+            int rv = poll(&pfd, 1, 0);
+            if (rv == -1) {
+                return -1;
+            }
+            if (rv == 1) {
+                return i;
+            }
+            c->ready[i / 64] &= ~(UINT64_C(1) << i % 64);
+            continue;
+        }
+
+        ssize_t bytes = read(c->fds[i], buffers[i], sizes[i]);
+        if (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        /* A short read means the stream is drained for now; there
+         * will be a new edge when more data comes. End of file stays
+         * ready, as it would be with poll. */
+        if (bytes == -1 || (bytes > 0 && bytes < sizes[i])) {
+            c->ready[i / 64] &= ~(UINT64_C(1) << i % 64);
+        }
+        if (bytes == -1) {
+            continue;
+        }
+
+        sizes[i] -= bytes;
+        buffers[i] += bytes;
+        return i;
+    }
+}
+
+int collect_fini(void *handle) {
+    struct collector *c = handle;
+    collect_restore(c, c->count);
+    int rv = close(c->epfd);
+    free(c);
+    return rv;
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <err.h>            /* err */
 #include <assert.h>         /* assert */
+#include <stdio.h>          /* dprintf */
+#include <time.h>           /* clock_gettime */
+#include <sys/resource.h> /* getrlimit, RLIMIT_NOFILE */
 
 void set_buffer_ptrs( char* buffr_ptr, char** buffer_ptrs, int size )
 {
@@ -94,6 +279,160 @@ void write_or_die( int write_fd, const char* what, int bytes )
         err( 1, "unable to write to pipe" );
 }
 
+static void open_pipes( int count, int *fds_read, int *fds_write )
+{
+    for ( int i = 0; i < count; i++ )
+    {
+        int p[ 2 ];
+        if ( pipe( p ) != 0 ) err( 1, "unable to open pipes" );
+        fds_read[ i ] = p[ 0 ];
+        fds_write[ i ] = p[ 1 ];
+    }
+}
+
+static void close_pipes( int count, int *fds_read, int *fds_write )
+{
+    for ( int i = 0; i < count; i++ )
+    {
+        close( fds_read[ i ] );
+        close( fds_write[ i ] );
+    }
+}
+
+static void test_engine( void )
+{
+    enum { n = 256 };           /* 512 descriptors, under ‹ulimit -n 1024› */
+    static int fds_read[ n ], fds_write[ n ], sizes[ n ];
+    static char data[ n ][ 8 ];
+    static char *buffers[ n ];
+
+    open_pipes( n, fds_read, fds_write );
+
+    for ( int i = 0; i < n; i++ )
+    {
+        buffers[ i ] = data[ i ];
+        sizes[ i ] = 8;
+    }
+
+    void *c = collect_init( n, fds_read );
+    assert( c );
+
+    /* the descriptor at or after pivot comes first, then wrap */
+    write_or_die( fds_write[ 230 ], "ab", 2 );
+    write_or_die( fds_write[ 70 ], "cd", 2 );
+    write_or_die( fds_write[ 150 ], "ef", 2 );
+    assert( collect_next( c, buffers, sizes, 151 ) == 230 );
+    assert( collect_next( c, buffers, sizes, 151 ) == 70 );
+    assert( collect_next( c, buffers, sizes, 151 ) == 150 );
+    assert( memcmp( data[ 230 ], "ab", 2 ) == 0 );
+    assert( memcmp( data[ 70 ], "cd", 2 ) == 0 );
+    assert( memcmp( data[ 150 ], "ef", 2 ) == 0 );
+    assert( sizes[ 230 ] == 6 && buffers[ 230 ] == data[ 230 ] + 2 );
+
+    /* data already waiting is read even after a short read */
+    write_or_die( fds_write[ 70 ], "gh", 2 );
+    assert( collect_next( c, buffers, sizes, 0 ) == 70 );
+    write_or_die( fds_write[ 70 ], "ijkl", 4 );
+    assert( collect_next( c, buffers, sizes, n - 1 ) == 70 );
+    assert( memcmp( data[ 70 ], "cdghijkl", 8 ) == 0 );
+    assert( sizes[ 70 ] == 0 );
+
+    /* a closed writer reports end of file, like with poll */
+    close( fds_write[ 5 ] );
+    fds_write[ 5 ] = dup( fds_write[ 6 ] );
+    assert( collect_next( c, buffers, sizes, 0 ) == 5 );
+    assert( collect_next( c, buffers, sizes, 0 ) == 5 );
+    assert( sizes[ 5 ] == 8 );
+
+    assert( collect_fini( c ) == 0 );
+
+    /* the original (blocking) mode is restored */
+    assert( !( fcntl( fds_read[ 0 ], F_GETFL ) & O_NONBLOCK ) );
+
+    /* the same descriptor twice is refused */
+    int saved = fds_read[ 1 ];
+    fds_read[ 1 ] = fds_read[ 0 ];
+    assert( !collect_init( 2, fds_read ) );
+    fds_read[ 1 ] = saved;
+
+    close_pipes( n, fds_read, fds_write );
+}
+
+/* The cost of one call with a single ready pipe among ‹n›: ‹collect›
+ * (poll) against ‹collect_next› (epoll). The default only checks
+ * that both agree on small sets; build with e.g.
+ * ‹-DCOLLECT_BENCH_MAX=8192› to print timings up to 8192 pipes. Each
+ * pipe takes two descriptors, so sizes which do not fit under
+ * ‹RLIMIT_NOFILE› are skipped. */
+
+#ifndef COLLECT_BENCH_MAX
+#define COLLECT_BENCH_MAX 256
+#define COLLECT_BENCH_QUIET
+#endif
+
+static double elapsed( struct timespec *start )
+{
+    struct timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    return end.tv_sec - start->tv_sec +
+           ( end.tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+static void bench( int n )
+{
+    int *fds_read = malloc( n * sizeof( int ) );
+    int *fds_write = malloc( n * sizeof( int ) );
+    int *sizes = malloc( n * sizeof( int ) );
+    char **buffers = malloc( n * sizeof( char * ) );
+    char sink[ 1 ];
+    const int rounds = 2000;
+    struct timespec start;
+    double took[ 2 ];
+
+    if ( !fds_read || !fds_write || !sizes || !buffers )
+        err( 1, "malloc" );
+
+    open_pipes( n, fds_read, fds_write );
+
+    for ( int engine = 0; engine < 2; ++engine )
+    {
+        void *c = engine ? collect_init( n, fds_read ) : NULL;
+        assert( !engine || c );
+        clock_gettime( CLOCK_MONOTONIC, &start );
+
+        for ( int r = 0; r < rounds; ++r )
+        {
+            int i = ( r * 7919 ) % n;
+            buffers[ i ] = sink;
+            sizes[ i ] = 1;
+            write_or_die( fds_write[ i ], "x", 1 );
+
+            int got = engine ? collect_next( c, buffers, sizes, 0 )
+                             : collect( n, fds_read, buffers, sizes, 0 );
+            assert( got == i );
+            assert( sizes[ i ] == 0 );
+        }
+
+        took[ engine ] = elapsed( &start );
+
+        if ( engine )
+            assert( collect_fini( c ) == 0 );
+    }
+
+#ifndef COLLECT_BENCH_QUIET
+    dprintf( 2, "%5d pipes: poll %7.2f µs, epoll %7.2f µs per call\n",
+             n, took[ 0 ] * 1e6 / rounds, took[ 1 ] * 1e6 / rounds );
+#else
+    ( void ) took;
+#endif
+
+    close_pipes( n, fds_read, fds_write );
+    free( fds_read );
+    free( fds_write );
+    free( sizes );
+    free( buffers );
+}
+
 int main()
 {
     char buffer[ 512 ] = { 0 };
@@ -161,5 +500,16 @@ int main()
         close( fds_write[ i ] );
     }
 
+    test_engine();
+
+    struct rlimit nofile;
+    if ( getrlimit( RLIMIT_NOFILE, &nofile ) == -1 )
+        err( 1, "getrlimit" );
+
+    for ( int n = 16; n <= COLLECT_BENCH_MAX; n *= 4 )
+        if ( nofile.rlim_cur == RLIM_INFINITY ||
+             2 * ( rlim_t ) n + 16 <= nofile.rlim_cur )
+            bench( n );
+
     return 0;
 }
@@ -2,10 +2,11 @@
 
 #include <fcntl.h>      /* open */
 #include <sys/mman.h>   /* mmap, munmap */
-#include <stdlib.h>     /* malloc, free, NULL */
-#include <unistd.h>     /* write, lseek */
+#include <stdlib.h>     /* malloc, calloc, free, NULL */
+#include <unistd.h>     /* write, lseek, sysconf */
 #include <stdint.h>     /* uint32_t, UINT32_MAX */
 #include <arpa/inet.h>  /* ntohl, htonl */
+#include <pthread.h>    /* pthread_create, pthread_join */
 #include <assert.h>
 #include <err.h>
 
@@ -159,6 +160,293 @@ int mode(int fd, int record_size, int value_index,
     return retcode;
 }
 
+/* Tabulka se zřetězenými seznamy je jednoduchá, ale pro velké
+ * soubory pomalá: každý nový klíč znamená volání ‹malloc› a každé
+ * vyhledání prochází seznam ukazatelů, jejichž cíle leží v paměti
+ * kdekoliv. Ukážeme si proto ještě paralelní verzi: mapování
+ * rozdělíme na souvislé úseky záznamů, každé vlákno spočítá výskyty
+ * ve svém úseku do vlastní tabulky (vlákna tak nemusí nic
+ * synchronizovat) a tabulky nakonec sečteme.
+ *
+ * Tabulky vláken používají otevřenou adresaci s lineárním
+ * zkoušením: klíče i počítadla leží přímo v jednom poli, kolizní
+ * klíč se uloží do nejbližšího dalšího volného místa a vyhledání tak
+ * obvykle skončí v téže řádce cache. Volné místo poznáme podle
+ * nulového počítadla. Tabulka je zaplněna nejvýše z poloviny,
+ * jinak ji zvětšíme na dvojnásobek. */
+
+#define MODE_MAX_THREADS 16
+#define MODE_PAR_MIN     65536      /* menší soubory počítá jedno vlákno */
+
+struct count_slot {
+    uint32_t value;
+    uint64_t count;                 /* 0 = volné místo */
+};
+
+struct count_table {
+    struct count_slot *slots;
+    size_t mask, used;              /* velikost je ‹mask + 1› */
+};
+
+static size_t count_hash(uint32_t value) {
+    value ^= value >> 16;
+    value *= 0x85ebca6b;
+    value ^= value >> 13;
+    value *= 0xc2b2ae35;
+    return value ^ (value >> 16);
+}
+
+static int count_init(struct count_table *t, size_t size) {
+    t->mask = size - 1;
+    t->used = 0;
+    t->slots = calloc(size, sizeof(struct count_slot));
+    return t->slots ? 0 : -1;
+}
+
+static int count_add(struct count_table *t, uint32_t value, uint64_t n);
+
+static int count_grow(struct count_table *t) {
+    struct count_table bigger;
+
+    if (count_init(&bigger, 2 * (t->mask + 1)) == -1)
+        return -1;
+
+    for (size_t i = 0; i <= t->mask; ++i)
+        if (t->slots[i].count)
+            count_add(&bigger, t->slots[i].value, t->slots[i].count);
+
+    free(t->slots);
+    *t = bigger;
+    return 0;
+}
+
+/* Přičte ‹n› výskytů hodnoty ‹value›; vrátí -1 selže-li alokace. */
+
+static int count_add(struct count_table *t, uint32_t value, uint64_t n) {
+    size_t i = count_hash(value) & t->mask;
+
+    while (t->slots[i].count && t->slots[i].value != value)
+        i = (i + 1) & t->mask;
+
+    if (!t->slots[i].count) {
+        if (2 * (t->used + 1) > t->mask + 1) {
+            if (count_grow(t) == -1)
+                return -1;
+            return count_add(t, value, n);
+        }
+        t->slots[i].value = value;
+        ++t->used;
+    }
+
+    t->slots[i].count += n;
+    return 0;
+}
+
+struct count_part {
+    const uint32_t *base;
+    size_t first, last;             /* rozsah záznamů */
+    int record_size, value_index;
+    struct count_table table;
+    int rv;
+    pthread_t tid;
+};
+
+static void *count_part(void *arg) {
+    struct count_part *part = arg;
+    const uint32_t *base = part->base;
+    size_t step = part->record_size;
+
+    part->rv = count_init(&part->table, 1024);
+
+    for (size_t r = part->first; part->rv == 0 && r < part->last; ++r)
+        part->rv = count_add(&part->table,
+                             ntohl(base[r * step + part->value_index]), 1);
+
+    return NULL;
+}
+
+/* Spočítá výskyty všech hodnot do tabulky ‹out›; soubor rozdělí
+ * mezi nejvýše tolik vláken, kolik je procesorů. */
+
+static int count_values(int fd, int record_size, int value_index,
+                        struct count_table *out) {
+    if (record_size <= 0 || value_index < 0 || value_index >= record_size)
+        return -1;
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    size_t record_bytes = 4 * (size_t) record_size;
+
+    if (size == -1 || size % record_bytes != 0)
+        return -1;
+    if (size == 0)
+        return count_init(out, 16);
+
+    uint32_t *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    size_t records = size / record_bytes;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nparts = records < MODE_PAR_MIN || cpus < 2 ? 1 :
+                 cpus < MODE_MAX_THREADS ? cpus : MODE_MAX_THREADS;
+    struct count_part parts[MODE_MAX_THREADS];
+    int started = 1, retcode = -1;
+
+    for (int i = 0; i < nparts; ++i)
+        parts[i] = (struct count_part) {
+            .base = base, .record_size = record_size,
+            .value_index = value_index,
+            .first = records / nparts * i,
+            .last = i == nparts - 1 ? records : records / nparts * (i + 1)
+        };
+
+    /* první úsek (a ty, pro které se nepodaří spustit vlákno)
+     * zpracujeme sami */
+
+    while (started < nparts &&
+           pthread_create(&parts[started].tid, NULL, count_part,
+                          parts + started) == 0)
+        ++started;
+
+    for (int i = started; i < nparts; ++i)
+        count_part(parts + i);
+    count_part(parts);
+
+    for (int i = 1; i < started; ++i)
+        pthread_join(parts[i].tid, NULL);
+
+    /* tabulky sečteme do tabulky prvního úseku */
+
+    retcode = parts[0].rv;
+
+    for (int i = 1; i < nparts; ++i) {
+        struct count_table *t = &parts[i].table;
+
+        for (size_t j = 0; retcode == 0 && parts[i].rv == 0 &&
+                           j <= t->mask; ++j)
+            if (t->slots[j].count)
+                retcode = count_add(&parts[0].table, t->slots[j].value,
+                                    t->slots[j].count);
+
+        if (parts[i].rv != 0)
+            retcode = -1;
+        free(t->slots);
+    }
+
+    if (retcode == 0)
+        *out = parts[0].table;
+    else
+        free(parts[0].table.slots);
+
+    if (munmap(base, size) == -1)
+        warn("unmapping region %p", base);
+    return retcode;
+}
+
+/* Paralelní ‹mode› má stejné rozhraní i výsledek jako ten původní. */
+
+int mode_par(int fd, int record_size, int value_index,
+             uint32_t *result) {
+    struct count_table t;
+
+    if (count_values(fd, record_size, value_index, &t) == -1)
+        return -1;
+
+    *result = UINT32_MAX;
+    uint64_t max = 0;
+
+    for (size_t i = 0; i <= t.mask; ++i)
+        if (t.slots[i].count > max ||
+            (t.slots[i].count == max && max > 0 &&
+             t.slots[i].value < *result)) {
+            *result = t.slots[i].value;
+            max = t.slots[i].count;
+        }
+
+    free(t.slots);
+    return 0;
+}
+
+/* Varianta ‹mode_top› nalezne ‹k› nejčastějších hodnot a zapíše je
+ * do pole ‹top› seřazené sestupně podle počtu výskytů (stejně časté
+ * hodnoty vzestupně podle hodnoty). Vrátí počet zapsaných hodnot
+ * (méně než ‹k›, obsahuje-li soubor méně různých hodnot), nebo -1.
+ * Během průchodu tabulkou si kandidáty udržujeme v haldě, na jejímž
+ * vrcholu je nejhorší z nich – ten je také jediný, se kterým nový
+ * kandidát soupeří. */
+
+struct mode_entry {
+    uint32_t value;
+    uint64_t count;
+};
+
+static int mode_better(struct mode_entry a, struct mode_entry b) {
+    return a.count > b.count || (a.count == b.count && a.value < b.value);
+}
+
+static void mode_sift_down(struct mode_entry *heap, int n, int i) {
+    for (;;) {
+        int worst = i, l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < n && mode_better(heap[worst], heap[l]))
+            worst = l;
+        if (r < n && mode_better(heap[worst], heap[r]))
+            worst = r;
+        if (worst == i)
+            return;
+
+        struct mode_entry tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+int mode_top(int fd, int record_size, int value_index, int k,
+             struct mode_entry *top) {
+    struct count_table t;
+    int n = 0;
+
+    if (k < 0 || count_values(fd, record_size, value_index, &t) == -1)
+        return -1;
+
+    for (size_t i = 0; k > 0 && i <= t.mask; ++i) {
+        if (!t.slots[i].count)
+            continue;
+
+        struct mode_entry e = { t.slots[i].value, t.slots[i].count };
+
+        if (n < k) {
+            /* halda ještě není plná: nový prvek probublá nahoru */
+            int j = n++;
+            top[j] = e;
+            while (j > 0 && mode_better(top[(j - 1) / 2], top[j])) {
+                struct mode_entry tmp = top[j];
+                top[j] = top[(j - 1) / 2];
+                top[(j - 1) / 2] = tmp;
+                j = (j - 1) / 2;
+            }
+        } else if (mode_better(e, top[0])) {
+            top[0] = e;
+            mode_sift_down(top, n, 0);
+        }
+    }
+
+    /* z haldy postupně odebíráme nejhorší prvek a ukládáme jej na
+     * konec – výsledkem je pole seřazené od nejlepšího */
+
+    for (int end = n - 1; end > 0; --end) {
+        struct mode_entry tmp = top[0];
+        top[0] = top[end];
+        top[end] = tmp;
+        mode_sift_down(top, end, 0);
+    }
+
+    free(t.slots);
+    return n;
+}
+
 int main() /* demo */
 {
     const char *name = "zt.d1_data.bin";
@@ -192,8 +480,79 @@ int main() /* demo */
     assert(mode(fd, 8, 1, &result) == 0);
     assert(result == 1);
 
+    assert(mode_par(fd, 8, 0, &result) == 0);
+    assert(result == 7);
+    assert(mode_par(fd, 8, 1, &result) == 0);
+    assert(result == 1);
+
+    /* ve sloupci 1 jsou hodnoty 1 a 2 stejně časté, všechny ostatní
+     * se opakují právě 256krát */
+
+    struct mode_entry top[4];
+
+    assert(mode_top(fd, 8, 1, 4, top) == 4);
+    assert(top[0].value == 1 && top[0].count == 1024 * 256);
+    assert(top[1].value == 2 && top[1].count == 1024 * 256);
+    assert(top[2].count == 256 && top[3].count == 256);
+    assert(top[2].value < top[3].value);
+    assert(mode_top(fd, 8, 0, 1, top) == 1);
+    assert(top[0].value == 7 && top[0].count == 2048 * 256);
+    assert(mode_top(fd, 8, 8, 4, top) == -1);
+    assert(mode_par(fd, 3, 0, &result) == -1);
+
     if (close(fd) == -1)
         warn("closing %s", name);
 
+    /* náhodná data s nerovnoměrným rozdělením porovnáme s výsledkem
+     * spočítaným hrubou silou */
+
+    static uint32_t values[1 << 20];
+    static uint64_t counts[1000];
+    const char *rnd_name = "zt.d1_random.bin";
+
+    srand(152);
+    for (int i = 0; i < 1 << 20; ++i) {
+        uint32_t v = rand() % 1000 * (rand() % 1000) / 1000;
+        values[i] = htonl(v);
+        counts[v] += i % 2 == 1;
+    }
+
+    if ((fd = open(rnd_name, O_CREAT | O_TRUNC | O_RDWR, 0666)) == -1)
+        err(1, "creating file %s", rnd_name);
+    if (write(fd, values, sizeof values) != sizeof values)
+        err(1, "writing data into %s", rnd_name);
+
+    uint32_t best = 0;
+    for (uint32_t v = 1; v < 1000; ++v)
+        if (counts[v] > counts[best])
+            best = v;
+
+    assert(mode(fd, 2, 1, &result) == 0);
+    assert(result == best);
+    assert(mode_par(fd, 2, 1, &result) == 0);
+    assert(result == best);
+
+    struct mode_entry top10[10];
+    assert(mode_top(fd, 2, 1, 10, top10) == 10);
+    assert(top10[0].value == best);
+
+    /* před ‹i›-tou hodnotou je právě ‹i› hodnot lepších */
+
+    for (int i = 0; i < 10; ++i) {
+        int better = 0;
+
+        assert(top10[i].count == counts[top10[i].value]);
+        for (uint32_t v = 0; v < 1000; ++v)
+            better += counts[v] > 0 &&
+                      mode_better((struct mode_entry) { v, counts[v] },
+                                  top10[i]);
+        assert(better == i);
+    }
+
+    if (close(fd) == -1)
+        warn("closing %s", rnd_name);
+    if (unlink(rnd_name) == -1)
+        warn("unlinking %s", rnd_name);
+
     return 0;
 }
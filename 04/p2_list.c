@@ -1,9 +1,18 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* madvise */
 
 #include <assert.h>     /* assert */
 #include <err.h>        /* err, warn */
-#include <unistd.h>     /* close, write, unlink */
+#include <unistd.h>     /* close, write, unlink, sysconf */
 #include <fcntl.h>      /* open, O_RWDR, O_CREAT, O_TRUNC */
+#include <stdint.h>     /* int32_t, uint64_t */
+#include <stdlib.h>     /* calloc, free */
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>   /* fstat */
+#include <sys/mman.h>   /* mmap, munmap, madvise */
 
 /* V tomto cvičení je Vaším úkolem zpracovat soubor, ve kterém jsou
  * uloženy záznamy pevné velikosti. Každý záznam obsahuje odkaz na
@@ -33,7 +42,184 @@
  * velké množství malých záznamů. Bez ohledu na obsah souboru musí
  * výpočet skončit (podprogram se nesmí zacyklit). */
 
-int check_list( int fd, int rec_size );
+/* The check takes two passes over the mapped file.
+ *
+ * The first pass looks at every record on its own: the link must be
+ * zero (only one record may have that – the end of the list), or it
+ * must point at the start of a record other than the first one. The
+ * records which are pointed at are marked in a bitset (one bit per
+ * record); finding a record marked already means it is referenced
+ * twice. Large files are split between threads, which mark the
+ * shared bitset with atomic ‹or›.
+ *
+ * After this pass, every record but the first is referenced at most
+ * once, and there are exactly as many links as records other than the
+ * first, so each of those is referenced exactly once. Following the
+ * links from the first record therefore cannot visit a record twice
+ * (it would need a second reference) and has to stop at the end
+ * record; the file is a single list exactly if this walk visits all
+ * the records. Anything else (cycles, which are the only thing that
+ * may remain) is left out of the walk, which thus takes at most n
+ * steps – no second bitset is needed to guarantee termination. The
+ * walk is a chain of dependent loads, so the next link is prefetched
+ * as soon as its address is known. */
+
+#define CL_PAR_MIN      (1 << 20)   /* records */
+#define CL_MAX_THREADS  16
+
+struct cl_pass {
+    const unsigned char *base;
+    size_t first, last, count, rec_size;
+    _Atomic uint64_t *referenced;
+    atomic_int *invalid;            /* shared by all parts */
+    atomic_size_t *ends;
+    bool shared;
+    pthread_t tid;
+};
+
+static int32_t cl_link(const unsigned char *base, size_t rec_size,
+                       size_t i) {
+    const unsigned char *p = base + i * rec_size + rec_size - 4;
+    return (int32_t) ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+                      (uint32_t) p[2] << 8 | p[3]);
+}
+
+static void *cl_first_pass(void *arg) {
+    struct cl_pass *pass = arg;
+    size_t ends = 0;
+
+    for (size_t i = pass->first; i < pass->last; ++i) {
+        if ((i & 0xffff) == 0 && atomic_load(pass->invalid)) {
+            return NULL;
+        }
+
+        int64_t offset = cl_link(pass->base, pass->rec_size, i);
+        if (offset == 0) {
+            ++ends;
+            continue;
+        }
+
+        int64_t target = (int64_t) i + offset / (int64_t) pass->rec_size;
+        if (offset % (int64_t) pass->rec_size != 0 || target <= 0 ||
+            target >= (int64_t) pass->count) {
+            atomic_store(pass->invalid, 1);
+            return NULL;
+        }
+
+        _Atomic uint64_t *word = pass->referenced + target / 64;
+        uint64_t bit = UINT64_C(1) << (target % 64), old;
+        if (pass->shared) {
+            old = atomic_fetch_or_explicit(word, bit, memory_order_relaxed);
+        } else {
+            old = atomic_load_explicit(word, memory_order_relaxed);
+            atomic_store_explicit(word, old | bit, memory_order_relaxed);
+        }
+        if (old & bit) {
+            atomic_store(pass->invalid, 1);
+            return NULL;
+        }
+    }
+
+    atomic_fetch_add(pass->ends, ends);
+    return NULL;
+}
+
+static bool cl_walk(const unsigned char *base, size_t rec_size,
+                    size_t count) {
+    size_t i = 0, visited = 1;
+    int64_t offset;
+
+    while ((offset = cl_link(base, rec_size, i)) != 0) {
+        i += offset / (int64_t) rec_size;
+#ifdef __GNUC__
+        __builtin_prefetch(base + i * rec_size + rec_size - 4);
+#endif
+        if (++visited > count) {
+            return false;       /* cannot happen after the first pass */
+        }
+    }
+
+    return visited == count;
+}
+
+int check_list( int fd, int rec_size ) {
+    struct stat st;
+
+    if (rec_size < 4) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    if (size == 0) {
+        return 0;
+    }
+    if (size % rec_size != 0) {
+        return 1;
+    }
+
+    size_t count = size / rec_size;
+    unsigned char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    _Atomic uint64_t *referenced = NULL;
+    int rv = -1;
+
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (!(referenced = calloc((count + 63) / 64, sizeof *referenced))) {
+        goto out;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nparts = count < CL_PAR_MIN || cpus < 2 ? 1 :
+                 cpus < CL_MAX_THREADS ? cpus : CL_MAX_THREADS;
+    struct cl_pass parts[CL_MAX_THREADS];
+    atomic_int invalid = 0;
+    atomic_size_t ends = 0;
+    int started = 1;
+
+    for (int i = 0; i < nparts; ++i) {
+        parts[i] = (struct cl_pass) {
+            .base = base, .count = count, .rec_size = rec_size,
+            .first = count / nparts * i,
+            .last = i == nparts - 1 ? count : count / nparts * (i + 1),
+            .referenced = referenced, .invalid = &invalid, .ends = &ends,
+            .shared = nparts > 1
+        };
+    }
+
+    /* part 0 is done by this thread, as are those for which a thread
+     * could not be started */
+    while (started < nparts &&
+           pthread_create(&parts[started].tid, NULL, cl_first_pass,
+                          parts + started) == 0) {
+        ++started;
+    }
+    for (int i = started; i < nparts; ++i) {
+        cl_first_pass(parts + i);
+    }
+    cl_first_pass(parts);
+    for (int i = 1; i < started; ++i) {
+        pthread_join(parts[i].tid, NULL);
+    }
+
+    if (atomic_load(&invalid) || atomic_load(&ends) != 1) {
+        rv = 1;
+    } else {
+        madvise(base, size, MADV_RANDOM);
+        rv = cl_walk(base, rec_size, count) ? 0 : 1;
+    }
+out:
+    free(referenced);
+    if (munmap(base, size) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -55,6 +241,47 @@ int check( int rec_size, size_t file_size, const char *data )
     return rv;
 }
 
+static void set_link( unsigned char *data, int rec_size, size_t from,
+                      size_t to )
+{
+    int32_t offset = ( ( int64_t ) to - ( int64_t ) from ) * rec_size;
+    unsigned char *p = data + from * rec_size + rec_size - 4;
+
+    p[ 0 ] = ( uint32_t ) offset >> 24;
+    p[ 1 ] = ( uint32_t ) offset >> 16;
+    p[ 2 ] = ( uint32_t ) offset >> 8;
+    p[ 3 ] = ( uint32_t ) offset;
+}
+
+/* A list of ‹count› records in random order, starting at record 0;
+ * ‹order› receives the order of records along the list. */
+
+static unsigned char *random_list( int rec_size, size_t count,
+                                   size_t *order )
+{
+    unsigned char *data = calloc( count, rec_size );
+
+    if ( !data )
+        err( 1, "calloc" );
+
+    for ( size_t i = 0; i < count; ++i )
+        order[ i ] = i;
+
+    for ( size_t i = count - 1; i > 1; --i )
+    {
+        size_t j = 1 + ( ( size_t ) rand() * RAND_MAX + rand() ) % i;
+        size_t tmp = order[ i ];
+        order[ i ] = order[ j ];
+        order[ j ] = tmp;
+    }
+
+    for ( size_t i = 0; i + 1 < count; ++i )
+        set_link( data, rec_size, order[ i ], order[ i + 1 ] );
+
+    set_link( data, rec_size, order[ count - 1 ], order[ count - 1 ] );
+    return data;
+}
+
 int main( void )
 {
     assert( 0 == check( 1024, 0, "" ) );
@@ -100,4 +327,34 @@ int main( void )
     assert( 1 == check( 7, 49, "fst\0\0\0\x2a" "lo1\0\0\0\7" "lo2\0\0\0\7"
                                "lo3\0\0\0\xe" "end\0\0\0\0"
                                "lo4\xff\xff\xff\xe4" "snd\xff\xff\xff\xf2" ) );
+
+    assert( -1 == check( 3, 6, "ab\0cd\0" ) );
+
+    // dlouhý seznam v náhodném pořadí
+    size_t count = 3 * 1024 * 1024;
+    size_t *order = malloc( count * sizeof *order );
+
+    if ( !order )
+        err( 1, "malloc" );
+
+    srand( 152 );
+    unsigned char *data = random_list( 8, count, order );
+    assert( 0 == check( 8, count * 8, ( const char * ) data ) );
+
+    // úsek ‹order[ 1000 .. 2000 ]› vyjmutý ze seznamu a uzavřený do cyklu
+    set_link( data, 8, order[ 999 ], order[ 2001 ] );
+    set_link( data, 8, order[ 2000 ], order[ 1000 ] );
+    assert( 1 == check( 8, count * 8, ( const char * ) data ) );
+
+    // záznam, na který vedou dva odkazy
+    set_link( data, 8, order[ 2000 ], order[ 2001 ] );
+    assert( 1 == check( 8, count * 8, ( const char * ) data ) );
+
+    // odkaz na první záznam
+    set_link( data, 8, order[ 999 ], order[ 1000 ] );
+    set_link( data, 8, order[ 2000 ], 0 );
+    assert( 1 == check( 8, count * 8, ( const char * ) data ) );
+
+    free( data );
+    free( order );
 }
@@ -5,9 +5,13 @@
 #include <sys/mman.h>   /* mmap, munmap */
 #include <stdint.h>     /* uint8_t */
 #include <string.h>     /* memset */
+#include <stdlib.h>     /* realloc, free */
+#include <stdbool.h>
+#include <sys/stat.h>   /* fstat */
 #include <stdio.h>      /* dprintf */
 #include <err.h>
 #include <assert.h>
+#include <time.h>       /* clock_gettime */
 
 /* Implementujte podprogram ‹flood_fill› s těmito parametry:
  *
@@ -29,8 +33,171 @@
  * příliš krátký), nebo -1 nastane-li při zpracování systémová
  * chyba. */
 
+/* The fill works with whole horizontal spans of pixels instead of
+ * single pixels. A seed (a pixel known to be inside the area) is
+ * extended to the left and to the right as far as the original colour
+ * goes, the span is filled with a single ‹memset›, and the rows above
+ * and below are scanned (only between the ends of the span) for runs
+ * of the original colour – each run becomes a new seed. Seeds are kept
+ * on a stack in the heap, so the depth of the search is only limited
+ * by memory; a seed which was filled in the meantime (runs may be
+ * found from both sides) is simply skipped.
+ *
+ * Finding the end of a run is a search for the first byte which is
+ * (or is not) equal to a given colour; with SSE2 (always available on
+ * x86-64) this is done 16 bytes at a time – spans are usually short,
+ * so wider vectors do not pay off. */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct flood_seed {
+    int x, y;
+};
+
+struct flood_stack {
+    struct flood_seed *seeds;
+    size_t count, capacity;
+};
+
+static int flood_push(struct flood_stack *s, int x, int y) {
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? 2 * s->capacity : 1024;
+        void *seeds = realloc(s->seeds, capacity * sizeof *s->seeds);
+        if (!seeds) {
+            return -1;
+        }
+        s->seeds = seeds;
+        s->capacity = capacity;
+    }
+    s->seeds[s->count++] = (struct flood_seed) { x, y };
+    return 0;
+}
+
+/* First ‹i› in [from, to) with ‹(row[i] == c) == equal›, or ‹to›. */
+static int span_find(const uint8_t *row, int from, int to, uint8_t c,
+                     bool equal) {
+    int i = from;
+#ifdef __SSE2__
+    const __m128i vc = _mm_set1_epi8((char) c);
+    unsigned flip = equal ? 0 : 0xffff;
+
+    for (; to - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < to && (row[i] == c) != equal) {
+        ++i;
+    }
+    return i;
+}
+
+/* Last ‹i› in [to, from] with ‹row[i] != c›, or ‹to - 1›. */
+static int span_find_left(const uint8_t *row, int from, int to, uint8_t c) {
+    int i = from;
+#ifdef __SSE2__
+    const __m128i vc = _mm_set1_epi8((char) c);
+
+    for (; i - to + 1 >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (row + i - 15));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) & 0xffff;
+        if (mask) {
+            return i - 15 + 31 - __builtin_clz(mask);
+        }
+    }
+#endif
+    while (i >= to && row[i] == c) {
+        --i;
+    }
+    return i;
+}
+
 int flood_fill( int fd, int offset, int w, int h,
-                int x, int y, int color );
+                int x, int y, int color ) {
+    struct stat st;
+    struct flood_stack stack = { NULL, 0, 0 };
+    uint8_t *map;
+    int rv = -1;
+
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (w <= 0 || h <= 0 || offset < 2 || x < 0 || x >= w || y < 0 ||
+        y >= h) {
+        return -2;
+    }
+
+    size_t stride = ((size_t) w + 3) & ~(size_t) 3;
+    size_t size = st.st_size;
+    if (size < 2 || size < (size_t) offset ||
+        (size - offset) / stride < (size_t) h) {
+        return -2;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (map[0] != 'B' || map[1] != 'M') {
+        rv = -2;
+        goto out;
+    }
+
+    uint8_t *pixels = map + offset;
+    uint8_t old = pixels[y * stride + x], new = color;
+
+    if (old == new) {
+        rv = 0;
+        goto out;
+    }
+    if (flood_push(&stack, x, y) == -1) {
+        goto out;
+    }
+
+    while (stack.count > 0) {
+        struct flood_seed seed = stack.seeds[--stack.count];
+        uint8_t *row = pixels + seed.y * stride;
+
+        if (row[seed.x] != old) {
+            continue;
+        }
+
+        int left = span_find_left(row, seed.x, 0, old) + 1;
+        int right = span_find(row, seed.x, w, old, false);
+        memset(row + left, new, right - left);
+
+        for (int dy = -1; dy <= 1; dy += 2) {
+            int ny = seed.y + dy;
+            if (ny < 0 || ny >= h) {
+                continue;
+            }
+            const uint8_t *next = pixels + ny * stride;
+            for (int i = left; i < right; ) {
+                i = span_find(next, i, right, old, true);
+                if (i == right) {
+                    break;
+                }
+                if (flood_push(&stack, i, ny) == -1) {
+                    goto out;
+                }
+                i = span_find(next, i, right, old, false);
+            }
+        }
+    }
+
+    rv = 0;
+out:
+    free(stack.seeds);
+    if (munmap(map, size) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -124,6 +291,76 @@ static int expect( int w, int h, int x, int y )
     return 32;
 }
 
+/* A worst case for span filling: the area is a snake which runs up
+ * and down through columns one pixel wide (‹vertical›), so that every
+ * span is a single pixel, or left and right through rows. Build with
+ * ‹-DFLOOD_BENCH_SIZE=20000› to time it on a 20000×20000 image. */
+
+#ifndef FLOOD_BENCH_SIZE
+#define FLOOD_BENCH_SIZE 2048
+#define FLOOD_BENCH_QUIET
+#endif
+
+static int is_wall( int n, int x, int y, int vertical )
+{
+    int along = vertical ? x : y, across = vertical ? y : x;
+
+    if ( along % 2 == 0 )
+        return 0;
+
+    return across != ( along % 4 == 1 ? n - 1 : 0 );
+}
+
+static void serpentine( int vertical )
+{
+    const char *file_name = "zt.p3_snake.bmp";
+    const int n = FLOOD_BENCH_SIZE;
+    int fd = mk_bmp( file_name, n, n );
+    int stride = ( n + 3 ) & ~3;
+    uint8_t *line = calloc( stride, 1 );
+    struct timespec start, end;
+
+    if ( !line )
+        err( 1, "calloc" );
+
+    for ( int y = 0; y < n; ++y )
+    {
+        for ( int x = 0; x < n; ++x )
+            line[ x ] = is_wall( n, x, y, vertical ) ? 255 : 0;
+        write_buffer( fd, ( const char * ) line, stride );
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    assert( flood_fill( fd, header_size, n, n, 0, 0, 7 ) == 0 );
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+#ifndef FLOOD_BENCH_QUIET
+    dprintf( 2, "%s snake %d×%d: %.3f s\n",
+             vertical ? "vertical" : "horizontal", n, n,
+             end.tv_sec - start.tv_sec +
+                 ( end.tv_nsec - start.tv_nsec ) / 1e9 );
+#endif
+
+    if ( lseek( fd, header_size, SEEK_SET ) == -1 )
+        err( 1, "lseek" );
+
+    for ( int y = 0; y < n; ++y )
+    {
+        if ( read( fd, line, stride ) != stride )
+            err( 1, "reading %s", file_name );
+
+        for ( int x = 0; x < n; ++x )
+            assert( line[ x ] == ( is_wall( n, x, y, vertical ) ? 255 : 7 ) );
+    }
+
+    free( line );
+
+    if ( close( fd ) == -1 )
+        warn( "closing %s", file_name );
+    if ( unlink( file_name ) == -1 )
+        warn( "unlinking %s", file_name );
+}
+
 int main( void )
 {
     const char *file_name = "zt.p3_square.bmp";
@@ -174,8 +411,30 @@ int main( void )
         }
     }
 
+    /* the colour of the area itself is nothing to do */
+    assert( flood_fill( fd, header_size, width, height,
+                        width / 2, height / 2, 64 ) == 0 );
+
+    /* bad coordinates, a file which is too short or is not a BMP */
+    assert( flood_fill( fd, header_size, width, height,
+                        width, 0, 1 ) == -2 );
+    assert( flood_fill( fd, header_size, width, height + 1,
+                        0, 0, 1 ) == -2 );
+
     if ( close( fd ) == -1 )
         warn( "closing %s", file_name );
 
+    fd = create_file( "zt.p3_bad.bmp" );
+    write_buffer( fd, "XM\0\0\0\0\0\0", 8 );
+    assert( flood_fill( fd, 4, 2, 1, 0, 0, 1 ) == -2 );
+    assert( flood_fill( fd, 4, 5, 1, 0, 0, 1 ) == -2 );
+    if ( close( fd ) == -1 )
+        warn( "closing zt.p3_bad.bmp" );
+    if ( unlink( "zt.p3_bad.bmp" ) == -1 )
+        warn( "unlinking zt.p3_bad.bmp" );
+
+    serpentine( 1 );
+    serpentine( 0 );
+
     return 0;
 }
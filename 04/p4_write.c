@@ -4,6 +4,9 @@
 #include <errno.h>          /* errno */
 #include <unistd.h>         /* read, write, fork, close */
 #include <poll.h>
+#include <sys/uio.h>        /* writev */
+#include <stdlib.h>         /* malloc, free */
+#include <string.h>         /* memcpy */
 #include <err.h>
 
 /* Na rozdíl od čtení, při blokujícím zápisu do socketu nebo roury
@@ -28,12 +31,133 @@
  * Výsledkem nechť je počet skutečně přečtených bajtů, nebo -1
  * v případě, že při zápisu došlo k fatální systémové chybě. */
 
-int write_buffer( int fd, const char *buffer, int nbytes );
-
 /* ¹ Na rozdíl od analogické konstrukce pro operaci ‹read› zde
  *   nevzniká přímé riziko uváznutí. To ale neznamená, že tento
  *   de-facto blokující zápis není bez rizik. */
 
+/* When the descriptor is not ready, the process waits in ‹poll› for
+ * it to become writable, instead of retrying right away. */
+
+static int write_wait(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write all of ‹iov› (which is updated as it goes). */
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t wrote = writev(fd, iov, count);
+        if (wrote == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                write_wait(fd) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        while (count > 0 && (size_t) wrote >= iov->iov_len) {
+            wrote -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + wrote;
+            iov->iov_len -= wrote;
+        }
+    }
+    return 0;
+}
+
+int write_buffer( int fd, const char *buffer, int nbytes ) {
+    if (nbytes < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iovec iov = { (void *) buffer, nbytes };
+    return write_all(fd, &iov, nbytes > 0) == -1 ? -1 : nbytes;
+}
+
+/* Many small writes (a length, a 1-byte acknowledgement, …) are
+ * better collected in memory and sent together. A ‹wstream› does
+ * that:
+ *
+ *  • ‹wstream_init› creates a stream writing to ‹fd› (which it does
+ *    not own) with a buffer of ‹capacity› bytes,
+ *  • ‹wstream_write› copies data into the buffer if they fit; if they
+ *    do not, the buffer and the new data are sent together with a
+ *    single ‹writev› (as ‹write_buffer› does, waiting if needed), so
+ *    large writes are never copied,
+ *  • ‹wstream_flush› sends whatever is buffered – it is up to the
+ *    caller to flush before waiting for a reply,
+ *  • ‹wstream_fini› flushes and frees the stream.
+ *
+ * All return 0 (‹wstream_write› the number of bytes) on success and
+ * -1 on error, after which it is unknown how much of the data was
+ * sent. */
+
+struct wstream {
+    int fd;
+    size_t used, capacity;
+    char buffer[];
+};
+
+void *wstream_init(int fd, int capacity) {
+    if (capacity <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct wstream *s = malloc(sizeof *s + capacity);
+    if (!s) {
+        return NULL;
+    }
+    s->fd = fd;
+    s->used = 0;
+    s->capacity = capacity;
+    return s;
+}
+
+int wstream_write(void *handle, const char *data, int nbytes) {
+    struct wstream *s = handle;
+
+    if (nbytes < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->capacity - s->used >= (size_t) nbytes) {
+        memcpy(s->buffer + s->used, data, nbytes);
+        s->used += nbytes;
+        return nbytes;
+    }
+
+    struct iovec iov[2] = { { s->buffer, s->used },
+                            { (void *) data, nbytes } };
+    int first = s->used == 0;
+    s->used = 0;
+    return write_all(s->fd, iov + first, 2 - first) == -1 ? -1 : nbytes;
+}
+
+int wstream_flush(void *handle) {
+    struct wstream *s = handle;
+    struct iovec iov = { s->buffer, s->used };
+    int count = s->used > 0;
+    s->used = 0;
+    return write_all(s->fd, &iov, count);
+}
+
+int wstream_fini(void *handle) {
+    int rv = wstream_flush(handle);
+    free(handle);
+    return rv;
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <sys/wait.h>
@@ -102,6 +226,91 @@ static void reader( int reader_fd, int writer_fd )
     close( reader_fd );
 }
 
+/* Messages of a 4-byte length and that many bytes, with an occasional
+ * message larger than the buffer of the stream. */
+
+enum { messages = 50000, big_size = 10000 };
+
+static int message_size( int i )
+{
+    return i % 1000 == 999 ? big_size : ( i * 7919 ) % 101;
+}
+
+static void message_reader( int fd )
+{
+    char buffer[ big_size ];
+
+    for ( int i = 0; i < messages; ++i )
+    {
+        int size, got = 0;
+
+        while ( got < 4 )
+            got += read_or_die( fd, ( char * ) &size + got, 4 - got );
+
+        assert( size == message_size( i ) );
+
+        for ( got = 0; got < size; )
+        {
+            int bytes = read_or_die( fd, buffer + got, size - got );
+            assert( bytes > 0 );
+            got += bytes;
+        }
+
+        for ( int j = 0; j < size; ++j )
+            assert( buffer[ j ] == ( char )( j % 251 ) );
+    }
+
+    assert( read_or_die( fd, buffer, 1 ) == 0 );
+}
+
+static void test_stream( void )
+{
+    int fds[ 2 ];
+
+    if ( pipe( fds ) == -1 )
+        err( 1, "pipe" );
+
+    if ( fcntl( fds[ 1 ], F_SETFL, O_NONBLOCK ) != 0 )
+        err( 1, "setting O_NONBLOCK on fd %d", fds[ 1 ] );
+
+    int reader_pid = fork();
+
+    if ( reader_pid == -1 )
+        err( 1, "fork" );
+
+    if ( reader_pid == 0 )
+    {
+        close_or_warn( fds[ 1 ], "writer end of a pipe" );
+        message_reader( fds[ 0 ] );
+        exit( 0 );
+    }
+
+    close_or_warn( fds[ 0 ], "reader end of a pipe" );
+
+    char data[ big_size ];
+    void *s = wstream_init( fds[ 1 ], 4096 );
+
+    assert( s );
+    assert( !wstream_init( fds[ 1 ], 0 ) );
+
+    for ( int i = 0; i < big_size; ++i )
+        data[ i ] = i % 251;
+
+    for ( int i = 0; i < messages; ++i )
+    {
+        int size = message_size( i );
+        assert( wstream_write( s, ( char * ) &size, 4 ) == 4 );
+        assert( wstream_write( s, data, size ) == size );
+
+        if ( i % 5000 == 0 )
+            assert( wstream_flush( s ) == 0 );
+    }
+
+    assert( wstream_fini( s ) == 0 );
+    close_or_warn( fds[ 1 ], "writer end of a pipe" );
+    assert( reap( reader_pid ) == 0 );
+}
+
 int main()
 {
     int fds[ 2 ];
@@ -157,7 +366,12 @@ int main()
     assert( write_buffer( reader_fd, buffer, 4 ) == -1 );
     assert( errno == EBADF );
 
+    assert( write_buffer( fd_rdonly, buffer, -1 ) == -1 );
+    assert( errno == EINVAL );
+
     close_or_warn( fd_rdonly, "/dev/null" );
 
+    test_stream();
+
     return 0;
 }
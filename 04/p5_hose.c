@@ -7,6 +7,9 @@
 #include <assert.h>     /* assert */
 #include <string.h>     /* memcmp */
 #include <errno.h>      /* errno */
+#include <poll.h>       /* poll */
+#include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+#include <stdint.h>     /* uint64_t */
 
 /* Uvažme situaci analogickou k přípravě ‹p4_collect›, ale se
  * zápisem – naprogramujte podprogram ‹hose›, který obdrží:
@@ -33,7 +36,220 @@
  * ¹ Je zaručeno, že všechny vstupní popisovače budou mít nastavený
  *   příznak ‹O_NONBLOCK›. */
 
-int hose( int count, int* fds, char** buffers, int* sizes );
+int hose( int count, int* fds, char** buffers, int* sizes ) {
+    struct pollfd *pfds = malloc((count ? count : 1) * sizeof *pfds);
+    int waiting = 0, failed = 0, rv = 0;
+
+    if (!pfds) {
+        return -1;
+    }
+
+    /* Descriptors without data are skipped by poll (negative fd). */
+    for (int i = 0; i < count; ++i) {
+        pfds[i].fd = sizes[i] > 0 ? fds[i] : -1;
+        pfds[i].events = POLLOUT;
+        waiting += sizes[i] > 0;
+    }
+    if (waiting == 0) {
+        goto out;
+    }
+    if (poll(pfds, count, -1) == -1) {
+        rv = -1;
+        goto out;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (sizes[i] == 0) {
+            continue;
+        }
+        if (!pfds[i].revents) {
+            ++rv;
+            continue;
+        }
+        ssize_t wrote = write(fds[i], buffers[i], sizes[i]);
+        if (wrote == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ++rv;
+        } else if (wrote == -1) {
+            failed = 1;
+        } else {
+            buffers[i] += wrote;
+            sizes[i] -= wrote;
+        }
+    }
+    if (failed) {
+        rv = -1;
+    }
+out:
+    free(pfds);
+    return rv;
+}
+
+/* The same with descriptors registered in an edge-triggered ‹epoll›
+ * instance between calls (cf. ‹collect_init› in ‹p4_collect›): with
+ * many descriptors, ‹poll› makes the kernel check each of them on
+ * every call. ‹hose_init› takes descriptors which must be distinct,
+ * ‹hose_next› has the semantics of ‹hose›, ‹hose_fini› frees the
+ * engine (it does not close the descriptors).
+ *
+ * The engine keeps a list of the descriptors which are writable (all
+ * of them at first). A descriptor leaves the list when a write fails
+ * with ‹EAGAIN› or is short (for pipes and other streams, that means
+ * the buffer is full), and ‹epoll_wait› puts it back on an ‹EPOLLOUT›
+ * edge; a bitmap says which descriptors are on the list, so that
+ * none is there twice. Only the list is walked to write, hence
+ * descriptors which are full cost nothing until they drain. The
+ * sizes belong to the caller and may change between calls, so the
+ * count of descriptors still waiting is one pass over them – but
+ * with no system calls and no per-descriptor state. The list, the
+ * bitmap and the event array share one allocation with the engine. */
+
+#define HOSE_EVENTS 256
+
+struct hose_engine {
+    int epfd, count, nready;
+    int *ready;                 /* indices of writable descriptors */
+    uint64_t *listed;           /* which indices are on ‹ready› */
+    struct epoll_event *events;
+    int *fds;
+};
+
+void *hose_init(int count, int *fds) {
+    if (count < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t words = ((size_t) count + 63) / 64;
+    size_t size = sizeof(struct hose_engine) + words * sizeof(uint64_t) +
+                  HOSE_EVENTS * sizeof(struct epoll_event) +
+                  2 * (size_t) count * sizeof(int);
+    struct hose_engine *h = calloc(1, size);
+    if (!h) {
+        return NULL;
+    }
+
+    h->count = h->nready = count;
+    h->listed = (uint64_t *) (h + 1);
+    h->events = (struct epoll_event *) (h->listed + words);
+    h->fds = (int *) (h->events + HOSE_EVENTS);
+    h->ready = h->fds + count;
+    memcpy(h->fds, fds, count * sizeof(int));
+    memset(h->listed, 0xff, words * sizeof(uint64_t));
+    for (int i = 0; i < count; ++i) {
+        h->ready[i] = i;
+    }
+
+    if ((h->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        free(h);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLET,
+                                  .data.u32 = i };
+        if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            int saved = errno;
+            close(h->epfd);
+            free(h);
+            errno = saved;
+            return NULL;
+        }
+    }
+    return h;
+}
+
+static int hose_harvest(struct hose_engine *h, int timeout) {
+    int n;
+    do {
+        if ((n = epoll_wait(h->epfd, h->events, HOSE_EVENTS,
+                            timeout)) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint32_t idx = h->events[i].data.u32;
+            uint64_t bit = UINT64_C(1) << idx % 64;
+            if (!(h->listed[idx / 64] & bit)) {
+                h->listed[idx / 64] |= bit;
+                h->ready[h->nready++] = idx;
+            }
+        }
+        timeout = 0;
+    } while (n == HOSE_EVENTS);
+    return 0;
+}
+
+/* Drop the ‹k›-th entry of the ready list (the last one takes its
+ * place, the order does not matter). */
+static void hose_unlist(struct hose_engine *h, int k) {
+    int i = h->ready[k];
+    h->listed[i / 64] &= ~(UINT64_C(1) << i % 64);
+    h->ready[k] = h->ready[--h->nready];
+}
+
+int hose_next(void *handle, char **buffers, int *sizes) {
+    struct hose_engine *h = handle;
+
+    if (hose_harvest(h, 0) == -1) {
+        return -1;
+    }
+
+    for (;;) {
+        int waiting = 0, wrote_any = 0, short_writes = 0, failed = 0;
+
+        for (int k = 0; k < h->nready; ) {
+            int i = h->ready[k];
+            if (sizes[i] == 0) {
+                ++k;
+                continue;
+            }
+
+            ssize_t wrote = write(h->fds[i], buffers[i], sizes[i]);
+            if (wrote == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                hose_unlist(h, k);
+                continue;
+            }
+            if (wrote == -1) {
+                failed = 1;
+                ++k;
+                continue;
+            }
+            buffers[i] += wrote;
+            sizes[i] -= wrote;
+            wrote_any = 1;
+            if (sizes[i] > 0) {
+                hose_unlist(h, k);
+                ++short_writes;
+            } else {
+                ++k;
+            }
+        }
+
+        if (failed) {
+            return -1;
+        }
+
+        /* whatever is still on the list has nothing left to write;
+         * like in ‹hose›, a descriptor which was written to (if only
+         * partially) does not count as waiting */
+        for (int i = 0; i < h->count; ++i) {
+            waiting += sizes[i] > 0;
+        }
+        waiting -= short_writes;
+        if (wrote_any || waiting == 0) {
+            return waiting;
+        }
+        if (hose_harvest(h, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+int hose_fini(void *handle) {
+    struct hose_engine *h = handle;
+    int rv = close(h->epfd);
+    free(h);
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -91,6 +307,79 @@ static void mk_pipe( int *fd_read, int *fd_write )
         err( 1, "unable to set pipe flags" );
 }
 
+static void test_engine( void )
+{
+    enum { n = 256 };
+    static int fds_read[ n ], fds_write[ n ], sizes[ n ];
+    static char *buffers[ n ];
+    char data[ PIPE_BUF * 2 ], buffer[ PIPE_BUF * 2 ];
+
+    for ( int i = 0; i < PIPE_BUF * 2; ++i )
+        data[ i ] = 'a' + i % 26;
+
+    for ( int i = 0; i < n; ++i )
+    {
+        mk_pipe( fds_read + i, fds_write + i );
+        fill_or_die( fds_write[ i ], '0' );
+        buffers[ i ] = data;
+        sizes[ i ] = 0;
+    }
+
+    void *h = hose_init( n, fds_write );
+    assert( h );
+
+    /* nothing to write: returns at once */
+    assert( hose_next( h, buffers, sizes ) == 0 );
+
+    sizes[ 3 ] = sizes[ 100 ] = sizes[ 255 ] = 100;
+    drain_or_die( fds_read[ 100 ], '0' );
+    assert( hose_next( h, buffers, sizes ) == 2 );
+    assert( sizes[ 100 ] == 0 && buffers[ 100 ] == data + 100 );
+    read_or_die( fds_read[ 100 ], buffer, 100 );
+    assert( memcmp( buffer, data, 100 ) == 0 );
+
+    /* a pipe which became writable later is noticed */
+    drain_or_die( fds_read[ 255 ], '0' );
+    assert( hose_next( h, buffers, sizes ) == 1 );
+    assert( sizes[ 255 ] == 0 );
+
+    /* a partial write; the rest waits for the reader */
+    sizes[ 7 ] = PIPE_BUF * 2;
+    read_or_die( fds_read[ 7 ], buffer, PIPE_BUF );
+    assert( hose_next( h, buffers, sizes ) == 1 );
+    assert( sizes[ 7 ] == PIPE_BUF );
+
+    /* the rest of the filling, then the first half of the data */
+    do
+        read_or_die( fds_read[ 7 ], buffer, PIPE_BUF );
+    while ( buffer[ 0 ] == '0' );
+
+    assert( memcmp( buffer, data, PIPE_BUF ) == 0 );
+    assert( hose_next( h, buffers, sizes ) == 1 );
+    assert( sizes[ 7 ] == 0 );
+    read_or_die( fds_read[ 7 ], buffer, PIPE_BUF );
+    assert( memcmp( buffer, data + PIPE_BUF, PIPE_BUF ) == 0 );
+
+    /* the last pipe with data left gets room */
+    drain_or_die( fds_read[ 3 ], '0' );
+    assert( hose_next( h, buffers, sizes ) == 0 );
+    assert( sizes[ 3 ] == 0 );
+
+    assert( hose_fini( h ) == 0 );
+
+    /* the same descriptor twice is refused */
+    int saved = fds_write[ 1 ];
+    fds_write[ 1 ] = fds_write[ 0 ];
+    assert( !hose_init( 2, fds_write ) );
+    fds_write[ 1 ] = saved;
+
+    for ( int i = 0; i < n; ++i )
+    {
+        close( fds_read[ i ] );
+        close( fds_write[ i ] );
+    }
+}
+
 int main()
 {
     char buffer[ PIPE_BUF * 3 ] = { 0 };
@@ -161,5 +450,7 @@ int main()
     assert( hose( 3, fds_write, buffer_ptrs_b, sizes_b ) == 0 );
     assert( sizes_b[ 0 ] == 0 );
 
+    test_engine();
+
     return 0;
 }
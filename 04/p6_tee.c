@@ -1,9 +1,13 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <unistd.h>     /* read, write, pipe */
+#include <fcntl.h>      /* fcntl */
+#include <sys/uio.h>    /* writev */
 #include <assert.h>     /* assert */
-#include <string.h>     /* memcmp */
+#include <string.h>     /* memcmp, memcpy */
 #include <stdlib.h>     /* malloc */
+#include <stdint.h>     /* uint64_t, SIZE_MAX */
+#include <stdbool.h>
 #include <err.h>        /* err */
 #include <errno.h>
 
@@ -46,9 +50,268 @@
  *
  * Očekává se, že tee_fini zavře všechny popisovače předané tee_ini */
 
-void *tee_init( int fd_count, int *fds );
-int tee_write( void *handle, const char *data, int nbytes );
-int tee_fini( void *handle );
+/* All sinks share one ring buffer: data which could not be written
+ * to every sink right away is stored there exactly once, and each
+ * sink only keeps a cursor – an offset into the stream of all bytes
+ * ever passed to ‹tee_write›. The ring holds the part of the stream
+ * between the slowest cursor (‹tail›) and the end of the stream
+ * (‹head›); once the slowest sink writes some bytes, they are free.
+ *
+ * A write to one sink is a single ‹writev› of whatever it has
+ * pending in the ring (up to two pieces, because the buffered range
+ * may wrap around the end of the ring) followed by the new data, so
+ * sinks which are keeping up never touch the ring at all, and only
+ * the part of the new data which some sink did not accept is copied
+ * into it. Space for the new data is reserved before anything is
+ * written, hence a failed allocation leaves nothing half-sent.
+ *
+ * ‹tee_limit› sets a high-water mark for the amount of buffered data.
+ * If accepting new data would make the buffer grow past it,
+ * ‹tee_write› only flushes what it can and fails with ‹EAGAIN› – the
+ * caller should slow down and pass the same data again later. To
+ * make progress always possible, data is accepted into an empty
+ * buffer whatever its size. ‹tee_pending› tells how much is
+ * buffered. */
+
+#define TEE_RING_MIN  4096
+#define TEE_RING_KEEP ( 64 * 1024 )
+
+struct tee {
+    int count;
+    int *fds;
+    uint64_t *cursor;     /* per sink, absolute stream offsets */
+    uint64_t head, tail;  /* the stream range held in the ring */
+    char *ring;
+    size_t capacity;      /* a power of two, or 0 */
+    size_t high_water;
+};
+
+/* The ring slice [from, from + len), as at most two iovecs. */
+static int tee_slice(struct tee *t, uint64_t from, size_t len,
+                     struct iovec *iov) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t at = from & (t->capacity - 1);
+    size_t first = t->capacity - at < len ? t->capacity - at : len;
+    iov[0] = (struct iovec) { t->ring + at, first };
+    if (first == len) {
+        return 1;
+    }
+    iov[1] = (struct iovec) { t->ring, len - first };
+    return 2;
+}
+
+static void tee_put(char *ring, size_t capacity, uint64_t at,
+                    const char *data, size_t len) {
+    size_t i = at & (capacity - 1);
+    size_t first = capacity - i < len ? capacity - i : len;
+    memcpy(ring + i, data, first);
+    memcpy(ring, data + first, len - first);
+}
+
+/* Make room for ‹extra› more bytes past ‹head›. */
+static int tee_reserve(struct tee *t, size_t extra) {
+    size_t used = t->head - t->tail;
+    if (t->capacity - used >= extra) {
+        return 0;
+    }
+    if (extra > SIZE_MAX / 2 - used) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t capacity = t->capacity ? t->capacity : TEE_RING_MIN;
+    while (capacity < used + extra) {
+        capacity *= 2;
+    }
+
+    char *ring = malloc(capacity);
+    if (!ring) {
+        return -1;
+    }
+
+    struct iovec iov[2];
+    int n = tee_slice(t, t->tail, used, iov);
+    uint64_t at = t->tail;
+    for (int i = 0; i < n; ++i) {
+        tee_put(ring, capacity, at, iov[i].iov_base, iov[i].iov_len);
+        at += iov[i].iov_len;
+    }
+
+    free(t->ring);
+    t->ring = ring;
+    t->capacity = capacity;
+    return 0;
+}
+
+/* Write as much as the sink takes of its part of the ring, followed
+ * by ‹data›, where ‹data› continues the stream at ‹head›. */
+static int tee_push(struct tee *t, int i, const char *data, size_t len) {
+    struct iovec iov[3];
+    uint64_t from = t->cursor[i];
+    int n = tee_slice(t, from, t->head - from, iov);
+    if (len > 0) {
+        iov[n++] = (struct iovec) { (void *) data, len };
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    ssize_t wrote = writev(t->fds[i], iov, n);
+    if (wrote == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    t->cursor[i] += wrote;
+    return 0;
+}
+
+/* Drop what every sink has written and count the sinks behind. */
+static int tee_settle(struct tee *t, size_t len) {
+    int behind = 0;
+    uint64_t tail = t->head;
+
+    for (int i = 0; i < t->count; ++i) {
+        if (t->cursor[i] < tail) {
+            tail = t->cursor[i];
+        }
+        if (t->cursor[i] < t->head) {
+            ++behind;
+        }
+    }
+    t->tail = tail;
+
+    if (t->tail == t->head && t->capacity > TEE_RING_KEEP &&
+        t->capacity / 4 >= len) {
+        free(t->ring);
+        t->ring = NULL;
+        t->capacity = 0;
+    }
+    return behind;
+}
+
+static bool tee_over(struct tee *t, size_t len) {
+    size_t used = t->head - t->tail;
+    return used > 0 && (used > t->high_water || len > t->high_water - used);
+}
+
+void *tee_init( int fd_count, int *fds ) {
+    if (fd_count < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct tee *t = calloc(1, sizeof *t);
+    if (!t) {
+        return NULL;
+    }
+    t->count = fd_count;
+    t->high_water = SIZE_MAX;
+    t->fds = malloc((fd_count ? fd_count : 1) * sizeof *t->fds);
+    t->cursor = calloc(fd_count ? fd_count : 1, sizeof *t->cursor);
+    if (!t->fds || !t->cursor) {
+        goto fail;
+    }
+
+    for (int i = 0; i < fd_count; ++i) {
+        int flags = fcntl(fds[i], F_GETFL);
+        if (flags == -1 || fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            goto fail;
+        }
+        t->fds[i] = fds[i];
+    }
+    return t;
+
+fail:
+    free(t->fds);
+    free(t->cursor);
+    free(t);
+    return NULL;
+}
+
+int tee_limit(void *handle, size_t high_water) {
+    struct tee *t = handle;
+    t->high_water = high_water ? high_water : SIZE_MAX;
+    return 0;
+}
+
+size_t tee_pending(void *handle) {
+    struct tee *t = handle;
+    return t->head - t->tail;
+}
+
+int tee_write( void *handle, const char *data, int nbytes ) {
+    struct tee *t = handle;
+    size_t len = nbytes;
+
+    if (nbytes < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Over the limit, see first whether the sinks have caught up. */
+    if (tee_over(t, len)) {
+        for (int i = 0; i < t->count; ++i) {
+            tee_push(t, i, NULL, 0);
+        }
+        tee_settle(t, 0);
+        if (tee_over(t, len)) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    if (tee_reserve(t, len) == -1) {
+        return -1;
+    }
+
+    /* Errors on single sinks are not reported here: the sink stays
+     * behind and is retried on the next call. */
+    for (int i = 0; i < t->count; ++i) {
+        tee_push(t, i, data, len);
+    }
+
+    uint64_t head = t->head;
+    t->head += len;
+    int behind = tee_settle(t, len);
+    if (len > 0 && t->tail < t->head) {
+        uint64_t from = t->tail > head ? t->tail : head;
+        tee_put(t->ring, t->capacity, from, data + (from - head),
+                t->head - from);
+    }
+
+    return behind;
+}
+
+int tee_fini( void *handle ) {
+    struct tee *t = handle;
+    int rv = 0;
+
+    for (int i = 0; i < t->count; ++i) {
+        int flags = fcntl(t->fds[i], F_GETFL);
+        bool ok = flags != -1 &&
+                  fcntl(t->fds[i], F_SETFL, flags & ~O_NONBLOCK) != -1;
+
+        while (ok && t->cursor[i] < t->head) {
+            struct iovec iov[2];
+            int n = tee_slice(t, t->cursor[i], t->head - t->cursor[i], iov);
+            ssize_t wrote = writev(t->fds[i], iov, n);
+            if (wrote == -1 && errno != EINTR) {
+                ok = false;
+            } else if (wrote > 0) {
+                t->cursor[i] += wrote;
+            }
+        }
+        if (close(t->fds[i]) == -1 || !ok) {
+            rv = -1;
+        }
+    }
+
+    free(t->ring);
+    free(t->fds);
+    free(t->cursor);
+    free(t);
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -80,6 +343,41 @@ static void drain( int fd, int byte )
         drain( fd, byte );
 }
 
+static void open_pipes( int count, int *fds_read, int *fds_write )
+{
+    for ( int i = 0; i < count; i++ )
+    {
+        int p[ 2 ];
+
+        if ( pipe( p ) != 0 )
+            err( 1, "unable to open pipes" );
+
+        fds_read[ i ] = p[ 0 ];
+        fds_write[ i ] = p[ 1 ];
+    }
+}
+
+static int stream_byte( long offset )
+{
+    return ( char )( offset % 251 );
+}
+
+/* Read whatever is available from a (non-blocking) pipe and check
+ * that it continues the stream at ‹*offset›. */
+static int take( int fd, long *offset, int limit )
+{
+    char buffer[ 4096 ];
+    int readb = read( fd, buffer, limit < 4096 ? limit : 4096 );
+
+    if ( readb == -1 && errno != EAGAIN )
+        err( 1, "reading a pipe" );
+
+    for ( int i = 0; i < readb; ++i )
+        assert( buffer[ i ] == stream_byte( ( *offset )++ ) );
+
+    return readb;
+}
+
 int main()
 {
     char buffer[ 256 ];
@@ -177,4 +475,113 @@ int main()
         assert( read( fds_read[ i ], buffer, 100 ) == 3 );
         assert( memcmp( buffer, "sed", 3 ) == 0 );
     }
+
+    for ( int i = 0; i < 3; i++ )
+        close( fds_read[ i ] );
+
+    /* high-water mark: data which would make the buffer grow past
+     * the limit is refused and can be passed again later */
+
+    char chunk[ 3000 ];
+    long offset[ 8 ] = { 0 }, sent = 0;
+
+    open_pipes( 2, fds_read, fds_write );
+    h = tee_init( 2, fds_write );
+    assert( h );
+    assert( tee_limit( h, 4096 ) == 0 );
+    fill( fds_write[ 1 ], 0 );
+
+    for ( int i = 0; i < 3000; ++i )
+        chunk[ i ] = stream_byte( i );
+
+    assert( tee_write( h, chunk, 3000 ) == 1 );
+    assert( tee_pending( h ) == 3000 );
+    take( fds_read[ 0 ], offset, 4096 );
+    assert( offset[ 0 ] == 3000 );
+
+    for ( int i = 0; i < 3000; ++i )
+        chunk[ i ] = stream_byte( 3000 + i );
+
+    errno = 0;
+    assert( tee_write( h, chunk, 2000 ) == -1 );
+    assert( errno == EAGAIN );
+    assert( tee_pending( h ) == 3000 );
+    drain( fds_read[ 1 ], 0 );
+
+    assert( tee_write( h, chunk, 2000 ) == 0 );
+    assert( tee_pending( h ) == 0 );
+
+    for ( int i = 0; i < 2; i++ )
+    {
+        int flags = fcntl( fds_read[ i ], F_GETFL );
+        fcntl( fds_read[ i ], F_SETFL, flags | O_NONBLOCK );
+        while ( take( fds_read[ i ], offset + i, 4096 ) > 0 )
+            continue;
+        assert( offset[ i ] == 5000 );
+    }
+
+    assert( tee_fini( h ) == 0 );
+
+    for ( int i = 0; i < 2; i++ )
+        close( fds_read[ i ] );
+
+    /* a stream fanned out to sinks which drain at different speeds;
+     * the buffer only holds what the slowest sink still lacks */
+
+    int fan_read[ 8 ], fan_write[ 8 ];
+    open_pipes( 8, fan_read, fan_write );
+    h = tee_init( 8, fan_write );
+    assert( h );
+
+    for ( int i = 0; i < 8; i++ )
+    {
+        int flags = fcntl( fan_read[ i ], F_GETFL );
+        fcntl( fan_read[ i ], F_SETFL, flags | O_NONBLOCK );
+        offset[ i ] = 0;
+    }
+
+    unsigned seed = 1;
+
+    for ( int round = 0; round < 2000; ++round )
+    {
+        seed = seed * 1103515245 + 12345;
+        int size = seed % 3000 + 1;
+
+        for ( int i = 0; i < size; ++i )
+            chunk[ i ] = stream_byte( sent + i );
+
+        int behind = tee_write( h, chunk, size );
+        assert( behind >= 0 && behind <= 8 );
+        sent += size;
+
+        long slowest = sent;
+
+        for ( int i = 0; i < 8; i++ )
+        {
+            take( fan_read[ i ], offset + i, ( i + 1 ) * 512 );
+            if ( offset[ i ] < slowest )
+                slowest = offset[ i ];
+        }
+
+        assert( tee_pending( h ) <= ( size_t )( sent - slowest ) );
+    }
+
+    for ( int done = 0; !done; )
+    {
+        for ( int i = 0; i < 8; i++ )
+            take( fan_read[ i ], offset + i, 4096 );
+
+        done = tee_write( h, NULL, 0 ) == 0;
+    }
+
+    assert( tee_pending( h ) == 0 );
+    assert( tee_fini( h ) == 0 );
+
+    for ( int i = 0; i < 8; i++ )
+    {
+        while ( take( fan_read[ i ], offset + i, 4096 ) > 0 )
+            continue;
+        assert( offset[ i ] == sent );
+        close( fan_read[ i ] );
+    }
 }
@@ -7,7 +7,7 @@
 #include <stdbool.h>
 #include <string.h>
 
-#define BLOCK_SIZE 128
+#define BLOCK_SIZE ( 64 * 1024 )
 
 /* Napište podprogram ‹read_until›, kterého úkolem je načíst ze
  * zadaného popisovače jeden záznam neznámé délky. Záznamy jsou od
@@ -42,73 +42,113 @@ struct shift_buffer /* doplňte nebo upravte dle potřeby */
     char *memory;
     int allocd;
     int used;
+    int start;  /* records before ‹start› were already returned */
+    bool done;  /* the last record was returned by ‹read_record› */
 };
 
+/* Records are found with ‹memchr› (which is vectorized in the C
+ * library) over large blocks read directly into the buffer. A record
+ * is handed out where it lies and the buffer only moves past it – the
+ * only data ever moved within the buffer is an unfinished record at
+ * the end of a block, once, to make room for the next read. Only the
+ * new bytes are scanned after a read, the unfinished part is known
+ * not to contain the delimiter. */
+
 bool realloc_double(struct shift_buffer *buf) {
-    buf->allocd = buf->allocd == 0 ? BLOCK_SIZE : buf->allocd * 2;
-    char *tmp = realloc(buf->memory, buf->allocd * sizeof(char));
+    int allocd = buf->allocd == 0 ? BLOCK_SIZE : buf->allocd * 2;
+    char *tmp = realloc(buf->memory, allocd * sizeof(char));
     if (!tmp) {
         return false;
     }
     buf->memory = tmp;
+    buf->allocd = allocd;
     return true;
 }
 
-int get_delim(struct shift_buffer *buf, int offset, char delim) {
-    for (int i = offset; i < buf->used; ++i) {
-        if (buf->memory[i] == delim) {
-            return i;
-        }
-    }
-    return -1;
+void shift_release(struct shift_buffer *buf) {
+    free(buf->memory);
+    memset(buf, 0, sizeof(*buf));
 }
 
-char *copy_from_buf(struct shift_buffer *buf, int size, int *length) {
-    char *string = malloc(size * sizeof(char));
-    if (!string) {
-        return NULL;
+/* The next record as a pointer into the buffer, valid until the
+ * buffer is used again; ‹*last› is set at the end of input, where the
+ * record is whatever was left (maybe nothing). */
+static const char *shift_next(int fd, char delimiter,
+                              struct shift_buffer *buf, int *length,
+                              bool *last) {
+    int from = buf->start;
+    *last = false;
+
+    for (;;) {
+        char *found = buf->used > from ?
+                      memchr(buf->memory + from, delimiter,
+                             buf->used - from) : NULL;
+        if (found) {
+            char *record = buf->memory + buf->start;
+            *length = found - record + 1;
+            buf->start += *length;
+            return record;
+        }
+
+        if (buf->start > 0) {
+            buf->used -= buf->start;
+            memmove(buf->memory, buf->memory + buf->start, buf->used);
+            buf->start = 0;
+        }
+        if ((buf->allocd == 0 || buf->used > buf->allocd / 2) &&
+            !realloc_double(buf)) {
+            return NULL;
+        }
+
+        int nread = read(fd, buf->memory + buf->used,
+                         buf->allocd - buf->used);
+        if (nread == -1) {
+            return NULL;
+        }
+        if (nread == 0) {
+            *last = true;
+            *length = buf->used;
+            buf->start = buf->used;
+            return buf->memory;
+        }
+        from = buf->used;
+        buf->used += nread;
     }
-    *length = size;
-    memcpy(string, buf->memory, size);
-    buf->used -= size;
-    memmove(buf->memory, &buf->memory[size], buf->used);
-    return string;
 }
 
 char *read_until( int fd, char delimiter,
                   struct shift_buffer *buf, int *length ) {
-    int nread;
-    int delim_index, offset;
+    bool last;
+    const char *record = shift_next(fd, delimiter, buf, length, &last);
     char *rv = NULL;
-    if (buf->allocd - buf->used < BLOCK_SIZE && !realloc_double(buf)) {
-        goto error;
-    }
-    while ((nread = read(fd, buf->memory + buf->used, BLOCK_SIZE)) > 0) {
-        offset = buf->used;
-        buf->used += nread;
-        if ((delim_index = get_delim(buf, offset, delimiter)) != -1) {
-            return copy_from_buf(buf, delim_index + 1, length);
-        }
-        if (buf->allocd - buf->used < BLOCK_SIZE && !realloc_double(buf)) {
-            goto error;
-        }
+
+    if (record && (rv = malloc(*length ? *length : 1))) {
+        memcpy(rv, record, *length);
     }
-    if (nread == -1) {
-        goto error;
+    if (!rv || last) {
+        shift_release(buf);
     }
-    if ((delim_index = get_delim(buf, 0, delimiter)) != -1) {
-        return copy_from_buf(buf, delim_index + 1, length);
+    return rv;
+}
+
+/* Like ‹read_until›, but without the copy: the result points into
+ * the buffer and is only valid until the next call with the same
+ * ‹buf›. After the last record, the buffer is released by the next
+ * call (which starts afresh) or by ‹shift_release›. */
+const char *read_record(int fd, char delimiter,
+                        struct shift_buffer *buf, int *length) {
+    bool last;
+
+    if (buf->done) {
+        shift_release(buf);
     }
-    rv = malloc(buf->used * sizeof(char));
-    if (!rv) {
-        goto error;
+
+    const char *record = shift_next(fd, delimiter, buf, length, &last);
+    if (!record) {
+        shift_release(buf);
     }
-    memcpy(rv, buf->memory, buf->used);
-    *length = buf->used;
-  error:
-    free(buf->memory);
-    memset(buf, 0, sizeof(*buf));
-    return rv;
+    buf->done = last;
+    return record;
 }
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
@@ -164,6 +204,112 @@ static void writer( int fd )
     close( fd );
 }
 
+/* Many records of different lengths (one of them longer than the
+ * block size), written in pieces which do not follow the records,
+ * and a final record without a delimiter. */
+
+enum { records = 20000, long_record = 777 };
+
+static int record_size( int i )
+{
+    return i == long_record ? 3 * BLOCK_SIZE + 5 : ( i * 7919 ) % 500;
+}
+
+static void record_writer( int fd )
+{
+    int total = 0, at = 0;
+
+    for ( int i = 0; i < records; ++i )
+        total += record_size( i ) + 1;
+
+    char *data = malloc( total + 4 );
+
+    if ( !data )
+        err( 1, "malloc" );
+
+    for ( int i = 0; i < records; ++i )
+    {
+        for ( int j = 0; j < record_size( i ); ++j )
+            data[ at++ ] = 'a' + ( i + j ) % 26;
+        data[ at++ ] = '\n';
+    }
+
+    memcpy( data + at, "tail", 4 );
+    total += 4;
+
+    for ( at = 0; at < total; )
+    {
+        int piece = 1 + ( at * 13 ) % 9000;
+        piece = piece < total - at ? piece : total - at;
+        write_or_die( fd, data + at, piece );
+        at += piece;
+    }
+
+    free( data );
+    close( fd );
+}
+
+static void test_records( bool copy )
+{
+    int fds[ 2 ];
+
+    if ( pipe( fds ) == -1 )
+        err( 1, "pipe" );
+
+    int writer_pid = fork();
+
+    if ( writer_pid == -1 )
+        err( 1, "fork" );
+
+    if ( writer_pid == 0 )
+    {
+        close_or_warn( fds[ 0 ], "reader end of a pipe" );
+        record_writer( fds[ 1 ] );
+        exit( 0 );
+    }
+
+    close_or_warn( fds[ 1 ], "writer end of a pipe" );
+
+    struct shift_buffer buffer = { 0 };
+    const char *record;
+    char *result = NULL;
+    int length;
+
+    for ( int i = 0; i <= records; ++i )
+    {
+        if ( copy )
+            record = result = read_until( fds[ 0 ], '\n', &buffer, &length );
+        else
+            record = read_record( fds[ 0 ], '\n', &buffer, &length );
+
+        assert( record );
+
+        if ( i == records )
+        {
+            assert( length == 4 );
+            assert( memcmp( record, "tail", 4 ) == 0 );
+        }
+        else
+        {
+            assert( length == record_size( i ) + 1 );
+            assert( record[ length - 1 ] == '\n' );
+
+            for ( int j = 0; j < length - 1; ++j )
+                assert( record[ j ] == 'a' + ( i + j ) % 26 );
+        }
+
+        free( result );
+    }
+
+    if ( copy )
+        assert( !buffer.memory );
+    else
+        shift_release( &buffer );
+
+    close_or_warn( fds[ 0 ], "reader end of a pipe" );
+    assert( reap( writer_pid ) == 0 );
+}
+
 int main()
 {
     int fds[ 2 ];
@@ -231,5 +377,8 @@ int main()
     close_or_warn( reader_fd, "reader end of a pipe" );
     close_or_warn( fd_wronly, "/dev/null" );
 
+    test_records( true );
+    test_records( false );
+
     return 0;
 }
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* DT_* */
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -9,6 +10,9 @@
 #include <errno.h>
 #include <err.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 /* V této ukázce přidáme k té předchozí «rekurzi» – budeme pracovat
  * s celým adresářovým podstromem, nikoliv jen jednotlivým
@@ -139,7 +143,367 @@ int tree_depth( int root_fd )
     return max_depth;
 }
 
-/* Dále již podprogram ‹tree_depth› pouze otestujeme. */
+/* Rekurzivní průchod čte v každém okamžiku jen jednu složku. Pro
+ * velké stromy (a zejména na síťových nebo jinak pomalých souborových
+ * systémech) je výhodnější číst více složek najednou – to dělá
+ * následující paralelní procházení, které rovnou počítá maximální
+ * hloubku. */
+
+#define WALK_MAX_WORKERS 16
+#define WALK_FD_BUDGET   64     /* celkem otevřených popisovačů */
+
+/* Složky, které je ještě potřeba přečíst, mají pracovní vlákna ve
+ * vlastních frontách s dvěma konci: vlákno bere ze svého konce (jde
+ * tedy do hloubky) a vlákno, které nemá co dělat, si práci
+ * „ukradne“ z opačného konce cizí fronty, kde jsou mělčí a tedy
+ * obvykle větší podstromy. Otevřený popisovač drží nejvýše
+ * ‹WALK_FD_BUDGET› složek, ostatní otevřeme znovu podle cesty vůči
+ * kořeni.
+ *
+ * Na hloubce se podílí jen složky, a typ položky obvykle poskytne
+ * přímo ‹readdir› – ‹fstatat› tedy voláme jen tehdy, když jej
+ * souborový systém neuvádí. Hloubku každé nalezené podsložky
+ * (položky kořene mají hloubku 1) započteme do sdíleného maxima
+ * ‹max_depth›, které udržujeme atomicky, protože jej mění více
+ * vláken současně. Výsledkem ‹walk_tree› je toto maximum, nebo -1
+ * v případě systémové chyby. */
+
+struct walk_item
+{
+    int fd;                     /* -1 = je třeba znovu otevřít */
+    char *path;                 /* cesta vůči kořeni */
+    int depth;
+};
+
+struct walk_deque
+{
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    int head, tail, cap;
+};
+
+struct walk
+{
+    int root_fd;
+    atomic_int max_depth;
+    int nworkers;
+    struct walk_deque deques[ WALK_MAX_WORKERS ];
+
+    atomic_int pending;         /* ve frontě nebo ve zpracování */
+    atomic_int queued;
+    atomic_int idle;
+    atomic_int fds;
+    atomic_int rv;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct walk_worker
+{
+    struct walk *walk;
+    int id;
+    pthread_t tid;
+};
+
+static void walk_wake( struct walk *w, bool all )
+{
+    if ( atomic_load( &w->idle ) > 0 || all )
+    {
+        pthread_mutex_lock( &w->lock );
+        if ( all )
+            pthread_cond_broadcast( &w->wake );
+        else
+            pthread_cond_signal( &w->wake );
+        pthread_mutex_unlock( &w->lock );
+    }
+}
+
+static int walk_push( struct walk *w, int id, struct walk_item item )
+{
+    struct walk_deque *d = &w->deques[ id ];
+    pthread_mutex_lock( &d->lock );
+    if ( d->tail == d->cap )
+    {
+        int live = d->tail - d->head;
+        if ( d->head > 0 )
+        {
+            memmove( d->items, d->items + d->head,
+                     live * sizeof( struct walk_item ) );
+        }
+        if ( live == d->cap )
+        {
+            int cap = d->cap ? 2 * d->cap : 64;
+            size_t bytes = cap * sizeof( struct walk_item );
+            struct walk_item *items = realloc( d->items, bytes );
+            if ( !items )
+            {
+                pthread_mutex_unlock( &d->lock );
+                return -1;
+            }
+            d->items = items;
+            d->cap = cap;
+        }
+        d->head = 0;
+        d->tail = live;
+    }
+    d->items[ d->tail++ ] = item;
+    atomic_fetch_add( &w->pending, 1 );
+    atomic_fetch_add( &w->queued, 1 );
+    pthread_mutex_unlock( &d->lock );
+    walk_wake( w, false );
+    return 0;
+}
+
+static bool walk_take( struct walk *w, int id, bool steal,
+                       struct walk_item *item )
+{
+    struct walk_deque *d = &w->deques[ id ];
+    bool found = false;
+    pthread_mutex_lock( &d->lock );
+    if ( d->head < d->tail )
+    {
+        *item = steal ? d->items[ d->head++ ] : d->items[ --d->tail ];
+        atomic_fetch_sub( &w->queued, 1 );
+        found = true;
+    }
+    pthread_mutex_unlock( &d->lock );
+    return found;
+}
+
+static char *walk_join( const char *dir, const char *name )
+{
+    size_t dlen = strlen( dir );
+    char *path = malloc( dlen + strlen( name ) + 2 );
+    if ( path )
+    {
+        memcpy( path, dir, dlen );
+        path[ dlen ] = '/';
+        strcpy( path + dlen + 1, name );
+    }
+    return path;
+}
+
+static void walk_fail( struct walk *w, int rv )
+{
+    int expected = 0;
+    atomic_compare_exchange_strong( &w->rv, &expected, rv );
+}
+
+static int walk_dir( struct walk *w, int id, struct walk_item *item )
+{
+    int fd = item->fd;
+    if ( fd == -1 )
+    {
+        fd = openat( w->root_fd, item->path, O_RDONLY | O_DIRECTORY );
+        if ( fd == -1 )
+            return -1;
+        atomic_fetch_add( &w->fds, 1 );
+    }
+    DIR *dir = fdopendir( fd );
+    if ( !dir )
+    {
+        close( fd );
+        atomic_fetch_sub( &w->fds, 1 );
+        return -1;
+    }
+
+    /* kořenový popisovač sdílí pozici s volajícím (kopie ‹dup›),
+     * nemusí tedy ukazovat na začátek složky */
+    rewinddir( dir );
+
+    int rv = 0;
+    struct dirent *ent;
+    struct stat st;
+    while ( rv == 0 && atomic_load( &w->rv ) == 0 &&
+            ( errno = 0, ent = readdir( dir ) ) )
+    {
+        if ( strcmp( ent->d_name, "." ) == 0 ||
+             strcmp( ent->d_name, ".." ) == 0 )
+            continue;
+        bool is_dir = ent->d_type == DT_DIR;
+        if ( ent->d_type == DT_UNKNOWN )
+        {
+            if ( fstatat( fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW ) == -1 )
+            {
+                rv = -1;
+                break;
+            }
+            is_dir = S_ISDIR( st.st_mode );
+        }
+        if ( !is_dir )
+            continue;
+
+        int depth = item->depth + 1;
+        int seen = atomic_load( &w->max_depth );
+        while ( depth > seen &&
+                !atomic_compare_exchange_weak( &w->max_depth, &seen, depth ) )
+            continue;
+
+        struct walk_item sub = { .fd = -1, .depth = depth };
+        if ( !( sub.path = walk_join( item->path, ent->d_name ) ) )
+        {
+            rv = -1;
+            break;
+        }
+        if ( atomic_fetch_add( &w->fds, 1 ) < WALK_FD_BUDGET )
+            sub.fd = openat( fd, ent->d_name, O_RDONLY | O_DIRECTORY );
+        if ( sub.fd == -1 )
+            atomic_fetch_sub( &w->fds, 1 );
+        if ( walk_push( w, id, sub ) == -1 )
+        {
+            if ( sub.fd != -1 )
+            {
+                close( sub.fd );
+                atomic_fetch_sub( &w->fds, 1 );
+            }
+            free( sub.path );
+            rv = -1;
+        }
+    }
+    if ( rv == 0 && errno != 0 )
+        rv = -1;
+    closedir( dir );
+    atomic_fetch_sub( &w->fds, 1 );
+    return rv;
+}
+
+static void walk_done( struct walk *w, struct walk_item *item )
+{
+    free( item->path );
+    if ( atomic_fetch_sub( &w->pending, 1 ) == 1 )
+        walk_wake( w, true );
+}
+
+static void *walk_worker( void *arg )
+{
+    struct walk_worker *worker = arg;
+    struct walk *w = worker->walk;
+    struct walk_item item;
+
+    for ( ;; )
+    {
+        bool found = walk_take( w, worker->id, false, &item );
+        for ( int i = 1; !found && i < w->nworkers; ++i )
+        {
+            found = walk_take( w, ( worker->id + i ) % w->nworkers,
+                               true, &item );
+        }
+        if ( found )
+        {
+            if ( atomic_load( &w->rv ) != 0 )
+            {
+                if ( item.fd != -1 )
+                {
+                    close( item.fd );
+                    atomic_fetch_sub( &w->fds, 1 );
+                }
+            }
+            else
+            {
+                int rv = walk_dir( w, worker->id, &item );
+                if ( rv != 0 )
+                    walk_fail( w, rv );
+            }
+            walk_done( w, &item );
+            continue;
+        }
+
+        pthread_mutex_lock( &w->lock );
+        atomic_fetch_add( &w->idle, 1 );
+        while ( atomic_load( &w->queued ) == 0 &&
+                atomic_load( &w->pending ) > 0 )
+            pthread_cond_wait( &w->wake, &w->lock );
+        atomic_fetch_sub( &w->idle, 1 );
+        bool finished = atomic_load( &w->pending ) == 0;
+        pthread_mutex_unlock( &w->lock );
+        if ( finished )
+            return NULL;
+    }
+}
+
+static int walk_tree( int root_fd )
+{
+    struct walk w = { .root_fd = root_fd };
+    struct walk_worker workers[ WALK_MAX_WORKERS ];
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+    /* čtení složek většinou čeká na I/O, proto více vláken než CPU */
+    w.nworkers = cpus > 0 ? 2 * ( int ) cpus : 2;
+    if ( w.nworkers > WALK_MAX_WORKERS )
+        w.nworkers = WALK_MAX_WORKERS;
+    atomic_init( &w.pending, 0 );
+    atomic_init( &w.queued, 0 );
+    atomic_init( &w.idle, 0 );
+    atomic_init( &w.fds, 0 );
+    atomic_init( &w.rv, 0 );
+    atomic_init( &w.max_depth, 0 );
+    pthread_mutex_init( &w.lock, NULL );
+    pthread_cond_init( &w.wake, NULL );
+    for ( int i = 0; i < w.nworkers; ++i )
+    {
+        pthread_mutex_init( &w.deques[ i ].lock, NULL );
+        w.deques[ i ].items = NULL;
+        w.deques[ i ].head = w.deques[ i ].tail = w.deques[ i ].cap = 0;
+    }
+
+    struct walk_item root = { .fd = dup( root_fd ), .path = malloc( 2 ) };
+    if ( root.fd == -1 || !root.path )
+    {
+        if ( root.fd != -1 )
+            close( root.fd );
+        free( root.path );
+        walk_fail( &w, -1 );
+    }
+    else
+    {
+        strcpy( root.path, "." );
+        atomic_fetch_add( &w.fds, 1 );
+        if ( walk_push( &w, 0, root ) == -1 )
+        {
+            close( root.fd );
+            free( root.path );
+            walk_fail( &w, -1 );
+        }
+    }
+
+    int started = 0;
+    for ( ; atomic_load( &w.rv ) == 0 && started < w.nworkers; ++started )
+    {
+        workers[ started ].walk = &w;
+        workers[ started ].id = started;
+        if ( pthread_create( &workers[ started ].tid, NULL,
+                             walk_worker, &workers[ started ] ) != 0 ) {
+            break;
+        }
+    }
+    if ( started == 0 && atomic_load( &w.pending ) > 0 )
+    {
+        /* nepodařilo se spustit žádné vlákno, projdeme strom sami */
+        workers[ 0 ].walk = &w;
+        workers[ 0 ].id = 0;
+        w.nworkers = 1;
+        walk_worker( &workers[ 0 ] );
+    }
+    for ( int i = 0; i < started; ++i )
+        pthread_join( workers[ i ].tid, NULL );
+
+    for ( int i = 0; i < w.nworkers; ++i )
+    {
+        pthread_mutex_destroy( &w.deques[ i ].lock );
+        free( w.deques[ i ].items );
+    }
+    pthread_mutex_destroy( &w.lock );
+    pthread_cond_destroy( &w.wake );
+    return atomic_load( &w.rv ) ? -1 : atomic_load( &w.max_depth );
+}
+
+int tree_depth_par( int root_fd )
+{
+    return walk_tree( root_fd );
+}
+
+/* Dále již podprogramy ‹tree_depth› a ‹tree_depth_par› pouze
+ * otestujeme. */
 
 static int mkdir_or_die( int dir_fd, const char *name )
 {
@@ -169,6 +533,10 @@ int main( void ) /* demo */
     assert( tree_depth( fds[ 3 ] ) == 1 );
     assert( tree_depth( fds[ 4 ] ) == 0 );
 
+    for ( int i = 0; i < 5; ++i )
+        assert( tree_depth_par( fds[ i ] ) == tree_depth( fds[ i ] ) );
+    assert( tree_depth_par( -1 ) == -1 );
+
     for ( int i = 0; i < 5; ++i )
         close( fds[ i ] );
 
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE        /* syscall, DT_* */
 
 #include <sys/stat.h>  /* mkdirat, openat */
 #include <unistd.h>    /* unlinkat, close, write */
@@ -7,10 +8,13 @@
 #include <stdlib.h>    /* free, malloc, calloc */
 #include <string.h>    /* strncpy */
 #include <stdbool.h>   /* bool */
+#include <stdio.h>     /* snprintf */
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
 #include <dirent.h>
+#include <stdint.h>    /* uint64_t */
+#include <sys/syscall.h> /* SYS_getdents64 */
 
 /* Váš úkol v této přípravě je přímočarý – na vstupu dostanete
  * popisovač otevřené složky, ze kterého vytvoříte zřetězeny seznam
@@ -54,39 +58,82 @@ void destroy(struct name_list *list) {
     }
 }
 
+/* ‹list› needs nothing but the names, so the directory is read with
+ * raw ‹getdents64›, which returns them by the hundred per call. */
+
+#define DIRB_BATCH (64 * 1024)
+
+struct dirb_entry {             /* the kernel's ‹struct linux_dirent64› */
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct dir_batch {
+    int fd;
+    char *buf;
+    long len, pos;
+};
+
+int dirb_open(struct dir_batch *d, int dir_fd) {
+    d->len = d->pos = 0;
+    d->buf = NULL;
+    if ((d->fd = dup(dir_fd)) == -1) {
+        return -1;
+    }
+    if (lseek(d->fd, 0, SEEK_SET) == -1 || !(d->buf = malloc(DIRB_BATCH))) {
+        close(d->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* At the end, returns a null pointer with ‹errno› set to 0. */
+const struct dirb_entry *dirb_next(struct dir_batch *d) {
+    if (d->pos >= d->len) {
+        long bytes = syscall(SYS_getdents64, d->fd, d->buf, DIRB_BATCH);
+        if (bytes <= 0) {
+            if (bytes == 0) {
+                errno = 0;
+            }
+            return NULL;
+        }
+        d->len = bytes;
+        d->pos = 0;
+    }
+    const struct dirb_entry *ent = (const void *) (d->buf + d->pos);
+    d->pos += ent->reclen;
+    return ent;
+}
+
+void dirb_close(struct dir_batch *d) {
+    free(d->buf);
+    close(d->fd);
+}
+
 struct name_list *list(int real_dir_fd) {
-    DIR *dir = NULL;
+    struct dir_batch dir;
+    const struct dirb_entry *ent;
     struct name_list *head = NULL, *tail = NULL;
 
-    int dup_fd = dup(real_dir_fd);
-    if (dup_fd == -1)
-        goto out;
-
-    dir = fdopendir(dup_fd);
-    if (!dir)
-        goto out;
-
-    rewinddir(dir);
-    struct dirent *ptr;
-    struct stat st;
-    while ((ptr = readdir(dir))) {
-        if (fstatat(real_dir_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1) {
-            goto out;
-        }
-        if (!append(&head, &tail, ptr->d_name)) {
-            goto out;
+    if (dirb_open(&dir, real_dir_fd) == -1)
+        return NULL;
+
+    /* only names are needed, so no ‹fstatat› at all */
+    while ((ent = dirb_next(&dir))) {
+        if (!append(&head, &tail, ent->name)) {
+            errno = ENOMEM;
+            break;
         }
     }
-    closedir(dir);
+    if (errno != 0) {
+        destroy(head);
+        head = NULL;
+    }
+    dirb_close(&dir);
     return head;
-    out:
-    destroy(head);
-    if (dir)
-        closedir(dir);
-    else if (dup_fd != -1)
-        close(dup_fd);
-    return NULL;
 }
 
 
@@ -217,6 +264,25 @@ int main() {
     check_content(result, names, 7);
     cleanup(result);
 
+    /* enough entries for more than one ‹getdents64› batch */
+    char name[32];
+    for (int i = 0; i < 3000; ++i) {
+        snprintf(name, sizeof name, "zt.p3_many_%d", i);
+        write_file(dir1, name, "");
+    }
+    result = list(dir1);
+    int count = 0;
+    for (struct name_list *node = result; node; node = node->next)
+        ++count;
+    assert(count == 3007);
+    assert(contains(result, "zt.p3_many_2999"));
+    cleanup(result);
+    for (int i = 0; i < 3000; ++i) {
+        snprintf(name, sizeof name, "zt.p3_many_%d", i);
+        if (unlinkat(dir1, name, 0) == -1)
+            err(2, "unlinking %s", name);
+    }
+
     close_or_warn(dir1, "zt.p3_test_dir1");
     unlink_test_files();
 
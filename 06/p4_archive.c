@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE     /* statx, syscall, DT_* */
 
 #include <unistd.h>     /* read, write, unlinkat, … */
 #include <fcntl.h>      /* openat, O_* */
@@ -11,6 +12,12 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>     /* malloc, realloc, qsort, free */
+#include <stdint.h>     /* uint64_t */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>       /* clock_gettime */
+#include <sys/syscall.h> /* SYS_getdents64 */
 
 /* Napište proceduru ‹archive_files›, která na vstupu obdrží:
  *
@@ -92,68 +99,318 @@ bool is_newer(struct timespec a, struct timespec b) {
            (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
 }
 
-int archive_files(int work_fd, int archive_fd,
-                  struct timespec threshold) {
-    DIR *dir = NULL;
-    int rv = -1;
+/* The archiving runs in two phases. The first one only reads the
+ * working directory: entries come from ‹getdents64› in large batches
+ * and ‹statx› is asked for the type, size and ‹mtime› of regular
+ * files (and nothing else, so it can skip the rest of the i-node).
+ * The result is a «plan» of files to move, sorted by i-node number,
+ * so that the second phase touches the i-node table in order.
+ *
+ * The second phase executes the plan on up to ‹ARCHIVE_WORKERS›
+ * threads, which claim ‹ARCHIVE_CHUNK› moves at a time. A move is a
+ * single ‹renameat›, which also atomically replaces a file of the
+ * same name in the archive. When the two directories are on
+ * different file systems (‹EXDEV›), the file is copied into a
+ * temporary file in the archive, which is then renamed over the
+ * target, and only then is the original unlinked – a failure at any
+ * point leaves the file in the working directory. */
+
+#define DIRB_BATCH (64 * 1024)
+#define ARCHIVE_WORKERS 4
+#define ARCHIVE_CHUNK 256
+
+struct dirb_entry {             /* the kernel's ‹struct linux_dirent64› */
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct archive_item {
+    uint64_t ino;
+    uint64_t size;
+    size_t name;                /* offset into ‹archive_plan.names› */
+};
+
+struct archive_plan {
+    struct archive_item *items;
+    size_t count, capacity;
+    char *names;
+    size_t names_used, names_capacity;
+};
+
+/* Counters filled in by ‹archive_files_summary›; ‹failed› counts
+ * files which could not be checked or moved. */
+struct archive_summary {
+    size_t planned, renamed, copied, failed;
+    uint64_t bytes;
+    struct timespec scan, move;     /* duration of the two phases */
+};
+
+static int plan_add(struct archive_plan *plan, uint64_t ino,
+                    uint64_t size, const char *name) {
+    size_t len = strlen(name) + 1;
+
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? 2 * plan->capacity : 256;
+        void *items = realloc(plan->items, capacity * sizeof *plan->items);
+        if (!items)
+            return -1;
+        plan->items = items;
+        plan->capacity = capacity;
+    }
 
-    int dup_fd = dup(work_fd);
-    if (dup_fd == -1) {
-        goto out;
+    if (plan->names_capacity - plan->names_used < len) {
+        size_t capacity = plan->names_capacity ? plan->names_capacity : 4096;
+        while (capacity - plan->names_used < len)
+            capacity *= 2;
+        char *names = realloc(plan->names, capacity);
+        if (!names)
+            return -1;
+        plan->names = names;
+        plan->names_capacity = capacity;
     }
 
-    dir = fdopendir(dup_fd);
-    if (!dir) {
-        goto out;
+    memcpy(plan->names + plan->names_used, name, len);
+    plan->items[plan->count++] = (struct archive_item) {
+        .ino = ino, .size = size, .name = plan->names_used
+    };
+    plan->names_used += len;
+    return 0;
+}
+
+static int item_cmp(const void *a, const void *b) {
+    const struct archive_item *x = a, *y = b;
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/* Fills ‹plan› with the regular files in ‹work_fd› older than
+ * ‹threshold›. Returns 0, -2 if some entries could not be checked,
+ * or -1 if the directory could not be read at all. */
+static int archive_scan(int work_fd, struct timespec threshold,
+                        struct archive_plan *plan, size_t *failed) {
+    long len = 0, pos = 0;
+    int rv = 0;
+    int fd = dup(work_fd);
+    char *buf = NULL;
+
+    if (fd == -1)
+        return -1;
+    if (lseek(fd, 0, SEEK_SET) == -1 || !(buf = malloc(DIRB_BATCH))) {
+        close(fd);
+        return -1;
     }
 
-    struct dirent *ptr;
-    struct stat st;
-    rewinddir(dir);
-    while ((ptr = readdir(dir))) {
-        if (fstatat(work_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1) {
+    for (;;) {
+        if (pos >= len) {
+            len = syscall(SYS_getdents64, fd, buf, DIRB_BATCH);
+            if (len <= 0) {
+                if (len == -1)
+                    rv = -1;
+                break;
+            }
+            pos = 0;
+        }
+
+        const struct dirb_entry *ent = (const void *) (buf + pos);
+        pos += ent->reclen;
+
+        if (ent->type != DT_REG && ent->type != DT_UNKNOWN)
+            continue;
+
+        struct statx stx;
+        if (statx(work_fd, ent->name,
+                  AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == -1) {
+            ++*failed;
             rv = -2;
             continue;
         }
-        if (S_ISREG(st.st_mode) && is_newer(threshold, st.st_mtim)) {
-            if (unlinkat(archive_fd, ptr->d_name, 0) == -1 && errno != ENOENT) {
-                rv = -2;
-                continue;
-            }
-            int in_fd = openat(work_fd, ptr->d_name, O_RDONLY);
-            if (in_fd == -1) {
-                rv = -2;
-                continue;
-            }
-            int out_fd = openat(archive_fd, ptr->d_name, O_CREAT | O_WRONLY);
-            if (out_fd == -1) {
-                rv = -2;
-                close(in_fd);
-                continue;
-            }
-            if (sendfile(out_fd, in_fd, NULL, st.st_size) == -1 ||
-                unlinkat(work_fd, ptr->d_name, 0) == -1) {
-                rv = -2;
-                close(in_fd);
-                close(out_fd);
+
+        struct timespec mtime = {
+            .tv_sec = stx.stx_mtime.tv_sec,
+            .tv_nsec = stx.stx_mtime.tv_nsec
+        };
+        if (!S_ISREG(stx.stx_mode) || !is_newer(threshold, mtime))
+            continue;
+
+        if (plan_add(plan, ent->ino, stx.stx_size, ent->name) == -1) {
+            rv = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    close(fd);
+
+    if (rv != -1)
+        qsort(plan->items, plan->count, sizeof *plan->items, item_cmp);
+    return rv;
+}
+
+/* Copy ‹name› from ‹work_fd› to ‹archive_fd› through a temporary file,
+ * keeping its permissions and timestamps, then unlink the original. */
+static int archive_copy(int work_fd, int archive_fd, const char *name) {
+    static atomic_uint counter;
+    char temp[64];
+    struct stat st;
+    int in_fd, out_fd = -1;
+    bool copied = false;
+
+    if ((in_fd = openat(work_fd, name, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(in_fd, &st) == -1)
+        goto out;
+
+    for (int attempt = 0; out_fd == -1 && attempt < 100; ++attempt) {
+        snprintf(temp, sizeof temp, ".archive.%d.%u", getpid(),
+                 atomic_fetch_add(&counter, 1));
+        out_fd = openat(archive_fd, temp, O_CREAT | O_EXCL | O_WRONLY,
+                        st.st_mode & 07777);
+        if (out_fd == -1 && errno != EEXIST)
+            goto out;
+    }
+    if (out_fd == -1)
+        goto out;
+
+    off_t left = st.st_size;
+    ssize_t sent = 0;
+    while (left > 0 && (sent = sendfile(out_fd, in_fd, NULL, left)) > 0)
+        left -= sent;
+
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    copied = sent != -1 && left == 0 && futimens(out_fd, times) == 0;
+
+    if (close(out_fd) == -1)
+        copied = false;
+    if (copied && renameat(archive_fd, temp, archive_fd, name) == -1)
+        copied = false;
+    if (!copied)
+        unlinkat(archive_fd, temp, 0);
+out:
+    close(in_fd);
+    if (!copied)
+        return -1;
+    return unlinkat(work_fd, name, 0);
+}
+
+struct archive_job {
+    int work_fd, archive_fd;
+    const struct archive_plan *plan;
+    atomic_size_t next, renamed, copied, failed;
+    _Atomic uint64_t bytes;
+};
+
+static void *archive_worker(void *arg) {
+    struct archive_job *job = arg;
+    const struct archive_plan *plan = job->plan;
+    size_t start;
+
+    while ((start = atomic_fetch_add(&job->next, ARCHIVE_CHUNK))
+           < plan->count) {
+        size_t end = start + ARCHIVE_CHUNK;
+        if (end > plan->count)
+            end = plan->count;
+
+        for (size_t i = start; i < end; ++i) {
+            const char *name = plan->names + plan->items[i].name;
+
+            if (renameat(job->work_fd, name, job->archive_fd, name) == 0)
+                atomic_fetch_add(&job->renamed, 1);
+            else if (errno == EXDEV &&
+                     archive_copy(job->work_fd, job->archive_fd, name) == 0)
+                atomic_fetch_add(&job->copied, 1);
+            else {
+                atomic_fetch_add(&job->failed, 1);
                 continue;
             }
-            close(in_fd);
-            close(out_fd);
+            atomic_fetch_add(&job->bytes, plan->items[i].size);
         }
     }
 
-    if (rv != -2)
-        rv = 0;
-    out:
-    if (dir)
-        closedir(dir);
-    else if (dup_fd != -1)
-        close(dup_fd);
+    return NULL;
+}
+
+static struct timespec elapsed(struct timespec from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now.tv_sec -= from.tv_sec;
+    if ((now.tv_nsec -= from.tv_nsec) < 0) {
+        now.tv_nsec += 1000000000;
+        --now.tv_sec;
+    }
+    return now;
+}
+
+/* Like ‹archive_files›, but also fills in ‹summary› (if not null). */
+int archive_files_summary(int work_fd, int archive_fd,
+                          struct timespec threshold,
+                          struct archive_summary *summary) {
+    struct archive_plan plan = {0};
+    struct archive_summary sum = {0};
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rv = archive_scan(work_fd, threshold, &plan, &sum.failed);
+    sum.scan = elapsed(start);
+
+    if (rv == -1)
+        goto out;
+
+    struct archive_job job = {
+        .work_fd = work_fd, .archive_fd = archive_fd, .plan = &plan
+    };
+    pthread_t threads[ARCHIVE_WORKERS];
+    int nthreads = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (nthreads < ARCHIVE_WORKERS &&
+           (size_t) nthreads * ARCHIVE_CHUNK < plan.count &&
+           pthread_create(threads + nthreads, NULL, archive_worker,
+                          &job) == 0)
+        ++nthreads;
+
+    archive_worker(&job);       /* help out, or do it all if no threads */
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    sum.move = elapsed(start);
+
+    sum.planned = plan.count;
+    sum.renamed = job.renamed;
+    sum.copied = job.copied;
+    sum.failed += job.failed;
+    sum.bytes = job.bytes;
+
+    if (sum.failed)
+        rv = -2;
+out:
+    free(plan.items);
+    free(plan.names);
+    if (summary)
+        *summary = sum;
     return rv;
 }
 
+/* Print a one-line report of throughput and failures. */
+void archive_report(FILE *out, const struct archive_summary *sum) {
+    double scan = sum->scan.tv_sec + sum->scan.tv_nsec / 1e9;
+    double move = sum->move.tv_sec + sum->move.tv_nsec / 1e9;
+    double rate = move > 0 ? (sum->renamed + sum->copied) / move : 0;
+    double mib = move > 0 ? sum->bytes / move / (1024 * 1024) : 0;
+
+    fprintf(out, "archived %zu of %zu files (%zu renamed, %zu copied), "
+                 "%zu failed; scan %.3f s, move %.3f s, "
+                 "%.0f files/s, %.1f MiB/s\n",
+            sum->renamed + sum->copied, sum->planned, sum->renamed,
+            sum->copied, sum->failed, scan, move, rate, mib);
+}
+
+int archive_files(int work_fd, int archive_fd,
+                  struct timespec threshold) {
+    return archive_files_summary(work_fd, archive_fd, threshold, NULL);
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <time.h>
@@ -266,6 +523,71 @@ int main() {
     assert(faccessat(work_fd, "bar", 0, 0) == -1);
     assert(errno == ENOENT);
 
+    /* A larger directory: every other file is old, and one of them
+     * replaces an existing file in the archive. */
+
+    char name[32], data[32];
+    struct archive_summary sum;
+
+    for (int i = 0; i < 2000; ++i) {
+        snprintf(name, sizeof name, "f%04d", i);
+        snprintf(data, sizeof data, "file %d", i);
+        write_file(work_fd, name, data);
+        set_mtime(work_fd, name, i % 2 ? now : earlier);
+        unlink_if_exists(arch_fd, name);
+    }
+    write_file(arch_fd, "f0000", "stale");
+
+    assert(archive_files_summary(work_fd, arch_fd, now, &sum) == 0);
+    assert(sum.planned == 1000);
+    assert(sum.renamed + sum.copied == 1000);
+    assert(sum.failed == 0);
+    assert(sum.bytes == 5 * 6 + 45 * 7 + 450 * 8 + 500 * 9);
+
+    for (int i = 0; i < 2000; ++i) {
+        snprintf(name, sizeof name, "f%04d", i);
+        snprintf(data, sizeof data, "file %d", i);
+        assert(check_file(i % 2 ? work_fd : arch_fd, name, data));
+        assert(faccessat(i % 2 ? arch_fd : work_fd, name, 0, 0) == -1);
+        unlink_if_exists(i % 2 ? work_fd : arch_fd, name);
+    }
+
+    char report[256];
+    FILE *out = fmemopen(report, sizeof report, "w");
+    assert(out);
+    archive_report(out, &sum);
+    fclose(out);
+    assert(strncmp(report, "archived 1000 of 1000 files", 27) == 0);
+
+    /* Across file systems, the files are copied (when a different one
+     * is at hand). */
+
+    struct stat work_st, shm_st;
+    int shm_fd = openat(AT_FDCWD, "/dev/shm", O_DIRECTORY);
+
+    if (shm_fd != -1 &&
+        fstat(work_fd, &work_st) == 0 && fstat(shm_fd, &shm_st) == 0 &&
+        work_st.st_dev != shm_st.st_dev) {
+        int other_fd = mkdir_or_die(shm_fd, "zt.p4_arch");
+
+        write_file(work_fd, "baz", "z");
+        set_mtime(work_fd, "baz", earlier);
+        unlink_if_exists(other_fd, "baz");
+
+        assert(archive_files_summary(work_fd, other_fd, now, &sum) == 0);
+        assert(sum.copied == 1 && sum.renamed == 0);
+        assert(check_file(other_fd, "baz", "z"));
+        assert(faccessat(work_fd, "baz", 0, 0) == -1);
+        assert(fstatat(other_fd, "baz", &shm_st, 0) == 0);
+        assert(shm_st.st_mtim.tv_sec == earlier.tv_sec);
+
+        unlink_if_exists(other_fd, "baz");
+        close_or_warn(other_fd, "/dev/shm/zt.p4_arch");
+        unlinkat(shm_fd, "zt.p4_arch", AT_REMOVEDIR);
+    }
+
+    if (shm_fd != -1)
+        close_or_warn(shm_fd, "/dev/shm");
     close_or_warn(work_fd, "zt.p4_root");
     close_or_warn(arch_fd, "zt.p4_arch");
 
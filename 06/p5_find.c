@@ -1,14 +1,23 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* DT_* */
 
 #include <unistd.h>     /* read, write, unlinkat, … */
 #include <fcntl.h>      /* openat, O_* */
 #include <sys/stat.h>   /* fstat, struct stat */
 #include <dirent.h>     /* DIR, fdopendir, readdir, … */
-#include <string.h>     /* strlen, memcmp */
+#include <string.h>     /* strlen, memcmp, strdup */
 #include <errno.h>
 #include <err.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>      /* snprintf */
+#include <stdlib.h>     /* malloc, realloc, qsort, free */
+#include <stdint.h>     /* uint32_t, uint64_t */
+#include <limits.h>     /* PATH_MAX */
+#include <time.h>       /* clock_gettime */
+#include <sys/mman.h>   /* mmap, munmap */
+#include <stdatomic.h>
+#include <pthread.h>
 
 /* Naprogramujte proceduru ‹find›, která obdrží:
  *
@@ -25,66 +34,892 @@
  * Nezapomeňte uvolnit veškeré zdroje, které jste alokovali
  * (s případnou výjimkou popisovače, který je funkcí vrácen). */
 
-bool find_rec(int root_fd, const char *name, int flags, int *fd) {
-    if (root_fd == -1)
-        return false;
+#define WALK_MAX_WORKERS 16
+#define WALK_FD_BUDGET   64     /* open directory descriptors, in total */
 
-    int rv = false;
-    DIR *dir = fdopendir(root_fd);
-    if (!dir)
-        goto out;
+/* ‹find› only compares names, so it walks the tree in parallel:
+ * each worker keeps a deque of directories still to be read, pops
+ * from its own end (going depth-first) and, when it runs dry,
+ * steals from the shallow end of another worker's deque. A queued
+ * directory keeps its descriptor open only while fewer than
+ * ‹WALK_FD_BUDGET› are open; otherwise it is reopened by its path
+ * from the root. The type of an entry comes from ‹readdir›, and
+ * ‹fstatat› is only needed to tell directories apart on file
+ * systems which do not report it.
+ *
+ * The visitor gets the descriptor of the directory and the name of
+ * each entry other than ‹.› and ‹..›, concurrently from several
+ * threads. Its non-zero result stops the walk and is returned by
+ * ‹walk_tree›, which otherwise returns 0, or -1 on a system error. */
+
+typedef int (*walk_visitor)(void *ctx, int dir_fd, const char *name);
+
+struct walk_item {
+    int fd;                     /* -1 if it has to be reopened */
+    char *path;                 /* relative to the root */
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    int head, tail, cap;
+};
 
+struct walk {
+    int root_fd;
+    walk_visitor visit;
+    void *ctx;
+    int nworkers;
+    struct walk_deque deques[WALK_MAX_WORKERS];
+
+    atomic_int pending;         /* queued or being processed */
+    atomic_int queued;
+    atomic_int idle;
+    atomic_int fds;
+    atomic_int rv;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    pthread_t tid;
+};
+
+static void walk_wake(struct walk *w, bool all) {
+    if (atomic_load(&w->idle) > 0 || all) {
+        pthread_mutex_lock(&w->lock);
+        if (all) {
+            pthread_cond_broadcast(&w->wake);
+        } else {
+            pthread_cond_signal(&w->wake);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static int walk_push(struct walk *w, int id, struct walk_item item) {
+    struct walk_deque *d = &w->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        int live = d->tail - d->head;
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    live * sizeof(struct walk_item));
+        }
+        if (live == d->cap) {
+            int cap = d->cap ? 2 * d->cap : 64;
+            struct walk_item *items = realloc(d->items,
+                                              cap * sizeof(struct walk_item));
+            if (!items) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->items = items;
+            d->cap = cap;
+        }
+        d->head = 0;
+        d->tail = live;
+    }
+    d->items[d->tail++] = item;
+    atomic_fetch_add(&w->pending, 1);
+    atomic_fetch_add(&w->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+    walk_wake(w, false);
+    return 0;
+}
+
+static bool walk_take(struct walk *w, int id, bool steal,
+                      struct walk_item *item) {
+    struct walk_deque *d = &w->deques[id];
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        atomic_fetch_sub(&w->queued, 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static char *walk_join(const char *dir, const char *name) {
+    size_t dlen = strlen(dir);
+    char *path = malloc(dlen + strlen(name) + 2);
+    if (path) {
+        memcpy(path, dir, dlen);
+        path[dlen] = '/';
+        strcpy(path + dlen + 1, name);
+    }
+    return path;
+}
+
+static void walk_fail(struct walk *w, int rv) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&w->rv, &expected, rv);
+}
+
+static int walk_dir(struct walk *w, int id, struct walk_item *item) {
+    int fd = item->fd;
+    if (fd == -1) {
+        fd = openat(w->root_fd, item->path, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            return -1;
+        }
+        atomic_fetch_add(&w->fds, 1);
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        atomic_fetch_sub(&w->fds, 1);
+        return -1;
+    }
+
+    /* the root descriptor is shared with the caller (through ‹dup›),
+     * so its position is not necessarily at the start */
     rewinddir(dir);
 
-    struct dirent *ptr;
+    int rv = 0;
+    struct dirent *ent;
     struct stat st;
-    while ((ptr = readdir(dir))) {
-        if (strcmp(ptr->d_name, ".") == 0 ||
-            strcmp(ptr->d_name, "..") == 0)
+    while (rv == 0 && atomic_load(&w->rv) == 0 &&
+           (errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+            strcmp(ent->d_name, "..") == 0) {
             continue;
-
-        if (strcmp(ptr->d_name, name) == 0) {
-            if (*fd != -1) {
-                goto out;
+        }
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                rv = -1;
+                break;
             }
-            *fd = openat(root_fd, ptr->d_name, flags);
-            if (*fd == -1) {
-                goto out;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        rv = w->visit(w->ctx, fd, ent->d_name);
+        if (rv != 0) {
+            break;
+        }
+        if (!is_dir) {
+            continue;
+        }
+
+        struct walk_item sub = { .fd = -1 };
+        if (!(sub.path = walk_join(item->path, ent->d_name))) {
+            rv = -1;
+            break;
+        }
+        if (atomic_fetch_add(&w->fds, 1) < WALK_FD_BUDGET) {
+            sub.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY);
+        }
+        if (sub.fd == -1) {
+            atomic_fetch_sub(&w->fds, 1);
+        }
+        if (walk_push(w, id, sub) == -1) {
+            if (sub.fd != -1) {
+                close(sub.fd);
+                atomic_fetch_sub(&w->fds, 1);
             }
+            free(sub.path);
+            rv = -1;
         }
+    }
+    if (rv == 0 && errno != 0) {
+        rv = -1;
+    }
+    closedir(dir);
+    atomic_fetch_sub(&w->fds, 1);
+    return rv;
+}
 
-        if (fstatat(root_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1)
-            goto out;
+static void walk_done(struct walk *w, struct walk_item *item) {
+    free(item->path);
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        walk_wake(w, true);
+    }
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_worker *worker = arg;
+    struct walk *w = worker->walk;
+    struct walk_item item;
 
-        if (!S_ISDIR(st.st_mode)) {
+    for (;;) {
+        bool found = walk_take(w, worker->id, false, &item);
+        for (int i = 1; !found && i < w->nworkers; ++i) {
+            found = walk_take(w, (worker->id + i) % w->nworkers, true, &item);
+        }
+        if (found) {
+            if (atomic_load(&w->rv) != 0) {
+                if (item.fd != -1) {
+                    close(item.fd);
+                    atomic_fetch_sub(&w->fds, 1);
+                }
+            } else {
+                int rv = walk_dir(w, worker->id, &item);
+                if (rv != 0) {
+                    walk_fail(w, rv);
+                }
+            }
+            walk_done(w, &item);
             continue;
         }
-        int sub_fd = openat(root_fd, ptr->d_name, flags);
-        if (!find_rec(sub_fd, name, flags, fd))
-            goto out;
+
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add(&w->idle, 1);
+        while (atomic_load(&w->queued) == 0 && atomic_load(&w->pending) > 0) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        atomic_fetch_sub(&w->idle, 1);
+        bool finished = atomic_load(&w->pending) == 0;
+        pthread_mutex_unlock(&w->lock);
+        if (finished) {
+            return NULL;
+        }
     }
+}
 
-    rv = true;
-    out:
-    if (dir)
-        closedir(dir);
-    return rv;
+static int walk_tree(int root_fd, walk_visitor visit, void *ctx) {
+    struct walk w = { .root_fd = root_fd, .visit = visit, .ctx = ctx };
+    struct walk_worker workers[WALK_MAX_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* directory reads mostly wait for I/O, so use more threads than CPUs */
+    w.nworkers = cpus > 0 ? 2 * (int) cpus : 2;
+    if (w.nworkers > WALK_MAX_WORKERS) {
+        w.nworkers = WALK_MAX_WORKERS;
+    }
+    atomic_init(&w.pending, 0);
+    atomic_init(&w.queued, 0);
+    atomic_init(&w.idle, 0);
+    atomic_init(&w.fds, 0);
+    atomic_init(&w.rv, 0);
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.wake, NULL);
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+        w.deques[i].items = NULL;
+        w.deques[i].head = w.deques[i].tail = w.deques[i].cap = 0;
+    }
+
+    struct walk_item root = { .fd = dup(root_fd), .path = malloc(2) };
+    if (root.fd == -1 || !root.path) {
+        if (root.fd != -1) {
+            close(root.fd);
+        }
+        free(root.path);
+        walk_fail(&w, -1);
+    } else {
+        strcpy(root.path, ".");
+        atomic_fetch_add(&w.fds, 1);
+        if (walk_push(&w, 0, root) == -1) {
+            close(root.fd);
+            free(root.path);
+            walk_fail(&w, -1);
+        }
+    }
+
+    int started = 0;
+    for (; atomic_load(&w.rv) == 0 && started < w.nworkers; ++started) {
+        workers[started].walk = &w;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].tid, NULL,
+                           walk_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started == 0 && atomic_load(&w.pending) > 0) {
+        /* could not start any thread, walk on our own */
+        workers[0].walk = &w;
+        workers[0].id = 0;
+        w.nworkers = 1;
+        walk_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].items);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.wake);
+    return atomic_load(&w.rv);
+}
+
+struct find_ctx {
+    const char *name;
+    int flags;
+    atomic_int found;
+    int fd;
+};
+
+static int find_visit(void *ctx, int dir_fd, const char *name) {
+    struct find_ctx *find = ctx;
+
+    if (strcmp(name, find->name) != 0) {
+        return 0;
+    }
+    if (atomic_fetch_add(&find->found, 1) > 0) {
+        return -2;
+    }
+    find->fd = openat(dir_fd, name, find->flags);
+    return find->fd == -1 ? -1 : 0;
 }
 
 int find(int root_fd, const char *name, int flags) {
-    int fd = -1;
-    bool rv = find_rec(dup(root_fd), name, flags, &fd);
-    if (!rv && fd == -1) {
+    struct find_ctx find = { .name = name, .flags = flags, .fd = -1 };
+    atomic_init(&find.found, 0);
+
+    int rv = walk_tree(root_fd, find_visit, &find);
+    if (rv != 0 || find.fd == -1) {
+        if (find.fd != -1) {
+            close(find.fd);
+        }
+        return rv == -1 ? -1 : -2;
+    }
+    return find.fd;
+}
+
+/* A persistent name index, for answering many ‹find› queries against
+ * the same tree without walking it each time. The index is a single
+ * file, written once and then mapped into memory by its readers:
+ *
+ *  • a header (‹struct fidx_header›),
+ *  • one record per directory (‹struct fidx_dir›), root first, with
+ *    the path relative to the root, the time stamp and i-node number
+ *    it had when it was read, and the range of its entries,
+ *  • the entries (‹struct fidx_entry›), grouped by directory and
+ *    sorted by name within each group,
+ *  • ‹nentries› entry numbers sorted by name (then by directory),
+ *    which is what ‹name_index_lookup› bisects, and
+ *  • the names and paths themselves, each terminated by a null byte.
+ *
+ * ‹name_index_refresh› rebuilds the file from the previous one: every
+ * directory is still checked with ‹fstatat›, but only those whose
+ * ‹mtime› or i-node changed (i.e. had entries added, removed or
+ * renamed) are read again; the entries of the rest are copied over.
+ * Time stamps only advance with the (coarse) clock tick, so a
+ * directory changed less than ‹FIDX_RACY_NS› before it was read is
+ * not trusted and is read again on the next refresh.
+ * The new file replaces the old one with ‹renameat›, so that indexes
+ * which are already mapped stay valid. */
+
+#define FIDX_MAGIC   "fidx\0\0\0\1"
+#define FIDX_NONE    UINT32_MAX
+#define FIDX_RACY_NS 100000000
+#define FIDX_RACY    1          /* ‹fidx_dir.flags› */
+
+struct fidx_header {
+    char magic[8];
+    uint32_t ndirs, nentries;
+    uint64_t strings_size;
+};
+
+struct fidx_dir {
+    uint32_t path;              /* offset into the strings */
+    uint32_t first, count;      /* entries of this directory */
+    uint32_t flags;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t dev, ino;
+};
+
+struct fidx_entry {
+    uint32_t name;              /* offset into the strings */
+    uint32_t dir;               /* the directory which contains it */
+    uint32_t child;             /* ‹FIDX_NONE› unless a directory */
+    uint32_t type;              /* ‹DT_*› */
+};
+
+struct name_index {
+    void *map;
+    size_t size;
+    const struct fidx_header *header;
+    const struct fidx_dir *dirs;
+    const struct fidx_entry *entries;
+    const uint32_t *sorted;
+    const char *strings;
+};
+
+/* Counts entries named ‹name›; the first of them (if any) is at
+ * position ‹*first› of the sorted table (see ‹name_index_path›). */
+size_t name_index_lookup(const struct name_index *idx, const char *name,
+                         size_t *first) {
+    size_t n = idx->header->nentries;
+    size_t low = 0, high = n;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const char *key = idx->strings + idx->entries[idx->sorted[mid]].name;
+        if (strcmp(key, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t end = low;
+    while (end < n &&
+           strcmp(idx->strings + idx->entries[idx->sorted[end]].name,
+                  name) == 0) {
+        ++end;
+    }
+    *first = low;
+    return end - low;
+}
+
+/* Store the path (relative to the root) of the entry at position
+ * ‹pos› of the sorted table into ‹buf›; returns its length, or -1 if
+ * it does not fit. */
+int name_index_path(const struct name_index *idx, size_t pos,
+                    char *buf, size_t size) {
+    const struct fidx_entry *ent = idx->entries + idx->sorted[pos];
+    const char *dir = idx->strings + idx->dirs[ent->dir].path;
+    const char *name = idx->strings + ent->name;
+    int len = ent->dir == 0 ? snprintf(buf, size, "%s", name)
+                            : snprintf(buf, size, "%s/%s", dir, name);
+
+    return len < 0 || (size_t) len >= size ? -1 : len;
+}
+
+/* Same as ‹find›, but the link is looked up in the index; ‹root_fd›
+ * must be the directory the index was built from. */
+int find_indexed(const struct name_index *idx, int root_fd,
+                 const char *name, int flags) {
+    char path[PATH_MAX];
+    size_t first;
+
+    if (name_index_lookup(idx, name, &first) != 1) {
+        return -2;
+    }
+    if (name_index_path(idx, first, path, sizeof path) == -1) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return openat(root_fd, path, flags);
+}
+
+int name_index_open(struct name_index *idx, int dir_fd, const char *file) {
+    struct stat st;
+    int fd = openat(dir_fd, file, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    idx->size = st.st_size;
+    idx->map = idx->size < sizeof(struct fidx_header) ? MAP_FAILED :
+               mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (idx->map == MAP_FAILED) {
+        if (idx->size < sizeof(struct fidx_header)) {
+            errno = EINVAL;
+        }
+        return -1;
+    }
+
+    const struct fidx_header *h = idx->header = idx->map;
+    uint64_t dirs = (uint64_t) h->ndirs * sizeof(struct fidx_dir);
+    uint64_t entries = (uint64_t) h->nentries * sizeof(struct fidx_entry);
+    uint64_t sorted = (uint64_t) h->nentries * sizeof(uint32_t);
+    const char *base = idx->map;
+
+    idx->dirs = (const void *) (base + sizeof *h);
+    idx->entries = (const void *) (base + sizeof *h + dirs);
+    idx->sorted = (const void *) (base + sizeof *h + dirs + entries);
+    idx->strings = base + sizeof *h + dirs + entries + sorted;
+
+    bool valid = memcmp(h->magic, FIDX_MAGIC, 8) == 0 && h->ndirs > 0 &&
+                 sizeof *h + dirs + entries + sorted + h->strings_size
+                     == idx->size &&
+                 h->strings_size > 0 &&
+                 idx->strings[h->strings_size - 1] == '\0';
+
+    for (uint32_t i = 0; valid && i < h->ndirs; ++i) {
+        const struct fidx_dir *d = idx->dirs + i;
+        valid = d->path < h->strings_size && d->first <= h->nentries &&
+                d->count <= h->nentries - d->first;
+    }
+    for (uint32_t i = 0; valid && i < h->nentries; ++i) {
+        const struct fidx_entry *e = idx->entries + i;
+        valid = e->name < h->strings_size && e->dir < h->ndirs &&
+                (e->child == FIDX_NONE || e->child < h->ndirs) &&
+                idx->sorted[i] < h->nentries;
+    }
+
+    if (!valid) {
+        munmap(idx->map, idx->size);
+        errno = EINVAL;
         return -1;
     }
-    if (!rv || fd == -1) {
+    return 0;
+}
+
+void name_index_close(struct name_index *idx) {
+    munmap(idx->map, idx->size);
+}
+
+struct fidx_build {
+    int root_fd;
+    const struct name_index *old;   /* or a null pointer */
+    struct fidx_dir *dirs;
+    struct fidx_entry *entries;
+    char *strings;
+    size_t ndirs, nentries, nstrings;
+    size_t dirs_cap, entries_cap, strings_cap;
+    int reread;
+};
+
+static int fidx_grow(void **ptr, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    if (new_cap > FIDX_NONE) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    void *new_ptr = realloc(*ptr, new_cap * size);
+    if (!new_ptr) {
+        return -1;
+    }
+    *ptr = new_ptr;
+    *cap = new_cap;
+    return 0;
+}
+
+static int fidx_string(struct fidx_build *b, const char *str,
+                       uint32_t *offset) {
+    size_t len = strlen(str) + 1;
+    if (fidx_grow((void **) &b->strings, &b->strings_cap,
+                  b->nstrings + len, 1) == -1) {
+        return -1;
+    }
+    memcpy(b->strings + b->nstrings, str, len);
+    *offset = b->nstrings;
+    b->nstrings += len;
+    return 0;
+}
+
+static int fidx_add_entry(struct fidx_build *b, uint32_t dir,
+                          const char *name, uint32_t type, uint32_t child) {
+    if (fidx_grow((void **) &b->entries, &b->entries_cap,
+                  b->nentries + 1, sizeof *b->entries) == -1) {
+        return -1;
+    }
+    struct fidx_entry *e = b->entries + b->nentries;
+    e->dir = dir;
+    e->type = type;
+    e->child = child;           /* the ‹old› directory, for now */
+    if (fidx_string(b, name, &e->name) == -1) {
+        return -1;
+    }
+    ++b->nentries;
+    return 0;
+}
+
+static int fidx_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* The ‹old› directory record for ‹name› in ‹old_dir› (whose entries
+ * are sorted by name), or ‹FIDX_NONE›. */
+static uint32_t fidx_old_child(const struct name_index *old,
+                               uint32_t old_dir, const char *name) {
+    if (!old || old_dir == FIDX_NONE) {
+        return FIDX_NONE;
+    }
+    const struct fidx_dir *d = old->dirs + old_dir;
+    size_t low = d->first, high = d->first + d->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(old->strings + old->entries[mid].name, name);
+        if (cmp == 0) {
+            return old->entries[mid].child;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return FIDX_NONE;
+}
+
+/* Read the entries of directory ‹d› (at ‹path›) from the file system. */
+static int fidx_read(struct fidx_build *b, uint32_t d, const char *path,
+                     uint32_t old_dir) {
+    int fd = openat(b->root_fd, path, O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    int rv = -1;
+
+    if (!dir) {
         if (fd != -1) {
             close(fd);
         }
-        return -2;
+        return -1;
     }
-    return fd;
+
+    struct dirent *ent;
+    while ((errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+            strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = strlen(ent->d_name);
+        char *copy = malloc(len + 2);
+        if (!copy || fidx_grow((void **) &names, &cap, count + 1,
+                               sizeof *names) == -1) {
+            free(copy);
+            goto out;
+        }
+
+        /* the type is kept in front of the name, so that sorting the
+         * pointers (with the type skipped) sorts both */
+        copy[0] = ent->d_type;
+        memcpy(copy + 1, ent->d_name, len + 1);
+        names[count++] = copy + 1;
+    }
+    if (errno != 0) {
+        goto out;
+    }
+
+    if (count > 0) {
+        qsort(names, count, sizeof *names, fidx_name_cmp);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t type = (unsigned char) names[i][-1];
+        struct stat st;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(fd, names[i], &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                goto out;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                   S_ISREG(st.st_mode) ? DT_REG :
+                   S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+        uint32_t old_child = type == DT_DIR ?
+                             fidx_old_child(b->old, old_dir, names[i]) :
+                             FIDX_NONE;
+        if (fidx_add_entry(b, d, names[i], type, old_child) == -1) {
+            goto out;
+        }
+    }
+    rv = 0;
+out:
+    for (size_t i = 0; i < count; ++i) {
+        free(names[i] - 1);
+    }
+    free(names);
+    closedir(dir);
+    return rv;
+}
+
+/* Add directory ‹path› and everything below it, reusing ‹old_dir› of
+ * the previous index where it is still valid; returns the index of
+ * the new record or -1. */
+static long fidx_dir(struct fidx_build *b, const char *path,
+                     uint32_t old_dir) {
+    const struct name_index *old = b->old;
+    struct stat st;
+    struct timespec now;
+
+    if (fstatat(b->root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        clock_gettime(CLOCK_REALTIME, &now) == -1) {
+        return -1;
+    }
+    if (fidx_grow((void **) &b->dirs, &b->dirs_cap, b->ndirs + 1,
+                  sizeof *b->dirs) == -1) {
+        return -1;
+    }
+
+    uint32_t d = b->ndirs++;
+    long long age = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL +
+                    (now.tv_nsec - st.st_mtim.tv_nsec);
+    struct fidx_dir *rec = b->dirs + d;
+    rec->first = b->nentries;
+    rec->flags = age < FIDX_RACY_NS ? FIDX_RACY : 0;
+    rec->mtime_sec = st.st_mtim.tv_sec;
+    rec->mtime_nsec = st.st_mtim.tv_nsec;
+    rec->dev = st.st_dev;
+    rec->ino = st.st_ino;
+    if (fidx_string(b, path, &b->dirs[d].path) == -1) {
+        return -1;
+    }
+
+    const struct fidx_dir *prev = old && old_dir != FIDX_NONE ?
+                                  old->dirs + old_dir : NULL;
+    if (prev && !(prev->flags & FIDX_RACY) &&
+        prev->mtime_sec == st.st_mtim.tv_sec &&
+        prev->mtime_nsec == st.st_mtim.tv_nsec &&
+        prev->dev == (uint64_t) st.st_dev &&
+        prev->ino == (uint64_t) st.st_ino) {
+        for (uint32_t i = prev->first; i < prev->first + prev->count; ++i) {
+            const struct fidx_entry *e = old->entries + i;
+            if (fidx_add_entry(b, d, old->strings + e->name, e->type,
+                               e->child) == -1) {
+                return -1;
+            }
+        }
+    } else {
+        ++b->reread;
+        if (fidx_read(b, d, path, old_dir) == -1) {
+            return -1;
+        }
+    }
+
+    size_t first = b->dirs[d].first;
+    size_t end = b->nentries;
+    b->dirs[d].count = end - first;
+
+    for (size_t i = first; i < end; ++i) {
+        if (b->entries[i].type != DT_DIR) {
+            continue;
+        }
+        const char *name = b->strings + b->entries[i].name;
+        char *sub = d == 0 ? strdup(name) : walk_join(path, name);
+        if (!sub) {
+            return -1;
+        }
+        long child = fidx_dir(b, sub, b->entries[i].child);
+        free(sub);
+        if (child == -1) {
+            return -1;
+        }
+        b->entries[i].child = child;
+    }
+    return d;
+}
+
+struct fidx_key {
+    const char *name;
+    uint32_t entry;
+};
+
+static int fidx_key_cmp(const void *a, const void *b) {
+    const struct fidx_key *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    return cmp ? cmp : (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static int fidx_write_all(int fd, const void *data, size_t size) {
+    const char *ptr = data;
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written == -1) {
+            return -1;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int fidx_write(struct fidx_build *b, int dir_fd, const char *file) {
+    struct fidx_header h = {
+        .ndirs = b->ndirs, .nentries = b->nentries,
+        .strings_size = b->nstrings
+    };
+    struct fidx_key *keys = malloc((b->nentries + 1) * sizeof *keys);
+    uint32_t *sorted = malloc((b->nentries + 1) * sizeof *sorted);
+    char temp[PATH_MAX];
+    int fd = -1, rv = -1;
+    bool created = false;
+
+    memcpy(h.magic, FIDX_MAGIC, 8);
+    if (!keys || !sorted) {
+        goto out;
+    }
+    for (size_t i = 0; i < b->nentries; ++i) {
+        keys[i].name = b->strings + b->entries[i].name;
+        keys[i].entry = i;
+    }
+    qsort(keys, b->nentries, sizeof *keys, fidx_key_cmp);
+    for (size_t i = 0; i < b->nentries; ++i) {
+        sorted[i] = keys[i].entry;
+    }
+
+    int len = snprintf(temp, sizeof temp, "%s.%d", file, getpid());
+    if (len < 0 || (size_t) len >= sizeof temp) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    if ((fd = openat(dir_fd, temp, O_CREAT | O_TRUNC | O_WRONLY,
+                     0666)) == -1) {
+        goto out;
+    }
+    created = true;
+    if (fidx_write_all(fd, &h, sizeof h) == -1 ||
+        fidx_write_all(fd, b->dirs, b->ndirs * sizeof *b->dirs) == -1 ||
+        fidx_write_all(fd, b->entries,
+                       b->nentries * sizeof *b->entries) == -1 ||
+        fidx_write_all(fd, sorted, b->nentries * sizeof *sorted) == -1 ||
+        fidx_write_all(fd, b->strings, b->nstrings) == -1) {
+        goto out;
+    }
+    if (close(fd) == -1) {
+        fd = -1;
+        goto out;
+    }
+    fd = -1;
+    rv = renameat(dir_fd, temp, dir_fd, file);
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (rv == -1 && created) {
+        unlinkat(dir_fd, temp, 0);
+    }
+    free(keys);
+    free(sorted);
+    return rv;
+}
+
+static int fidx_update(int root_fd, int dir_fd, const char *file,
+                       const struct name_index *old) {
+    struct fidx_build b = { .root_fd = root_fd, .old = old };
+    int rv = -1;
+
+    if (fidx_dir(&b, ".", old ? 0 : FIDX_NONE) != -1 &&
+        fidx_write(&b, dir_fd, file) != -1) {
+        rv = b.reread;
+    }
+    free(b.dirs);
+    free(b.entries);
+    free(b.strings);
+    return rv;
+}
+
+/* Walk the tree under ‹root_fd› and store its index into ‹file› in
+ * ‹dir_fd›. Returns the number of directories read, or -1. */
+int name_index_build(int root_fd, int dir_fd, const char *file) {
+    return fidx_update(root_fd, dir_fd, file, NULL);
+}
+
+/* Bring the index in ‹file› up to date, reading only the directories
+ * which changed since it was written (or all, if it does not exist).
+ * Returns the number of directories read, or -1. */
+int name_index_refresh(int root_fd, int dir_fd, const char *file) {
+    struct name_index old;
+
+    if (name_index_open(&old, dir_fd, file) == -1) {
+        return errno == ENOENT || errno == EINVAL ?
+               name_index_build(root_fd, dir_fd, file) : -1;
+    }
+    int rv = fidx_update(root_fd, dir_fd, file, &old);
+    name_index_close(&old);
+    return rv;
 }
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
@@ -169,6 +1004,90 @@ int main() {
     assert(find(work_fd, "foo", O_RDONLY) == -2);
     assert(find(file_fd, "foo", O_RDONLY) == -1);
 
+    /* more directories than the walker keeps open at once */
+    char dir_name[16];
+    int wide_fd = mkdir_or_die(work_fd, "wide");
+    for (int i = 0; i < 200; ++i) {
+        snprintf(dir_name, sizeof dir_name, "d%d", i);
+        int fd = mkdir_or_die(wide_fd, dir_name);
+        close_or_warn(mkdir_or_die(fd, "e"), "e");
+        close_or_warn(fd, dir_name);
+    }
+    int deep_fd = openat(wide_fd, "d199/e", O_DIRECTORY);
+    if (deep_fd == -1)
+        err(1, "opening d199/e");
+    write_file(deep_fd, "needle", "z");
+
+    file_fd = find(work_fd, "needle", O_RDONLY);
+    assert(file_fd >= 0);
+    assert(check_file(file_fd, "z"));
+    close_or_warn(file_fd, "file returned by find");
+    file_fd = find(work_fd, "d150", O_RDONLY | O_DIRECTORY);
+    assert(file_fd >= 0);
+    close_or_warn(file_fd, "directory returned by find");
+    assert(find(work_fd, "e", O_RDONLY) == -2);
+
+    /* the same queries, answered from an index */
+    struct name_index idx;
+    size_t first;
+    char path[64];
+
+    unlink_if_exists(AT_FDCWD, "zt.p5_index");
+    assert(name_index_refresh(work_fd, AT_FDCWD, "zt.p5_index") >= 403);
+    assert(name_index_open(&idx, AT_FDCWD, "zt.p5_index") == 0);
+    assert(name_index_lookup(&idx, "e", &first) == 200);
+    assert(name_index_path(&idx, first, path, sizeof path) > 0);
+    assert(strncmp(path, "wide/d", 6) == 0);
+    assert(name_index_lookup(&idx, "foo", &first) == 2);
+    assert(name_index_path(&idx, first, path, sizeof path) == 3);
+    assert(strcmp(path, "foo") == 0);
+    assert(find_indexed(&idx, work_fd, "foo", O_RDONLY) == -2);
+    assert(find_indexed(&idx, work_fd, "foob", O_RDONLY) == -2);
+    file_fd = find_indexed(&idx, work_fd, "needle", O_RDONLY);
+    assert(file_fd >= 0);
+    assert(check_file(file_fd, "z"));
+    close_or_warn(file_fd, "file returned by find_indexed");
+    file_fd = find_indexed(&idx, work_fd, "bar", O_RDONLY);
+    assert(file_fd >= 0);
+    assert(check_file(file_fd, "y"));
+    close_or_warn(file_fd, "file returned by find_indexed");
+    name_index_close(&idx);
+
+    /* once the directories are no longer racy, a refresh only reads
+     * those which changed */
+    nanosleep(&(struct timespec) { .tv_nsec = 2 * FIDX_RACY_NS }, NULL);
+    assert(name_index_refresh(work_fd, AT_FDCWD, "zt.p5_index") >= 0);
+    assert(name_index_refresh(work_fd, AT_FDCWD, "zt.p5_index") == 0);
+
+    int d5_fd = openat(wide_fd, "d5/e", O_DIRECTORY);
+    if (d5_fd == -1)
+        err(1, "opening d5/e");
+    write_file(d5_fd, "needle2", "w");
+    if (unlinkat(wide_fd, "d7/e", AT_REMOVEDIR) == -1 ||
+        unlinkat(wide_fd, "d7", AT_REMOVEDIR) == -1)
+        err(1, "removing d7");
+
+    assert(name_index_refresh(work_fd, AT_FDCWD, "zt.p5_index") == 2);
+    assert(name_index_open(&idx, AT_FDCWD, "zt.p5_index") == 0);
+    assert(name_index_lookup(&idx, "e", &first) == 199);
+    assert(name_index_lookup(&idx, "d7", &first) == 0);
+    assert(name_index_lookup(&idx, "needle2", &first) == 1);
+    assert(name_index_path(&idx, first, path, sizeof path) > 0);
+    assert(strcmp(path, "wide/d5/e/needle2") == 0);
+    file_fd = find_indexed(&idx, work_fd, "needle2", O_RDONLY);
+    assert(file_fd >= 0);
+    assert(check_file(file_fd, "w"));
+    close_or_warn(file_fd, "file returned by find_indexed");
+    name_index_close(&idx);
+
+    unlink_if_exists(d5_fd, "needle2");
+    unlink_if_exists(AT_FDCWD, "zt.p5_index");
+    close_or_warn(d5_fd, "d5/e");
+
+    unlink_if_exists(deep_fd, "needle");
+    close_or_warn(deep_fd, "d199/e");
+    close_or_warn(wide_fd, "zt.p5_root/wide");
+
     close_or_warn(subd_fd, "zt.p5_root/subdir");
     close_or_warn(work_fd, "zt.p5_root");
 
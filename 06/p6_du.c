@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* DT_* */
 
 #include <unistd.h>     /* read, write, unlinkat, … */
 #include <fcntl.h>      /* openat, O_* */
@@ -9,6 +10,15 @@
 #include <err.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdlib.h>     /* malloc, realloc, free */
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdint.h>     /* uint32_t, uint64_t */
+#include <stdio.h>      /* snprintf */
+#include <limits.h>     /* PATH_MAX */
+#include <sys/mman.h>   /* mmap, munmap */
+#include <sys/inotify.h>
+#include <time.h>       /* clock_gettime */
 
 /* Naprogramujte proceduru ‹disk_usage›, která prohledá zadaný
  * podstrom a sečte velikosti všech «obyčejných» souborů (v bajtech,
@@ -24,61 +34,1259 @@
  *  • dojde-li při zpracování podstromu k systémové chybě, výsledek
  *    bude -1. */
 
-int disk_usage_rec(int root_fd, ssize_t *size) {
-    if (root_fd == -1)
-        return -1;
+#define WALK_MAX_WORKERS 16
+#define WALK_FD_BUDGET   64     /* open directory descriptors, in total */
 
-    int rv = -1;
-    DIR *dir = fdopendir(root_fd);
+/* The sizes are summed by a parallel walk. Every worker owns a
+ * deque of directories waiting to be read: it pushes and pops at
+ * one end, so it goes depth-first, and an idle worker steals from
+ * the other end, where the bigger (shallower) subtrees are. At most
+ * ‹WALK_FD_BUDGET› queued directories stay open, the rest are
+ * reopened by their path from the root.
+ *
+ * Only regular files matter for ‹disk_usage›, hence the visitor is
+ * only called for those (concurrently, from several threads), with
+ * the descriptor of their directory and their name. Whenever
+ * ‹readdir› reports the type, nothing is ‹stat›-ed by the walker and
+ * ‹st› is a null pointer; otherwise ‹st› is the result of the
+ * ‹fstatat› that told the type. A non-zero result of the visitor
+ * stops the walk and is returned by ‹walk_tree›, which otherwise
+ * returns 0, or -1 on a system error. */
 
-    if (!dir)
-        goto out;
+typedef int (*walk_visitor)(void *ctx, int dir_fd, const char *name,
+                            const struct stat *st);
+
+struct walk_item {
+    int fd;                     /* -1 if it has to be reopened */
+    char *path;                 /* relative to the root */
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    int head, tail, cap;
+};
+
+struct walk {
+    int root_fd;
+    walk_visitor visit;
+    void *ctx;
+    int nworkers;
+    struct walk_deque deques[WALK_MAX_WORKERS];
+
+    atomic_int pending;         /* queued or being processed */
+    atomic_int queued;
+    atomic_int idle;
+    atomic_int fds;
+    atomic_int rv;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    pthread_t tid;
+};
+
+static void walk_wake(struct walk *w, bool all) {
+    if (atomic_load(&w->idle) > 0 || all) {
+        pthread_mutex_lock(&w->lock);
+        if (all) {
+            pthread_cond_broadcast(&w->wake);
+        } else {
+            pthread_cond_signal(&w->wake);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static int walk_push(struct walk *w, int id, struct walk_item item) {
+    struct walk_deque *d = &w->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        int live = d->tail - d->head;
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    live * sizeof(struct walk_item));
+        }
+        if (live == d->cap) {
+            int cap = d->cap ? 2 * d->cap : 64;
+            struct walk_item *items = realloc(d->items,
+                                              cap * sizeof(struct walk_item));
+            if (!items) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->items = items;
+            d->cap = cap;
+        }
+        d->head = 0;
+        d->tail = live;
+    }
+    d->items[d->tail++] = item;
+    atomic_fetch_add(&w->pending, 1);
+    atomic_fetch_add(&w->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+    walk_wake(w, false);
+    return 0;
+}
+
+static bool walk_take(struct walk *w, int id, bool steal,
+                      struct walk_item *item) {
+    struct walk_deque *d = &w->deques[id];
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        atomic_fetch_sub(&w->queued, 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
 
+static char *walk_join(const char *dir, const char *name) {
+    size_t dlen = strlen(dir);
+    char *path = malloc(dlen + strlen(name) + 2);
+    if (path) {
+        memcpy(path, dir, dlen);
+        path[dlen] = '/';
+        strcpy(path + dlen + 1, name);
+    }
+    return path;
+}
+
+static void walk_fail(struct walk *w, int rv) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&w->rv, &expected, rv);
+}
+
+static int walk_dir(struct walk *w, int id, struct walk_item *item) {
+    int fd = item->fd;
+    if (fd == -1) {
+        fd = openat(w->root_fd, item->path, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            return -1;
+        }
+        atomic_fetch_add(&w->fds, 1);
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        atomic_fetch_sub(&w->fds, 1);
+        return -1;
+    }
+
+    /* the root descriptor is shared with the caller (through ‹dup›),
+     * so its position is not necessarily at the start */
     rewinddir(dir);
-    struct dirent *ptr;
+
+    int rv = 0;
+    struct dirent *ent;
     struct stat st;
-    while ((ptr = readdir(dir))) {
-        if (strcmp(ptr->d_name, ".") == 0 ||
-            strcmp(ptr->d_name, "..") == 0)
+    while (rv == 0 && atomic_load(&w->rv) == 0 &&
+           (errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+            strcmp(ent->d_name, "..") == 0) {
             continue;
+        }
+        bool is_dir = ent->d_type == DT_DIR;
+        bool is_reg = ent->d_type == DT_REG;
+        const struct stat *stp = NULL;
+        if (ent->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                rv = -1;
+                break;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+            is_reg = S_ISREG(st.st_mode);
+            stp = &st;
+        }
+        if (is_reg) {
+            rv = w->visit(w->ctx, fd, ent->d_name, stp);
+            continue;
+        }
+        if (!is_dir) {
+            continue;
+        }
 
-        if (fstatat(root_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1)
-            goto out;
+        struct walk_item sub = { .fd = -1 };
+        if (!(sub.path = walk_join(item->path, ent->d_name))) {
+            rv = -1;
+            break;
+        }
+        if (atomic_fetch_add(&w->fds, 1) < WALK_FD_BUDGET) {
+            sub.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY);
+        }
+        if (sub.fd == -1) {
+            atomic_fetch_sub(&w->fds, 1);
+        }
+        if (walk_push(w, id, sub) == -1) {
+            if (sub.fd != -1) {
+                close(sub.fd);
+                atomic_fetch_sub(&w->fds, 1);
+            }
+            free(sub.path);
+            rv = -1;
+        }
+    }
+    if (rv == 0 && errno != 0) {
+        rv = -1;
+    }
+    closedir(dir);
+    atomic_fetch_sub(&w->fds, 1);
+    return rv;
+}
 
-        if (S_ISREG(st.st_mode)) {
-            if (st.st_nlink != 1) {
-                rv = 2;
-                goto out;
+static void walk_done(struct walk *w, struct walk_item *item) {
+    free(item->path);
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        walk_wake(w, true);
+    }
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_worker *worker = arg;
+    struct walk *w = worker->walk;
+    struct walk_item item;
+
+    for (;;) {
+        bool found = walk_take(w, worker->id, false, &item);
+        for (int i = 1; !found && i < w->nworkers; ++i) {
+            found = walk_take(w, (worker->id + i) % w->nworkers, true, &item);
+        }
+        if (found) {
+            if (atomic_load(&w->rv) != 0) {
+                if (item.fd != -1) {
+                    close(item.fd);
+                    atomic_fetch_sub(&w->fds, 1);
+                }
+            } else {
+                int rv = walk_dir(w, worker->id, &item);
+                if (rv != 0) {
+                    walk_fail(w, rv);
+                }
+            }
+            walk_done(w, &item);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add(&w->idle, 1);
+        while (atomic_load(&w->queued) == 0 && atomic_load(&w->pending) > 0) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        atomic_fetch_sub(&w->idle, 1);
+        bool finished = atomic_load(&w->pending) == 0;
+        pthread_mutex_unlock(&w->lock);
+        if (finished) {
+            return NULL;
+        }
+    }
+}
+
+static int walk_tree(int root_fd, walk_visitor visit, void *ctx) {
+    struct walk w = { .root_fd = root_fd, .visit = visit, .ctx = ctx };
+    struct walk_worker workers[WALK_MAX_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* directory reads mostly wait for I/O, so use more threads than CPUs */
+    w.nworkers = cpus > 0 ? 2 * (int) cpus : 2;
+    if (w.nworkers > WALK_MAX_WORKERS) {
+        w.nworkers = WALK_MAX_WORKERS;
+    }
+    atomic_init(&w.pending, 0);
+    atomic_init(&w.queued, 0);
+    atomic_init(&w.idle, 0);
+    atomic_init(&w.fds, 0);
+    atomic_init(&w.rv, 0);
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.wake, NULL);
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+        w.deques[i].items = NULL;
+        w.deques[i].head = w.deques[i].tail = w.deques[i].cap = 0;
+    }
+
+    struct walk_item root = { .fd = dup(root_fd), .path = malloc(2) };
+    if (root.fd == -1 || !root.path) {
+        if (root.fd != -1) {
+            close(root.fd);
+        }
+        free(root.path);
+        walk_fail(&w, -1);
+    } else {
+        strcpy(root.path, ".");
+        atomic_fetch_add(&w.fds, 1);
+        if (walk_push(&w, 0, root) == -1) {
+            close(root.fd);
+            free(root.path);
+            walk_fail(&w, -1);
+        }
+    }
+
+    int started = 0;
+    for (; atomic_load(&w.rv) == 0 && started < w.nworkers; ++started) {
+        workers[started].walk = &w;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].tid, NULL,
+                           walk_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started == 0 && atomic_load(&w.pending) > 0) {
+        /* could not start any thread, walk on our own */
+        workers[0].walk = &w;
+        workers[0].id = 0;
+        w.nworkers = 1;
+        walk_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].items);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.wake);
+    return atomic_load(&w.rv);
+}
+
+/* An open-addressing hash set of (dev, ino) pairs. The table has
+ * a power-of-two size, is kept at most half full and uses linear
+ * probing, so a lookup usually touches a single cache line. A slot
+ * with both fields zero is free; the (0, 0) pair itself, should it
+ * ever come up, is remembered in ‹has_zero› instead. An all-zero
+ * ‹struct inode_set› is a valid empty set. */
+
+struct inode_key {
+    dev_t dev;
+    ino_t ino;
+};
+
+struct inode_set {
+    struct inode_key *slots;
+    size_t count, capacity;
+    bool has_zero;
+};
+
+static size_t inode_hash(dev_t dev, ino_t ino) {
+    uint64_t d = (uint64_t) dev;
+    uint64_t x = (uint64_t) ino ^ (d << 32 | d >> 32);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static struct inode_key *inode_slot(struct inode_key *slots, size_t capacity,
+                                    dev_t dev, ino_t ino) {
+    size_t i = inode_hash(dev, ino) & (capacity - 1);
+    while ((slots[i].dev != 0 || slots[i].ino != 0) &&
+           (slots[i].dev != dev || slots[i].ino != ino)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static bool inode_set_grow(struct inode_set *set) {
+    size_t capacity = set->capacity ? 2 * set->capacity : 64;
+    struct inode_key *slots = calloc(capacity, sizeof(struct inode_key));
+    if (!slots) {
+        return false;
+    }
+    for (size_t i = 0; i < set->capacity; ++i) {
+        struct inode_key *key = &set->slots[i];
+        if (key->dev != 0 || key->ino != 0) {
+            *inode_slot(slots, capacity, key->dev, key->ino) = *key;
+        }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    return true;
+}
+
+/* Returns 1 if the pair was added, 0 if it was already present and
+ * -1 if memory could not be allocated. */
+int inode_set_add(struct inode_set *set, dev_t dev, ino_t ino) {
+    if (dev == 0 && ino == 0) {
+        if (set->has_zero) {
+            return 0;
+        }
+        set->has_zero = true;
+        ++set->count;
+        return 1;
+    }
+    if (2 * (set->count + 1) > set->capacity && !inode_set_grow(set)) {
+        return -1;
+    }
+    struct inode_key *slot = inode_slot(set->slots, set->capacity, dev, ino);
+    if (slot->ino == ino && slot->dev == dev) {
+        return 0;
+    }
+    slot->dev = dev;
+    slot->ino = ino;
+    ++set->count;
+    return 1;
+}
+
+void inode_set_free(struct inode_set *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->count = set->capacity = 0;
+    set->has_zero = false;
+}
+
+struct du_ctx {
+    atomic_llong size;
+    bool shared;                /* count multiply-linked files once */
+    pthread_mutex_t lock;       /* protects ‹seen› */
+    struct inode_set seen;
+};
+
+static int du_visit(void *ctx, int dir_fd, const char *name,
+                    const struct stat *st) {
+    struct du_ctx *du = ctx;
+    struct stat buf;
+
+    if (!st) {
+        if (fstatat(dir_fd, name, &buf, AT_SYMLINK_NOFOLLOW) == -1) {
+            return -1;
+        }
+        st = &buf;
+    }
+    if (st->st_nlink != 1) {
+        if (!du->shared) {
+            return -2;
+        }
+        pthread_mutex_lock(&du->lock);
+        int added = inode_set_add(&du->seen, st->st_dev, st->st_ino);
+        pthread_mutex_unlock(&du->lock);
+        if (added != 1) {
+            return added;       /* -1 or already counted */
+        }
+    }
+    atomic_fetch_add(&du->size, st->st_size);
+    return 0;
+}
+
+static ssize_t disk_usage_walk(int root_fd, bool shared) {
+    struct du_ctx du = { .shared = shared };
+    atomic_init(&du.size, 0);
+    pthread_mutex_init(&du.lock, NULL);
+
+    int rv = walk_tree(root_fd, du_visit, &du);
+    pthread_mutex_destroy(&du.lock);
+    inode_set_free(&du.seen);
+    if (rv != 0) {
+        return rv;
+    }
+    return atomic_load(&du.size);
+}
+
+ssize_t disk_usage(int root_fd) {
+    return disk_usage_walk(root_fd, false);
+}
+
+/* Like ‹disk_usage›, but instead of failing on a file with more than
+ * one link, counts each such file once (the way ‹du› does), tracking
+ * the (dev, ino) pairs already seen in a hash set. Only multiply-linked
+ * files go through the set (and its lock), so it stays small. */
+
+ssize_t disk_usage_shared(int root_fd) {
+    return disk_usage_walk(root_fd, true);
+}
+
+/* For repeated measurements of a large, mostly unchanging tree, the
+ * results can be kept in a ‹du_index›: a summary of every directory
+ * (the total size of the regular files directly in it and whether any
+ * of them has more than one link), its subdirectories and the (dev,
+ * ino, mtime, ctime) of the directory as of its last reading. On each
+ * ‹du_index_usage›, a directory is read again only if its mtime or
+ * ctime differs; for the others, the cached summary is used and only
+ * their subdirectories are checked. That costs an ‹openat› and an
+ * ‹fstat› per directory instead of reading every directory and
+ * calling ‹fstatat› on every file.
+ *
+ * The directory timestamps only change when entries are added,
+ * removed or renamed – a file rewritten in place (or given another
+ * hard link from elsewhere) does not touch them. With the
+ * ‹DU_INDEX_INOTIFY› flag, every directory is also watched with
+ * inotify, which reports those changes too; ‹du_index_usage› then
+ * only reads directories for which an event arrived since the last
+ * call and does not touch the others at all. Without it, in-place
+ * changes of file sizes are only picked up when their directory
+ * changes for another reason.
+ *
+ * The summaries outlive the process: ‹du_index_save› stores them in
+ * a file and ‹du_index_load› starts from that file instead of an
+ * empty index, so a monitor which runs every so often only reads the
+ * directories changed since its last run (‹disk_usage_cached› does
+ * all of that in one call). A loaded index has no inotify watches
+ * yet, so its first ‹du_index_usage› checks the times of every
+ * directory even with ‹DU_INDEX_INOTIFY›.
+ *
+ * The results are those of ‹disk_usage›: the total, -2 if there is
+ * a multiply-linked file or -1 on a system error. */
+
+#define DU_INDEX_INOTIFY 1
+
+#define DU_NONE ((size_t) -1)
+
+struct du_dir {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;
+    long long files;            /* regular files directly inside */
+    bool shared;                /* one of them has more links */
+    bool dirty;                 /* has to be read again */
+    int wd;                     /* inotify watch or -1 */
+    unsigned gen;               /* last refresh which reached it */
+    size_t parent;
+    char *name;                 /* within ‹parent› */
+    size_t *subs, nsubs;
+};
+
+struct du_index {
+    int root_fd;
+    int in_fd;                  /* inotify instance or -1 */
+    unsigned gen;
+
+    struct du_dir *dirs;
+    size_t ndirs, capacity;
+    size_t free_dir;            /* list of unused entries, via ‹parent› */
+
+    size_t *map;                /* (dev, ino) → index + 1, 0 = empty */
+    size_t map_capacity, map_count;
+
+    size_t *by_wd;              /* inotify watch → index + 1 */
+    size_t wd_capacity;
+
+    bool polling;               /* check the times of every directory */
+    bool unwatched;             /* loaded; no watches in place yet */
+    size_t reread;              /* directories read by the last call */
+};
+
+static size_t *du_map_slot(struct du_index *idx, dev_t dev, ino_t ino) {
+    size_t mask = idx->map_capacity - 1;
+    size_t i = inode_hash(dev, ino) & mask;
+    while (idx->map[i]) {
+        struct du_dir *dir = &idx->dirs[idx->map[i] - 1];
+        if (dir->dev == dev && dir->ino == ino) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &idx->map[i];
+}
+
+/* Rebuild the map from the live directories, with room for ‹count›. */
+static bool du_map_rebuild(struct du_index *idx, size_t count) {
+    size_t capacity = 64;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    size_t *map = calloc(capacity, sizeof(size_t));
+    if (!map) {
+        return false;
+    }
+    free(idx->map);
+    idx->map = map;
+    idx->map_capacity = capacity;
+    idx->map_count = 0;
+    for (size_t i = 0; i < idx->ndirs; ++i) {
+        if (idx->dirs[i].name) {
+            *du_map_slot(idx, idx->dirs[i].dev, idx->dirs[i].ino) = i + 1;
+            ++idx->map_count;
+        }
+    }
+    return true;
+}
+
+/* Find the directory, or create a new (dirty) one; DU_NONE if out of
+ * memory. */
+static size_t du_dir_get(struct du_index *idx, const struct stat *st,
+                         size_t parent, const char *name) {
+    size_t *slot = du_map_slot(idx, st->st_dev, st->st_ino);
+    if (*slot) {
+        return *slot - 1;
+    }
+    if (2 * (idx->map_count + 1) > idx->map_capacity) {
+        if (!du_map_rebuild(idx, idx->map_count + 1)) {
+            return DU_NONE;
+        }
+        slot = du_map_slot(idx, st->st_dev, st->st_ino);
+    }
+
+    size_t i = idx->free_dir;
+    if (i != DU_NONE) {
+        idx->free_dir = idx->dirs[i].parent;
+    } else {
+        if (idx->ndirs == idx->capacity) {
+            size_t capacity = idx->capacity ? 2 * idx->capacity : 64;
+            struct du_dir *dirs = realloc(idx->dirs,
+                                          capacity * sizeof(struct du_dir));
+            if (!dirs) {
+                return DU_NONE;
             }
-            *size += st.st_size;
+            idx->dirs = dirs;
+            idx->capacity = capacity;
         }
+        i = idx->ndirs++;
+    }
 
-        if (S_ISDIR(st.st_mode)) {
-            int sub_fd = openat(root_fd, ptr->d_name,
-                                O_DIRECTORY | O_RDONLY);
+    struct du_dir *dir = &idx->dirs[i];
+    memset(dir, 0, sizeof(struct du_dir));
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->dirty = true;
+    dir->wd = -1;
+    dir->parent = parent;
+    if (!(dir->name = strdup(name))) {
+        dir->parent = idx->free_dir;
+        idx->free_dir = i;
+        return DU_NONE;
+    }
+    *slot = i + 1;
+    ++idx->map_count;
+    return i;
+}
+
+static bool du_same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* Timestamps only advance with the (coarse) clock tick, so a change
+ * made right after we read the directory may leave them as they were.
+ * A directory changed less than ‹DU_RACY_NS› before it was read is
+ * therefore read again on the next call, rather than trusted. */
+#define DU_RACY_NS 100000000
+
+static bool du_recent(struct timespec now, struct timespec t) {
+    long long ns = (now.tv_sec - t.tv_sec) * 1000000000LL +
+                   (now.tv_nsec - t.tv_nsec);
+    return ns < DU_RACY_NS;
+}
+
+static bool du_racy(const struct stat *st) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return du_recent(now, st->st_mtim) || du_recent(now, st->st_ctim);
+}
 
-            if (disk_usage_rec(sub_fd, size) == -1)
+static int du_watch(struct du_index *idx, size_t i, int fd) {
+    char path[32];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    int wd = inotify_add_watch(idx->in_fd, path,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+                               IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd == -1) {
+        return -1;
+    }
+    if ((size_t) wd >= idx->wd_capacity) {
+        size_t capacity = idx->wd_capacity ? idx->wd_capacity : 64;
+        while (capacity <= (size_t) wd) {
+            capacity *= 2;
+        }
+        size_t *by_wd = realloc(idx->by_wd, capacity * sizeof(size_t));
+        if (!by_wd) {
+            inotify_rm_watch(idx->in_fd, wd);
+            return -1;
+        }
+        memset(by_wd + idx->wd_capacity, 0,
+               (capacity - idx->wd_capacity) * sizeof(size_t));
+        idx->by_wd = by_wd;
+        idx->wd_capacity = capacity;
+    }
+    idx->by_wd[wd] = i + 1;
+    idx->dirs[i].wd = wd;
+    return 0;
+}
+
+/* Read directory ‹i› (open as ‹fd›, with metadata ‹st›) again. */
+static int du_scan(struct du_index *idx, size_t i, int fd,
+                   const struct stat *st) {
+    int dup_fd = dup(fd);
+    DIR *dir = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+    if (!dir) {
+        if (dup_fd != -1) {
+            close(dup_fd);
+        }
+        return -1;
+    }
+    rewinddir(dir);
+
+    long long files = 0;
+    bool shared = false;
+    size_t *subs = NULL, nsubs = 0, capacity = 0;
+    struct dirent *ent;
+    struct stat ent_st;
+    int rv = -1;
+
+    while ((errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        if (ent->d_type != DT_REG && ent->d_type != DT_DIR &&
+            ent->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        if (fstatat(fd, ent->d_name, &ent_st, AT_SYMLINK_NOFOLLOW) == -1) {
+            goto out;
+        }
+        if (S_ISREG(ent_st.st_mode)) {
+            files += ent_st.st_size;
+            shared = shared || ent_st.st_nlink != 1;
+        }
+        if (!S_ISDIR(ent_st.st_mode)) {
+            continue;
+        }
+        if (nsubs == capacity) {
+            capacity = capacity ? 2 * capacity : 8;
+            size_t *bigger = realloc(subs, capacity * sizeof(size_t));
+            if (!bigger) {
+                goto out;
+            }
+            subs = bigger;
+        }
+        size_t sub = du_dir_get(idx, &ent_st, i, ent->d_name);
+        if (sub == DU_NONE) {
+            goto out;
+        }
+        /* it may have been moved here from elsewhere */
+        if (idx->dirs[sub].parent != i ||
+            strcmp(idx->dirs[sub].name, ent->d_name) != 0) {
+            char *name = strdup(ent->d_name);
+            if (!name) {
                 goto out;
+            }
+            free(idx->dirs[sub].name);
+            idx->dirs[sub].name = name;
+            idx->dirs[sub].parent = i;
         }
+        subs[nsubs++] = sub;
+    }
+    if (errno != 0) {
+        goto out;
     }
 
+    struct du_dir *self = &idx->dirs[i];
+    free(self->subs);
+    self->subs = subs;
+    self->nsubs = nsubs;
+    subs = NULL;
+    self->files = files;
+    self->shared = shared;
+    self->mtime = st->st_mtim;
+    self->ctime = st->st_ctim;
+    self->dirty = du_racy(st);
+    ++idx->reread;
     rv = 0;
-    out:
-    if (dir)
-        closedir(dir);
+out:
+    free(subs);
+    closedir(dir);
+    return rv;
+}
+
+/* Open directory ‹i› through the chain of its parents. */
+static int du_open(struct du_index *idx, size_t i) {
+    if (idx->dirs[i].parent == DU_NONE) {
+        return dup(idx->root_fd);
+    }
+    int parent_fd = du_open(idx, idx->dirs[i].parent);
+    if (parent_fd == -1) {
+        return -1;
+    }
+    int fd = openat(parent_fd, idx->dirs[i].name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    close(parent_fd);
+    return fd;
+}
+
+static void du_mark_parent(struct du_index *idx, size_t i) {
+    if (idx->dirs[i].parent != DU_NONE) {
+        idx->dirs[idx->dirs[i].parent].dirty = true;
+    } else {
+        idx->dirs[i].dirty = true;
+    }
+}
+
+struct du_total {
+    long long size;
+    bool shared;
+};
 
+/* Refresh directory ‹i› and its subtree, adding it to ‹total›. In the
+ * polling mode, ‹fd› is the open directory (borrowed); otherwise, it
+ * is -1 and the directory is only opened if it is dirty. */
+static int du_refresh(struct du_index *idx, size_t i, int fd,
+                      struct du_total *total) {
+    struct stat st;
+    int own_fd = -1;
+    int rv = -1;
+
+    idx->dirs[i].gen = idx->gen;
+    if (fd == -1 && idx->dirs[i].dirty) {
+        if ((fd = own_fd = du_open(idx, i)) == -1) {
+            return -1;
+        }
+    }
+    if (fd != -1) {
+        if (fstat(fd, &st) == -1) {
+            goto out;
+        }
+        if (st.st_dev != idx->dirs[i].dev || st.st_ino != idx->dirs[i].ino) {
+            /* replaced under our hands; the parent has changed too */
+            du_mark_parent(idx, i);
+            goto out;
+        }
+        if (idx->in_fd != -1 && idx->dirs[i].wd == -1 &&
+            du_watch(idx, i, fd) == -1) {
+            goto out;
+        }
+        if ((idx->dirs[i].dirty ||
+             !du_same_time(st.st_mtim, idx->dirs[i].mtime) ||
+             !du_same_time(st.st_ctim, idx->dirs[i].ctime)) &&
+            du_scan(idx, i, fd, &st) == -1) {
+            idx->dirs[i].dirty = true;
+            goto out;
+        }
+    }
+
+    total->size += idx->dirs[i].files;
+    total->shared = total->shared || idx->dirs[i].shared;
+
+    for (size_t s = 0; s < idx->dirs[i].nsubs; ++s) {
+        size_t sub = idx->dirs[i].subs[s];
+        int sub_fd = -1;
+        if (idx->polling) {
+            sub_fd = openat(fd, idx->dirs[sub].name,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub_fd == -1) {
+                idx->dirs[i].dirty = true;
+                goto out;
+            }
+        }
+        int sub_rv = du_refresh(idx, sub, sub_fd, total);
+        if (sub_fd != -1) {
+            close(sub_fd);
+        }
+        if (sub_rv == -1) {
+            goto out;
+        }
+    }
+    rv = 0;
+out:
+    if (own_fd != -1) {
+        close(own_fd);
+    }
     return rv;
 }
 
-ssize_t disk_usage(int root_fd) {
-    ssize_t size = 0;
-    int rv;
-    rv = disk_usage_rec(dup(root_fd), &size);
+/* Mark the directories which have seen changes since the last call. */
+static int du_drain(struct du_index *idx) {
+    _Alignas(struct inotify_event) char buffer[16384];
+    ssize_t bytes;
+
+    while ((bytes = read(idx->in_fd, buffer, sizeof buffer)) > 0) {
+        for (char *ptr = buffer; ptr < buffer + bytes; ) {
+            struct inotify_event *ev = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (size_t i = 0; i < idx->ndirs; ++i) {
+                    idx->dirs[i].dirty = true;
+                }
+                continue;
+            }
+            if (ev->wd < 0 || (size_t) ev->wd >= idx->wd_capacity ||
+                !idx->by_wd[ev->wd]) {
+                continue;
+            }
+            size_t i = idx->by_wd[ev->wd] - 1;
+            if (ev->mask & IN_IGNORED) {
+                idx->by_wd[ev->wd] = 0;
+                idx->dirs[i].wd = -1;
+                du_mark_parent(idx, i);
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                du_mark_parent(idx, i);
+            } else {
+                idx->dirs[i].dirty = true;
+            }
+        }
+    }
+    return bytes == -1 && errno != EAGAIN ? -1 : 0;
+}
+
+/* Drop the directories which the last refresh did not reach. */
+static int du_sweep(struct du_index *idx) {
+    size_t removed = 0;
+    for (size_t i = 0; i < idx->ndirs; ++i) {
+        struct du_dir *dir = &idx->dirs[i];
+        if (!dir->name || dir->gen == idx->gen) {
+            continue;
+        }
+        if (dir->wd != -1) {
+            inotify_rm_watch(idx->in_fd, dir->wd);
+            idx->by_wd[dir->wd] = 0;
+        }
+        free(dir->name);
+        free(dir->subs);
+        dir->name = NULL;
+        dir->subs = NULL;
+        dir->parent = idx->free_dir;
+        idx->free_dir = i;
+        ++removed;
+    }
+    if (removed && !du_map_rebuild(idx, idx->map_count - removed)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void du_free_dirs(struct du_dir *dirs, size_t ndirs) {
+    for (size_t i = 0; i < ndirs; ++i) {
+        free(dirs[i].name);
+        free(dirs[i].subs);
+    }
+    free(dirs);
+}
+
+void du_index_destroy(struct du_index *idx) {
+    if (!idx) {
+        return;
+    }
+    du_free_dirs(idx->dirs, idx->ndirs);
+    free(idx->map);
+    free(idx->by_wd);
+    if (idx->in_fd != -1) {
+        close(idx->in_fd);
+    }
+    if (idx->root_fd != -1) {
+        close(idx->root_fd);
+    }
+    free(idx);
+}
+
+/* The descriptor is borrowed; returns a null pointer on error. */
+struct du_index *du_index_create(int root_fd, int flags) {
+    struct du_index *idx = calloc(1, sizeof(struct du_index));
+    struct stat st;
+    if (!idx) {
+        return NULL;
+    }
+    idx->in_fd = -1;
+    idx->free_dir = DU_NONE;
+    if ((idx->root_fd = dup(root_fd)) == -1 ||
+        fstat(idx->root_fd, &st) == -1 ||
+        ((flags & DU_INDEX_INOTIFY) &&
+         (idx->in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) ||
+        !du_map_rebuild(idx, 1) ||
+        du_dir_get(idx, &st, DU_NONE, ".") == DU_NONE) {
+        du_index_destroy(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+ssize_t du_index_usage(struct du_index *idx) {
+    struct du_total total = { 0 };
+
+    if (idx->in_fd != -1 && du_drain(idx) == -1) {
+        return -1;
+    }
+
+    ++idx->gen;
+    idx->reread = 0;
+    idx->polling = idx->in_fd == -1 || idx->unwatched;
+    int fd = idx->polling ? idx->root_fd : -1;
+    int rv = du_refresh(idx, 0, fd, &total);
+    if (rv == 0) {
+        rv = du_sweep(idx);
+    }
     if (rv != 0) {
-        return rv;
+        return -1;
+    }
+    idx->unwatched = false;
+    return total.shared ? -2 : total.size;
+}
+
+/* The index file is a header followed by one record per directory,
+ * root first and every directory after its parent, and the names of
+ * the directories, each terminated by a null byte. Records of
+ * subdirectories are recovered from their ‹parent›. */
+
+#define DUDX_MAGIC  "dudx\0\0\0\1"
+#define DUDX_NONE   UINT32_MAX
+#define DUDX_SHARED 1           /* ‹dudx_dir.flags› */
+#define DUDX_DIRTY  2
+
+struct dudx_header {
+    char magic[8];
+    uint64_t ndirs, strings_size;
+};
+
+struct dudx_dir {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    int64_t files;
+    uint32_t parent;            /* ‹DUDX_NONE› for the root */
+    uint32_t name;              /* offset into the strings */
+    uint32_t flags;
+    uint32_t unused;
+};
+
+static int du_write_all(int fd, const void *data, size_t size) {
+    const char *ptr = data;
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written == -1) {
+            return -1;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Store the summaries into ‹file› in ‹dir_fd›, replacing it with
+ * ‹renameat›. Directories which are no longer reachable from the root
+ * through their ‹parent› are left out. */
+int du_index_save(struct du_index *idx, int dir_fd, const char *file) {
+    struct dudx_header h = { .ndirs = 0 };
+    size_t *order = malloc(idx->ndirs * sizeof(size_t));
+    uint32_t *number = malloc(idx->ndirs * sizeof(uint32_t));
+    struct dudx_dir *recs = calloc(idx->ndirs, sizeof(struct dudx_dir));
+    char *strings = NULL, temp[PATH_MAX];
+    int fd = -1, rv = -1;
+    bool created = false;
+
+    memcpy(h.magic, DUDX_MAGIC, 8);
+    if (!order || !number || !recs) {
+        goto out;
+    }
+
+    /* breadth first, so that parents come before their subdirectories */
+    size_t count = 1;
+    order[0] = 0;
+    for (size_t i = 0; i < idx->ndirs; ++i) {
+        number[i] = DUDX_NONE;
+    }
+    number[0] = 0;
+    for (size_t k = 0; k < count; ++k) {
+        struct du_dir *dir = &idx->dirs[order[k]];
+        for (size_t s = 0; s < dir->nsubs; ++s) {
+            size_t sub = dir->subs[s];
+            if (idx->dirs[sub].parent == order[k] &&
+                number[sub] == DUDX_NONE) {
+                number[sub] = count;
+                order[count++] = sub;
+            }
+        }
+        h.strings_size += strlen(dir->name) + 1;
+    }
+
+    if (!(strings = malloc(h.strings_size))) {
+        goto out;
+    }
+    size_t used = 0;
+    for (size_t k = 0; k < count; ++k) {
+        struct du_dir *dir = &idx->dirs[order[k]];
+        size_t len = strlen(dir->name) + 1;
+        recs[k] = (struct dudx_dir) {
+            .dev = dir->dev, .ino = dir->ino,
+            .mtime_sec = dir->mtime.tv_sec,
+            .mtime_nsec = dir->mtime.tv_nsec,
+            .ctime_sec = dir->ctime.tv_sec,
+            .ctime_nsec = dir->ctime.tv_nsec,
+            .files = dir->files,
+            .parent = k ? number[dir->parent] : DUDX_NONE,
+            .name = used,
+            .flags = (dir->shared ? DUDX_SHARED : 0) |
+                     (dir->dirty ? DUDX_DIRTY : 0)
+        };
+        memcpy(strings + used, dir->name, len);
+        used += len;
+    }
+    h.ndirs = count;
+
+    int len = snprintf(temp, sizeof temp, "%s.%d", file, getpid());
+    if (len < 0 || (size_t) len >= sizeof temp) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    if ((fd = openat(dir_fd, temp, O_CREAT | O_TRUNC | O_WRONLY,
+                     0666)) == -1) {
+        goto out;
+    }
+    created = true;
+    if (du_write_all(fd, &h, sizeof h) == -1 ||
+        du_write_all(fd, recs, count * sizeof *recs) == -1 ||
+        du_write_all(fd, strings, h.strings_size) == -1) {
+        goto out;
+    }
+    if (close(fd) == -1) {
+        fd = -1;
+        goto out;
+    }
+    fd = -1;
+    rv = renameat(dir_fd, temp, dir_fd, file);
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (rv == -1 && created) {
+        unlinkat(dir_fd, temp, 0);
+    }
+    free(order);
+    free(number);
+    free(recs);
+    free(strings);
+    return rv;
+}
+
+/* Replace the (fresh) index with the one stored in ‹file›; fails
+ * with ‹EINVAL› if the file is damaged or describes another root. */
+static int du_load(struct du_index *idx, int dir_fd, const char *file) {
+    struct stat st;
+    int fd = openat(dir_fd, file, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    void *map = size < sizeof(struct dudx_header) ? MAP_FAILED :
+                mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (size < sizeof(struct dudx_header)) {
+            errno = EINVAL;
+        }
+        return -1;
+    }
+
+    const struct dudx_header *h = map;
+    const struct dudx_dir *recs = (const void *) (h + 1);
+    size_t room = (size - sizeof *h) / sizeof *recs;
+    const char *strings = (const char *) (recs + (h->ndirs < room ?
+                                                  h->ndirs : room));
+    bool valid = memcmp(h->magic, DUDX_MAGIC, 8) == 0 &&
+                 h->ndirs > 0 && h->ndirs <= room &&
+                 h->strings_size > 0 &&
+                 sizeof *h + h->ndirs * sizeof *recs + h->strings_size
+                     == size &&
+                 strings[h->strings_size - 1] == '\0' &&
+                 recs[0].dev == (uint64_t) idx->dirs[0].dev &&
+                 recs[0].ino == (uint64_t) idx->dirs[0].ino;
+
+    for (size_t i = 0; valid && i < h->ndirs; ++i) {
+        valid = recs[i].name < h->strings_size &&
+                (i ? recs[i].parent < i : recs[i].parent == DUDX_NONE);
+    }
+    if (!valid) {
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t ndirs = h->ndirs;
+    struct du_dir *dirs = calloc(ndirs, sizeof(struct du_dir));
+    bool ok = dirs != NULL;
+
+    for (size_t i = 0; ok && i < ndirs; ++i) {
+        dirs[i] = (struct du_dir) {
+            .dev = recs[i].dev, .ino = recs[i].ino,
+            .mtime = { recs[i].mtime_sec, recs[i].mtime_nsec },
+            .ctime = { recs[i].ctime_sec, recs[i].ctime_nsec },
+            .files = recs[i].files,
+            .shared = recs[i].flags & DUDX_SHARED,
+            .dirty = recs[i].flags & DUDX_DIRTY,
+            .wd = -1,
+            .parent = i ? recs[i].parent : DU_NONE,
+            .name = strdup(strings + recs[i].name)
+        };
+        ok = dirs[i].name != NULL;
+        if (i) {
+            ++dirs[dirs[i].parent].nsubs;
+        }
+    }
+    for (size_t i = 0; ok && i < ndirs; ++i) {
+        if (dirs[i].nsubs &&
+            !(dirs[i].subs = malloc(dirs[i].nsubs * sizeof(size_t)))) {
+            ok = false;
+        }
+        dirs[i].nsubs = 0;
+    }
+    for (size_t i = 1; ok && i < ndirs; ++i) {
+        struct du_dir *parent = &dirs[dirs[i].parent];
+        parent->subs[parent->nsubs++] = i;
     }
-    return size;
+    munmap(map, size);
+
+    if (!ok) {
+        if (dirs) {
+            du_free_dirs(dirs, ndirs);
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct du_dir *old = idx->dirs;
+    size_t old_ndirs = idx->ndirs;
+    idx->dirs = dirs;
+    idx->ndirs = idx->capacity = ndirs;
+    if (!du_map_rebuild(idx, ndirs)) {
+        idx->dirs = old;
+        idx->ndirs = idx->capacity = old_ndirs;
+        du_free_dirs(dirs, ndirs);
+        errno = ENOMEM;
+        return -1;
+    }
+    du_free_dirs(old, old_ndirs);
+    idx->unwatched = true;
+    return 0;
+}
+
+/* Like ‹du_index_create›, but start from the summaries in ‹file› in
+ * ‹dir_fd›, if it exists and was saved for the same root; otherwise
+ * the index starts empty. Returns a null pointer on error. */
+struct du_index *du_index_load(int root_fd, int flags,
+                               int dir_fd, const char *file) {
+    struct du_index *idx = du_index_create(root_fd, flags);
+
+    if (idx && du_load(idx, dir_fd, file) == -1 &&
+        errno != ENOENT && errno != EINVAL) {
+        du_index_destroy(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/* One measurement with the summaries kept in ‹file› in ‹dir_fd› from
+ * one call to the next: only directories changed since the previous
+ * call are read. */
+ssize_t disk_usage_cached(int root_fd, int dir_fd, const char *file) {
+    struct du_index *idx = du_index_load(root_fd, 0, dir_fd, file);
+
+    if (!idx) {
+        return -1;
+    }
+    ssize_t rv = du_index_usage(idx);
+    if (rv != -1 && du_index_save(idx, dir_fd, file) == -1) {
+        rv = -1;
+    }
+    du_index_destroy(idx);
+    return rv;
 }
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
@@ -125,6 +1333,114 @@ static void write_file(int dir, const char *name, const char *str) {
     close_or_warn(fd, name);
 }
 
+static void append_file(int dir, const char *name, const char *str) {
+    int fd = openat(dir, name, O_WRONLY | O_APPEND);
+
+    if (fd == -1 || write(fd, str, strlen(str)) == -1)
+        err(2, "appending to %s", name);
+
+    close_or_warn(fd, name);
+}
+
+/* the tree is as in ‹main› below: 5 bytes in foo, subdir/bar, subdir/baz
+ * and subdir/wibble */
+static void test_index(int work_fd, int subd_fd, int flags) {
+    struct du_index *idx = du_index_create(work_fd, flags);
+    assert(idx);
+    assert(du_index_usage(idx) == 5);
+    assert(du_index_usage(idx) == 5);
+
+    write_file(subd_fd, "new", "abc");
+    assert(du_index_usage(idx) == 8);
+
+    int deep_fd = mkdir_or_die(subd_fd, "deep");
+    write_file(deep_fd, "x", "1234");
+    assert(du_index_usage(idx) == 12);
+
+    if (renameat(subd_fd, "deep", work_fd, "moved") == -1)
+        err(1, "renaming deep");
+    assert(du_index_usage(idx) == 12);
+
+    if (linkat(deep_fd, "x", subd_fd, "link", 0) == -1)
+        err(1, "creating a hard link");
+    assert(du_index_usage(idx) == -2);
+    unlink_if_exists(subd_fd, "link");
+    assert(du_index_usage(idx) == 12);
+
+    /* pretend the directories were last changed long ago, so that
+     * the polling mode trusts its cache for them */
+    struct timespec old[2] = { { .tv_sec = 1000000000 },
+                               { .tv_sec = 1000000000 } };
+    if (futimens(work_fd, old) == -1 || futimens(subd_fd, old) == -1 ||
+        futimens(deep_fd, old) == -1)
+        err(1, "setting directory times");
+    nanosleep(&(struct timespec) { .tv_nsec = 2 * DU_RACY_NS }, NULL);
+    assert(du_index_usage(idx) == 12);
+
+    /* no directory is changed by this, only the file */
+    append_file(deep_fd, "x", "56");
+    if (flags & DU_INDEX_INOTIFY) {
+        assert(du_index_usage(idx) == 14);
+    } else {
+        assert(du_index_usage(idx) == 12);
+        write_file(deep_fd, "y", "");
+        assert(du_index_usage(idx) == 14);
+        unlink_if_exists(deep_fd, "y");
+    }
+
+    unlink_if_exists(deep_fd, "x");
+    close_or_warn(deep_fd, "moved");
+    if (unlinkat(work_fd, "moved", AT_REMOVEDIR) == -1)
+        err(1, "removing moved");
+    unlink_if_exists(subd_fd, "new");
+    assert(du_index_usage(idx) == 5);
+    assert(du_index_usage(idx) == disk_usage(work_fd));
+
+    du_index_destroy(idx);
+}
+
+/* The summaries saved by one process are used by the next one. */
+static void test_saved(int work_fd, int subd_fd, int flags) {
+    struct timespec old[2] = { { .tv_sec = 1000000000 },
+                               { .tv_sec = 1000000000 } };
+    if (futimens(work_fd, old) == -1 || futimens(subd_fd, old) == -1)
+        err(1, "setting directory times");
+    nanosleep(&(struct timespec) { .tv_nsec = 2 * DU_RACY_NS }, NULL);
+
+    unlink_if_exists(AT_FDCWD, "zt.p6_index");
+    assert(disk_usage_cached(work_fd, AT_FDCWD, "zt.p6_index") == 5);
+
+    struct du_index *idx = du_index_load(work_fd, flags,
+                                         AT_FDCWD, "zt.p6_index");
+    assert(idx);
+    assert(du_index_usage(idx) == 5);
+    assert(idx->reread == 0);
+    du_index_destroy(idx);
+
+    /* a change made while nothing was watching */
+    write_file(subd_fd, "new", "abc");
+    idx = du_index_load(work_fd, flags, AT_FDCWD, "zt.p6_index");
+    assert(idx);
+    assert(du_index_usage(idx) == 8);
+    assert(idx->reread == 1);
+    unlink_if_exists(subd_fd, "new");
+    assert(du_index_usage(idx) == 5);
+    write_file(subd_fd, "new", "abc");
+    assert(du_index_usage(idx) == 8);
+    assert(du_index_save(idx, AT_FDCWD, "zt.p6_index") == 0);
+    du_index_destroy(idx);
+
+    unlink_if_exists(subd_fd, "new");
+    assert(disk_usage_cached(work_fd, AT_FDCWD, "zt.p6_index") == 5);
+
+    /* an index saved for another tree is not used */
+    assert(disk_usage_cached(subd_fd, AT_FDCWD, "zt.p6_index") == 4);
+    write_file(AT_FDCWD, "zt.p6_index", "garbage");
+    assert(disk_usage_cached(work_fd, AT_FDCWD, "zt.p6_index") == 5);
+
+    unlink_if_exists(AT_FDCWD, "zt.p6_index");
+}
+
 int main() {
     int work_fd = mkdir_or_die(AT_FDCWD, "zt.p6_root");
     int subd_fd = mkdir_or_die(work_fd, "subdir");
@@ -137,6 +1453,8 @@ int main() {
     write_file(subd_fd, "baz", "y");
 
     assert(disk_usage(work_fd) == 3);
+    assert(disk_usage_shared(work_fd) == 3);
+    assert(disk_usage_shared(-1) == -1);
     assert(disk_usage(-1) == -1);
 
     write_file(subd_fd, "wibble", "xy");
@@ -146,6 +1464,21 @@ int main() {
 
     assert(disk_usage(work_fd) == 5);
 
+    unlink_if_exists(subd_fd, "link");
+    if (linkat(work_fd, "foo", subd_fd, "link", 0) == -1)
+        err(1, "creating a hard link");
+
+    assert(disk_usage(work_fd) == -2);
+    assert(disk_usage_shared(work_fd) == 5);
+    unlink_if_exists(subd_fd, "link");
+    assert(disk_usage(work_fd) == 5);
+
+    test_index(work_fd, subd_fd, 0);
+    test_index(work_fd, subd_fd, DU_INDEX_INOTIFY);
+    test_saved(work_fd, subd_fd, 0);
+    test_saved(work_fd, subd_fd, DU_INDEX_INOTIFY);
+    assert(du_index_create(-1, 0) == NULL);
+
     close_or_warn(subd_fd, "zt.p6_root/subdir");
     close_or_warn(work_fd, "zt.p6_root");
 
@@ -9,6 +9,11 @@
 #include <sys/socket.h>     /* socket, AF_* */
 #include <sys/un.h>         /* struct sockaddr_un */
 #include <arpa/inet.h>      /* ntohl */
+#include <stdbool.h>        /* bool */
+#include <string.h>         /* memcpy, strlen, strcpy, strcat */
+#include <fcntl.h>          /* open */
+#include <sys/mman.h>       /* mmap, msync, munmap */
+#include <sys/stat.h>       /* fstat */
 
 /* Napište podprogram ‹memo_server›, který přijme dva parametry:
  *
@@ -26,7 +31,251 @@
  * Návratová hodnota 0 znamená, že bylo úspěšně obslouženo ‹count›
  * klientů, -1 znamená systémovou chybu. */
 
-int memo_server( int sock_fd, int count, uint32_t initial );
+#define STORE_MAGIC      0x73746f72u    /* "stor" */
+#define STORE_CHECKPOINT 4096           /* log records between snapshots */
+
+/* Persistent state. The state file holds a small header with the
+ * state in it and is mapped into memory. Every new state is first
+ * appended to a write-ahead log (‹path›.wal) and synced, and only
+ * then stored in the mapping and confirmed to the client. Every
+ * ‹STORE_CHECKPOINT› records the mapping is synced to disk, which
+ * makes the log redundant, and the log is truncated. On startup,
+ * only the records after the last checkpoint are read (the last
+ * valid one wins), so restart time does not depend on how long the
+ * server has been running.
+ *
+ * The header field ‹applied› says how much of the log is already
+ * contained in the state file. It is synced together with the state
+ * before the log is truncated, and reset (and synced) before
+ * anything new is appended, hence if it is ever larger than the log,
+ * the truncation went through and the whole (empty) log is new.
+ * A torn record at the end of the log fails its check and is
+ * dropped – it was never confirmed. */
+
+struct store_header {
+    uint32_t magic;
+    uint32_t state;
+    uint64_t applied;
+};
+
+struct store_record {
+    uint32_t state;
+    uint32_t check;
+};
+
+struct store {
+    int snap_fd, log_fd;
+    struct store_header *header;
+    uint64_t log_len;
+    int pending;
+};
+
+static uint32_t store_check(uint32_t state) {
+    return state ^ STORE_MAGIC;
+}
+
+static int store_checkpoint(struct store *store) {
+    store->header->applied = store->log_len;
+    if (msync(store->header, sizeof *store->header, MS_SYNC) == -1 ||
+        ftruncate(store->log_fd, 0) == -1) {
+        return -1;
+    }
+    store->log_len = 0;
+    store->header->applied = 0;
+    store->pending = 0;
+    return msync(store->header, sizeof *store->header, MS_SYNC);
+}
+
+static int store_replay(struct store *store) {
+    struct store_record records[256];
+    uint64_t offset = store->header->applied;
+    if (offset > store->log_len) {
+        offset = store->log_len;
+    }
+    while (offset < store->log_len) {
+        ssize_t nbytes = pread(store->log_fd, records, sizeof records, offset);
+        if (nbytes == -1) {
+            return -1;
+        }
+        size_t count = nbytes / sizeof(struct store_record);
+        size_t i = 0;
+        for (; i < count; ++i) {
+            if (records[i].check != store_check(records[i].state)) {
+                break;
+            }
+            store->header->state = records[i].state;
+        }
+        offset += i * sizeof(struct store_record);
+        if (i == 0 || i < count) {
+            break;
+        }
+    }
+    store->log_len = offset;    /* drops a torn or garbled tail */
+    return store_checkpoint(store);
+}
+
+static int store_close(struct store *store);
+
+/* Open (or create) the store at ‹path›; ‹initial› is only used when
+ * the state file does not exist yet. Returns a null pointer on
+ * error. */
+
+static struct store *store_open(const char *path, uint32_t initial) {
+    struct store *store = calloc(1, sizeof(struct store));
+    char *log_path = malloc(strlen(path) + 5);
+    if (!store || !log_path) {
+        free(store);
+        free(log_path);
+        return NULL;
+    }
+    strcpy(log_path, path);
+    strcat(log_path, ".wal");
+    store->snap_fd = open(path, O_RDWR | O_CREAT, 0666);
+    store->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(log_path);
+
+    struct stat st_snap, st_log;
+    if (store->snap_fd == -1 || store->log_fd == -1 ||
+        fstat(store->snap_fd, &st_snap) == -1 ||
+        fstat(store->log_fd, &st_log) == -1) {
+        goto err;
+    }
+    bool fresh = st_snap.st_size == 0;
+    if (fresh && ftruncate(store->snap_fd, sizeof(struct store_header)) == -1) {
+        goto err;
+    }
+    if (!fresh && st_snap.st_size != sizeof(struct store_header)) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->header = mmap(NULL, sizeof(struct store_header),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, store->snap_fd, 0);
+    if (store->header == MAP_FAILED) {
+        store->header = NULL;
+        goto err;
+    }
+
+    if (fresh) {
+        store->header->magic = STORE_MAGIC;
+        store->header->state = initial;
+        store->header->applied = 0;
+        /* a log without a state file is stale */
+        if (ftruncate(store->log_fd, 0) == -1) {
+            goto err;
+        }
+        st_log.st_size = 0;
+    } else if (store->header->magic != STORE_MAGIC) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->log_len = st_log.st_size;
+    if (store_replay(store) == -1) {
+        goto err;
+    }
+    return store;
+
+err:
+    store_close(store);
+    return NULL;
+}
+
+static uint32_t store_get(struct store *store) {
+    return store->header->state;
+}
+
+/* Log, sync and apply a new state. */
+
+static int store_set(struct store *store, uint32_t state) {
+    struct store_record record = { state, store_check(state) };
+
+    if (write(store->log_fd, &record, sizeof record) != sizeof record ||
+        fdatasync(store->log_fd) == -1) {
+        return -1;
+    }
+    store->log_len += sizeof record;
+    store->header->state = state;
+    if (++store->pending >= STORE_CHECKPOINT) {
+        return store_checkpoint(store);
+    }
+    return 0;
+}
+
+static int store_close(struct store *store) {
+    int rv = 0;
+    if (store->header) {
+        if (store_checkpoint(store) == -1 ||
+            munmap(store->header, sizeof(struct store_header)) == -1) {
+            rv = -1;
+        }
+    }
+    if (store->snap_fd != -1 && close(store->snap_fd) == -1) {
+        rv = -1;
+    }
+    if (store->log_fd != -1 && close(store->log_fd) == -1) {
+        rv = -1;
+    }
+    free(store);
+    return rv;
+}
+
+/* The state is kept as the raw 4 bytes the client sent, in the
+ * store if there is one. A client which leaves
+ * before sending a complete new value does not change the state. */
+
+static int serve_client(int fd, uint32_t *state, struct store *store) {
+    uint8_t buffer[4];
+    ssize_t nbytes = 0, offset = 0;
+
+    if (store) {
+        *state = store_get(store);
+    }
+    if (write(fd, state, sizeof *state) == -1) {
+        return errno == EPIPE || errno == ECONNRESET ? 0 : -1;
+    }
+    while (offset < 4 && (nbytes = read(fd, buffer + offset, 4 - offset)) > 0) {
+        offset += nbytes;
+    }
+    if (offset < 4) {
+        return nbytes == -1 && errno != ECONNRESET ? -1 : 0;
+    }
+    memcpy(state, buffer, 4);
+    return store ? store_set(store, *state) : 0;
+}
+
+static int serve(int sock_fd, int count, uint32_t initial, struct store *store) {
+    uint32_t state = initial;
+    for (int i = 0; i < count; ++i) {
+        int fd = accept(sock_fd, NULL, NULL);
+        if (fd == -1) {
+            return -1;
+        }
+        int rv = serve_client(fd, &state, store);
+        if (close(fd) == -1 || rv == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int memo_server(int sock_fd, int count, uint32_t initial) {
+    return serve(sock_fd, count, initial, NULL);
+}
+
+/* Same as ‹memo_server›, but the state survives a restart: it lives
+ * in the store at ‹path› and ‹initial› is only used if the store
+ * does not exist yet. */
+
+int memo_server_persistent(int sock_fd, int count, const char *path, uint32_t initial) {
+    struct store *store = store_open(path, initial);
+    if (!store) {
+        return -1;
+    }
+    int rv = serve(sock_fd, count, initial, store);
+    if (store_close(store) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -84,6 +333,38 @@ static pid_t fork_server( int sock_fd, int clients, uint32_t initial )
     return pid;
 }
 
+static pid_t fork_persistent( int count, uint32_t initial )
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX,
+                                .sun_path = "zt.r1_socket" };
+
+    unlink_if_exists( "zt.r1_socket" );
+
+    int sock_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( sock_fd == -1 )
+        err( 2, "socket" );
+
+    if ( bind( sock_fd, (const struct sockaddr *) &addr, sizeof addr ) == -1 )
+        err( 2, "bind" );
+
+    if ( listen( sock_fd, 4 ) == -1 )
+        err( 2, "listen" );
+
+    pid_t pid = fork();
+
+    if ( pid == -1 )
+        err( 2, "fork" );
+
+    if ( pid == 0 )
+    {
+        alarm( 3 );
+        exit( memo_server_persistent( sock_fd, count, "zt.r1_state", initial ) ? 1 : 0 );
+    }
+
+    close_or_warn( sock_fd, "server socket in client" );
+    return pid;
+}
+
 static int read_and_write( int retries, uint32_t expect, uint32_t new )
 {
     int rv = -1;
@@ -163,6 +444,21 @@ int main( void )
 
     assert( reap( pid ) == 0 );
 
+    /* the state survives a restart of the server */
+    unlink_if_exists( "zt.r1_state" );
+    unlink_if_exists( "zt.r1_state.wal" );
+
+    pid = fork_persistent( 2, 17 );
+    assert( read_and_write( 5, 17, 21 ) == 0 );
+    assert( read_and_write( 0, 21, 33 ) == 0 );
+    assert( reap( pid ) == 0 );
+
+    pid = fork_persistent( 1, 99 );
+    assert( read_and_write( 5, 33, 34 ) == 0 );
+    assert( reap( pid ) == 0 );
+
+    unlink_if_exists( "zt.r1_state" );
+    unlink_if_exists( "zt.r1_state.wal" );
     unlink_if_exists( "zt.r1_socket" );
     return 0;
 }
@@ -8,6 +8,15 @@
 #include <unistd.h>     /* read, write, close, unlink, fork, alarm */
 #include <sys/socket.h> /* socket, bind, connect, recv */
 #include <sys/wait.h>   /* waitpid */
+#include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+#include <sys/eventfd.h> /* eventfd */
+#include <fcntl.h>      /* fcntl, O_NONBLOCK */
+#include <pthread.h>    /* pthread_create, pthread_join */
+#include <semaphore.h>  /* sem_init, sem_wait, sem_post */
+#include <sched.h>      /* sched_yield */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>     /* memmove */
 
 /* Vaším úkolem v této přípravě bude naprogramovat jednoduchý
  * server, který bude klientům poskytovat výpočetní službu – samotný
@@ -33,8 +42,623 @@
  * uvolnit veškeré zdroje (s výjimkou popisovače ‹sock_fd›, který
  * vlastní volající). */
 
-int compute_server( int sock_fd, int count,
-                    uint64_t (*compute)( uint64_t ) );
+#define COMPUTE_WORKERS 16
+#define QUEUE_SIZE      4096    /* power of two */
+#define MAX_INFLIGHT    (QUEUE_SIZE - COMPUTE_WORKERS)
+#define PIPELINE_DEPTH  64      /* unanswered requests per client */
+#define MEMO_SLOTS      1024
+#define MAX_EVENTS      64
+#define CACHE_LINE      64
+#define MSG_SIZE        8
+
+/* The server is a single epoll loop which owns all client state and a
+ * fixed pool of ‹COMPUTE_WORKERS› threads which only ever call
+ * ‹compute›. Requests travel to the workers through a lock-free ring
+ * (workers sleep on a semaphore while it is empty) and come back
+ * through a second ring, after which the workers poke an eventfd so
+ * that the loop wakes up. Each client keeps its requests in a list in
+ * arrival order and answers are only sent from the head of that list,
+ * so pipelined requests are answered in order even if the results
+ * come back out of order. */
+
+/* Bounded multi-producer multi-consumer queue (after D. Vyukov):
+ * every cell carries a sequence number which tells both producers and
+ * consumers whether it is their turn to use it. */
+
+struct ring_cell {
+    atomic_size_t seq;
+    void *data;
+};
+
+struct ring {
+    struct ring_cell *cells;
+    size_t mask;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+};
+
+static int ring_init(struct ring *ring, size_t size) {
+    ring->cells = malloc(size * sizeof(struct ring_cell));
+    if (!ring->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+static bool ring_push(struct ring *ring, void *data) {
+    struct ring_cell *cell;
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_pop(struct ring *ring, void **data) {
+    struct ring_cell *cell;
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    *data = cell->data;
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    return true;
+}
+
+struct client;
+
+struct job {
+    struct client *client;
+    uint64_t input;
+    uint64_t result;
+    bool done;
+    struct job *next;
+};
+
+struct client {
+    int fd;
+    uint32_t events;
+    bool eof, dead, stalled;
+    bool detached;                  /* no longer in the epoll set */
+    struct job *head, *tail;
+    int queued;
+    uint8_t in[PIPELINE_DEPTH * MSG_SIZE];
+    size_t in_len;
+    uint8_t out[PIPELINE_DEPTH * MSG_SIZE];
+    size_t out_len;
+    struct client *prev, *next;     /* all clients */
+    struct client *next_stalled;
+    struct client *next_closed;
+};
+
+/* A cache of recent results, for servers created with ‹COMPUTE_MEMO›
+ * (see ‹compute_server_opts›). It is only touched by the loop thread,
+ * so it needs no synchronization. */
+
+struct memo_slot {
+    bool valid;
+    uint64_t input, result;
+};
+
+struct server {
+    uint64_t (*compute)(uint64_t);
+    int epoll_fd, event_fd;
+    struct ring jobs, done;
+    sem_t ready;
+    pthread_t workers[COMPUTE_WORKERS];
+    int started;
+    int inflight;
+    int active;
+    struct client *clients;
+    struct client *stalled;
+    struct client *closed;
+    bool memoize;
+    struct memo_slot memo[MEMO_SLOTS];
+};
+
+static void *compute_worker(void *arg) {
+    struct server *srv = arg;
+    void *data;
+    const uint64_t one = 1;
+    for (;;) {
+        while (sem_wait(&srv->ready) == -1) {
+            if (errno != EINTR) {
+                return NULL;
+            }
+        }
+        while (!ring_pop(&srv->jobs, &data)) {
+            sched_yield();
+        }
+        struct job *job = data;
+        if (!job) {
+            return NULL;
+        }
+        job->result = srv->compute(job->input);
+        while (!ring_push(&srv->done, job)) {
+            sched_yield();
+        }
+        if (write(srv->event_fd, &one, sizeof one) == -1) {
+            return NULL;
+        }
+    }
+}
+
+static uint64_t get_be64(const uint8_t *buf) {
+    uint64_t value = 0;
+    for (int i = 0; i < MSG_SIZE; ++i) {
+        value = value << 8 | buf[i];
+    }
+    return value;
+}
+
+static void put_be64(uint8_t *buf, uint64_t value) {
+    for (int i = MSG_SIZE - 1; i >= 0; --i) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static struct memo_slot *memo_slot(struct server *srv, uint64_t input) {
+    return &srv->memo[(input * 0x9e3779b97f4a7c15u) >> 54 & (MEMO_SLOTS - 1)];
+}
+
+static int client_load(struct client *c) {
+    return c->queued + (int) ((c->out_len + MSG_SIZE - 1) / MSG_SIZE);
+}
+
+/* A client which may not send more (its pipeline is full, or too
+ * many jobs are in flight) is not polled for ‹EPOLLIN›, otherwise a
+ * level-triggered event would wake the loop over and over; it is
+ * re-armed once its answers go out or ‹collect› unstalls it. */
+
+static int client_update(struct server *srv, struct client *c) {
+    uint32_t events = 0;
+    if (c->detached) {
+        return 0;
+    }
+    if (!c->eof && !c->stalled && client_load(c) < PIPELINE_DEPTH) {
+        events |= EPOLLIN;
+    }
+    if (c->out_len > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == c->events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    c->events = events;
+    return epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void client_free(struct server *srv, struct client *c) {
+    while (c->head) {
+        struct job *job = c->head;
+        c->head = job->next;
+        free(job);
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        srv->clients = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    free(c);
+}
+
+/* A client is finished once it has stopped sending and all of its
+ * answers are out, or once it went away and the workers have let go
+ * of its jobs. Its memory is only reclaimed by ‹sweep_closed› after
+ * the current batch of events, which may still mention it. */
+
+static int client_maybe_finish(struct server *srv, struct client *c) {
+    bool finished = c->queued == 0 && (c->dead || (c->eof && c->out_len == 0));
+    if (!finished || c->fd == -1) {
+        return 0;
+    }
+    int rv = 0;
+    if ((!c->detached &&
+         epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) == -1) ||
+        close(c->fd) == -1) {
+        rv = -1;
+    }
+    c->fd = -1;
+    c->next_closed = srv->closed;
+    srv->closed = c;
+    --srv->active;
+    return rv;
+}
+
+static void sweep_closed(struct server *srv) {
+    struct client *keep = NULL;
+    while (srv->closed) {
+        struct client *c = srv->closed;
+        srv->closed = c->next_closed;
+        if (c->stalled) {
+            c->next_closed = keep;
+            keep = c;
+        } else {
+            client_free(srv, c);
+        }
+    }
+    srv->closed = keep;
+}
+
+static int client_flush(struct server *srv, struct client *c) {
+    if (c->fd == -1) {
+        return 0;
+    }
+    while (c->head && c->head->done) {
+        struct job *job = c->head;
+        c->head = job->next;
+        if (!c->head) {
+            c->tail = NULL;
+        }
+        --c->queued;
+        if (!c->dead) {
+            put_be64(c->out + c->out_len, job->result);
+            c->out_len += MSG_SIZE;
+        }
+        free(job);
+    }
+    if (c->out_len > 0 && !c->dead) {
+        ssize_t nbytes = write(c->fd, c->out, c->out_len);
+        if (nbytes == -1) {
+            if (errno == EPIPE || errno == ECONNRESET) {
+                c->dead = true;
+                c->out_len = 0;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+        } else {
+            c->out_len -= nbytes;
+            memmove(c->out, c->out + nbytes, c->out_len);
+        }
+    }
+    if (client_maybe_finish(srv, c) == -1) {
+        return -1;
+    }
+    return c->fd == -1 ? 0 : client_update(srv, c);
+}
+
+/* ‹EPOLLHUP› and ‹EPOLLERR› are reported whatever the event mask is,
+ * and the answers can no longer be delivered: the client is taken out
+ * of the epoll set right away, and closed as soon as the workers let
+ * go of its jobs (at once if there are none). */
+
+static int client_hangup(struct server *srv, struct client *c) {
+    c->dead = true;
+    c->out_len = 0;
+    if (!c->detached) {
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL) == -1) {
+            return -1;
+        }
+        c->detached = true;
+    }
+    return client_maybe_finish(srv, c);
+}
+
+static int submit(struct server *srv, struct client *c, uint64_t input) {
+    struct job *job = malloc(sizeof(struct job));
+    if (!job) {
+        return -1;
+    }
+    job->client = c;
+    job->input = input;
+    job->next = NULL;
+    job->done = false;
+
+    struct memo_slot *slot = srv->memoize ? memo_slot(srv, input) : NULL;
+    if (slot && slot->valid && slot->input == input) {
+        job->result = slot->result;
+        job->done = true;
+    }
+
+    if (c->tail) {
+        c->tail->next = job;
+    } else {
+        c->head = job;
+    }
+    c->tail = job;
+    ++c->queued;
+
+    if (!job->done) {
+        ++srv->inflight;
+        if (!ring_push(&srv->jobs, job) || sem_post(&srv->ready) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int client_read(struct server *srv, struct client *c) {
+    int room = PIPELINE_DEPTH - client_load(c);
+    if (room > MAX_INFLIGHT - srv->inflight) {
+        room = MAX_INFLIGHT - srv->inflight;
+    }
+    if (room <= 0) {
+        if (!c->stalled) {
+            c->stalled = true;
+            c->next_stalled = srv->stalled;
+            srv->stalled = c;
+        }
+        return client_update(srv, c);
+    }
+
+    ssize_t nbytes = read(c->fd, c->in + c->in_len, room * MSG_SIZE - c->in_len);
+    if (nbytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != ECONNRESET) {
+            return -1;
+        }
+        c->dead = true;
+        nbytes = 0;
+    }
+    if (nbytes == 0) {
+        c->eof = true;
+    }
+    c->in_len += nbytes;
+
+    size_t offset = 0;
+    for (; c->in_len - offset >= MSG_SIZE; offset += MSG_SIZE) {
+        if (submit(srv, c, get_be64(c->in + offset)) == -1) {
+            return -1;
+        }
+    }
+    c->in_len -= offset;
+    memmove(c->in, c->in + offset, c->in_len);
+    return client_flush(srv, c);
+}
+
+static int collect(struct server *srv) {
+    uint64_t ticks;
+    void *data;
+    if (read(srv->event_fd, &ticks, sizeof ticks) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+    while (ring_pop(&srv->done, &data)) {
+        struct job *job = data;
+        if (srv->memoize) {
+            struct memo_slot *slot = memo_slot(srv, job->input);
+            slot->valid = true;
+            slot->input = job->input;
+            slot->result = job->result;
+        }
+        job->done = true;
+        --srv->inflight;
+        if (client_flush(srv, job->client) == -1) {
+            return -1;
+        }
+    }
+    while (srv->stalled) {
+        struct client *c = srv->stalled;
+        srv->stalled = c->next_stalled;
+        c->stalled = false;
+        if (c->fd != -1 && client_update(srv, c) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int accept_client(struct server *srv, int sock_fd) {
+    int fd = accept(sock_fd, NULL, NULL);
+    if (fd == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == ECONNABORTED ? 1 : -1;
+    }
+    struct client *c = calloc(1, sizeof(struct client));
+    if (!c) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->events = EPOLLIN;
+    c->next = srv->clients;
+    if (srv->clients) {
+        srv->clients->prev = c;
+    }
+    srv->clients = c;
+    ++srv->active;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int serve(struct server *srv, int sock_fd, int count) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    int accepted = 0;
+
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+        return -1;
+    }
+    ev.data.ptr = srv;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->event_fd, &ev) == -1) {
+        return -1;
+    }
+
+    while (accepted < count || srv->active > 0) {
+        int ready = epoll_wait(srv->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (int i = 0; i < ready; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                int rv = accept_client(srv, sock_fd);
+                if (rv == -1) {
+                    return -1;
+                }
+                if (rv == 0 && ++accepted == count &&
+                    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, sock_fd, NULL) == -1) {
+                    return -1;
+                }
+            } else if (ptr == srv) {
+                if (collect(srv) == -1) {
+                    return -1;
+                }
+            } else {
+                struct client *c = ptr;
+                if (c->fd == -1) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    if (client_hangup(srv, c) == -1) {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (events[i].events & EPOLLIN &&
+                    client_read(srv, c) == -1) {
+                    return -1;
+                }
+                if (c->fd != -1 && events[i].events & EPOLLOUT &&
+                    client_flush(srv, c) == -1) {
+                    return -1;
+                }
+            }
+        }
+        sweep_closed(srv);
+    }
+    return 0;
+}
+
+/* Stop the workers: the poison pills queue up behind whatever is
+ * still in flight, and ‹MAX_INFLIGHT› leaves room for them. */
+
+static int server_fini(struct server *srv) {
+    int rv = 0;
+    void *data;
+    for (int i = 0; i < srv->started; ++i) {
+        if (!ring_push(&srv->jobs, NULL) || sem_post(&srv->ready) == -1) {
+            rv = -1;
+        }
+    }
+    for (int i = 0; i < srv->started; ++i) {
+        if (pthread_join(srv->workers[i], NULL) != 0) {
+            rv = -1;
+        }
+    }
+    while (ring_pop(&srv->done, &data)) {
+        ((struct job *) data)->done = true;
+    }
+    while (srv->clients) {
+        if (srv->clients->fd != -1 && close(srv->clients->fd) == -1) {
+            rv = -1;
+        }
+        client_free(srv, srv->clients);
+    }
+    sem_destroy(&srv->ready);
+    free(srv->jobs.cells);
+    free(srv->done.cells);
+    if (srv->epoll_fd != -1 && close(srv->epoll_fd) == -1) {
+        rv = -1;
+    }
+    if (srv->event_fd != -1 && close(srv->event_fd) == -1) {
+        rv = -1;
+    }
+    free(srv);
+    return rv;
+}
+
+/* Like ‹compute_server›; with ‹COMPUTE_MEMO› in ‹options›, repeated
+ * inputs are answered from a cache of recent results instead of
+ * calling ‹compute› again. That is only correct if ‹compute› is
+ * a pure function: the same input must always give the same result. */
+
+#define COMPUTE_MEMO 1
+
+int compute_server_opts(int sock_fd, int count,
+                        uint64_t (*compute)(uint64_t), int options) {
+    struct server *srv = calloc(1, sizeof(struct server));
+    if (!srv) {
+        return -1;
+    }
+    srv->compute = compute;
+    srv->memoize = options & COMPUTE_MEMO;
+    srv->epoll_fd = epoll_create1(0);
+    srv->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (ring_init(&srv->jobs, QUEUE_SIZE) == -1 || ring_init(&srv->done, QUEUE_SIZE) == -1 ||
+        sem_init(&srv->ready, 0, 0) == -1 || srv->epoll_fd == -1 || srv->event_fd == -1) {
+        server_fini(srv);
+        return -1;
+    }
+
+    int rv = -1;
+    int flags = fcntl(sock_fd, F_GETFL);
+    if (flags == -1 || listen(sock_fd, SOMAXCONN) == -1 ||
+        fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        server_fini(srv);
+        return -1;
+    }
+
+    for (; srv->started < COMPUTE_WORKERS; ++srv->started) {
+        if (pthread_create(&srv->workers[srv->started], NULL, compute_worker, srv) != 0) {
+            break;
+        }
+    }
+    if (srv->started == COMPUTE_WORKERS) {
+        rv = serve(srv, sock_fd, count);
+    }
+
+    if (fcntl(sock_fd, F_SETFL, flags) == -1) {
+        rv = -1;
+    }
+    if (server_fini(srv) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
+
+int compute_server(int sock_fd, int count, uint64_t (*compute)(uint64_t)) {
+    return compute_server_opts(sock_fd, count, compute, 0);
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -43,6 +667,7 @@ int compute_server( int sock_fd, int count,
 #include <sys/un.h>     /* struct sockaddr_un */
 #include <time.h>       /* nanosleep */
 #include <sched.h>      /* sched_yield */
+#include <sys/resource.h> /* getrusage */
 
 static void unlink_if_exists( const char *file )
 {
@@ -152,6 +777,150 @@ static int client_is_busy( int fd )
     return would_recv == -1 && ( e == EAGAIN || e == EWOULDBLOCK );
 }
 
+#define MANY_CLIENTS 500
+
+static pid_t server_start( int count, uint64_t ( *compute )( uint64_t ),
+                           int options )
+{
+    unlink_if_exists( "zt.p6_socket" );
+
+    int sock_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( sock_fd == -1 )
+        err( 2, "server socket" );
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX,
+                                .sun_path = "zt.p6_socket" };
+    if ( bind( sock_fd, ( struct sockaddr * ) &addr, sizeof addr ) == -1 )
+        err( 2, "bind" );
+
+    pid_t pid = fork();
+    if ( pid == -1 )
+        err( 2, "fork" );
+
+    if ( pid == 0 )
+    {
+        alarm( 10 );
+        int rv = compute_server_opts( sock_fd, count, compute, options );
+        close_or_warn( sock_fd, "sock_fd in server" );
+        exit( !!rv );
+    }
+
+    close_or_warn( sock_fd, "sock_fd in client" );
+    return pid;
+}
+
+static void encode( char *buf, uint64_t value )
+{
+    for ( int i = 7; i >= 0; --i, value >>= 8 )
+        buf[ i ] = value & 0xff;
+}
+
+/* Several requests in a single write, the slow one first: answers
+ * must still come back in request order. Then many clients at once,
+ * each with a request in flight. */
+
+static void test_pipelined( void )
+{
+    pid_t pid = server_start( 1 + MANY_CLIENTS, sleepy_square, 0 );
+
+    char batch[ 4 * 8 ], expect[ 4 * 8 ];
+    uint64_t inputs[ 4 ] = { 64, 1, 2, 3 };
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        encode( batch + 8 * i, inputs[ i ] );
+        encode( expect + 8 * i, inputs[ i ] * inputs[ i ] );
+    }
+
+    int pipelined = client_start( batch );
+    assert( write( pipelined, batch + 8, 3 * 8 ) == 3 * 8 );
+
+    char reply[ 4 * 8 ];
+    assert( recv( pipelined, reply, sizeof reply, MSG_WAITALL ) == sizeof reply );
+    assert( memcmp( reply, expect, sizeof reply ) == 0 );
+    close_or_warn( pipelined, "pipelined client" );
+
+    int fds[ MANY_CLIENTS ];
+    char buf[ 8 ];
+
+    for ( int i = 0; i < MANY_CLIENTS; ++i )
+    {
+        encode( buf, i % 16 );
+        fds[ i ] = client_start( buf );
+    }
+
+    for ( int i = 0; i < MANY_CLIENTS; ++i )
+    {
+        encode( buf, ( i % 16 ) * ( i % 16 ) );
+        assert( client_finish( fds[ i ], buf ) == 0 );
+    }
+
+    assert( reap( pid ) == 0 );
+    unlink_if_exists( "zt.p6_socket" );
+}
+
+/* A client which fills its pipeline with slow requests and hangs up:
+ * the server must not spin on the hangup while the jobs finish. The
+ * processor time used by the server is a proxy which does not depend
+ * on how loaded the machine is; the jobs themselves take ~1.5 s. */
+
+static double children_cpu( void )
+{
+    struct rusage ru;
+
+    if ( getrusage( RUSAGE_CHILDREN, &ru ) == -1 )
+        err( 2, "getrusage" );
+
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           ( ru.ru_utime.tv_usec + ru.ru_stime.tv_usec ) / 1e6;
+}
+
+static void test_hangup( void )
+{
+    double before = children_cpu();
+    pid_t pid = server_start( 1, sleepy_square, 0 );
+    char batch[ 80 * 8 ];
+
+    for ( int i = 0; i < 80; ++i )
+        encode( batch + 8 * i, 800 + i );
+
+    int fd = client_start( batch );
+    assert( write( fd, batch + 8, sizeof batch - 8 ) == sizeof batch - 8 );
+    close_or_warn( fd, "hung up client" );
+
+    assert( reap( pid ) == 0 );
+    assert( children_cpu() - before < 0.5 );
+    unlink_if_exists( "zt.p6_socket" );
+}
+
+/* A function which is not pure: each call gives a new result. The
+ * cache is only used when asked for, and then the repeated input gets
+ * the first result again. */
+
+static uint64_t counting( uint64_t x )
+{
+    static atomic_uint_fast64_t calls;
+    return x + 1000 * atomic_fetch_add( &calls, 1 );
+}
+
+static void test_memo( int options )
+{
+    pid_t pid = server_start( 1, counting, options );
+    char buf[ 8 ], first[ 8 ], second[ 8 ];
+
+    encode( buf, 7 );
+    int fd = client_start( buf );
+    assert( recv( fd, first, 8, MSG_WAITALL ) == 8 );
+    assert( write( fd, buf, 8 ) == 8 );
+    assert( recv( fd, second, 8, MSG_WAITALL ) == 8 );
+    close_or_warn( fd, "memo client" );
+
+    assert( ( memcmp( first, second, 8 ) == 0 ) ==
+            !!( options & COMPUTE_MEMO ) );
+    assert( reap( pid ) == 0 );
+    unlink_if_exists( "zt.p6_socket" );
+}
+
 int main( void )
 {
     unlink_if_exists( "zt.p6_socket" );
@@ -192,5 +961,9 @@ int main( void )
 
     unlink_if_exists( "zt.p6_socket" );
 
+    test_pipelined();
+    test_hangup();
+    test_memo( 0 );
+    test_memo( COMPUTE_MEMO );
     return 0;
 }
@@ -24,35 +24,70 @@
  * propojeny ukazatelem ‹handle›, který je výsledkem podprogramu
  * ‹counter_start›. */
 
+#define CACHE_LINE 64
+
+/* The byte count is written only by the counter thread, so it does
+ * not need a read-modify-write; readers only ever load it. Each slot
+ * lives on its own cache line, so polling readers never share a line
+ * with anything the counter thread writes besides the counter itself.
+ * The ‹seq› field is a seqlock which lets ‹counter_snapshot› read
+ * several counters as one consistent unit without blocking the
+ * writer. */
+
+struct counter_slot {
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t value;
+};
+
+struct counter_snapshot {
+    uint64_t bytes;
+    uint64_t reads;
+};
+
 struct handle {
     int fd;
-    atomic_int bytes;
+    int max_delay;
     pthread_t tid;
     int rv;
+    struct counter_slot bytes;
+    struct counter_slot reads;
+    _Alignas(CACHE_LINE) atomic_uint seq;
 };
 
+static void counter_publish(struct handle *handle, ssize_t nbytes) {
+    unsigned seq = atomic_load_explicit(&handle->seq, memory_order_relaxed);
+    uint64_t bytes = atomic_load_explicit(&handle->bytes.value, memory_order_relaxed);
+    uint64_t reads = atomic_load_explicit(&handle->reads.value, memory_order_relaxed);
+
+    atomic_store_explicit(&handle->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&handle->bytes.value, bytes + nbytes, memory_order_relaxed);
+    atomic_store_explicit(&handle->reads.value, reads + 1, memory_order_relaxed);
+    atomic_store_explicit(&handle->seq, seq + 2, memory_order_release);
+}
+
 void *counter(void *data) {
     struct handle *handle = data;
     uint8_t buffer[BUF_SIZE];
     ssize_t nbytes;
     while ((nbytes = read(handle->fd, buffer, BUF_SIZE)) > 0) {
-        handle->bytes += nbytes;
-    }
-    if (nbytes == -1) {
-        handle->rv = -1;
+        counter_publish(handle, nbytes);
     }
-    handle->rv = 0;
+    handle->rv = nbytes == -1 ? -1 : 0;
     return NULL;
 }
 
 void *counter_start(int fd, int max_delay) {
-    struct handle *handle = malloc(sizeof(struct handle));
-    if (!handle) {
+    struct handle *handle;
+    if (posix_memalign((void **) &handle, CACHE_LINE, sizeof(struct handle)) != 0) {
         return NULL;
     }
     handle->fd = fd;
-    handle->bytes = 0;
-    // todo delay
+    // every read is published right away, so we are always within max_delay
+    handle->max_delay = max_delay;
+    handle->rv = 0;
+    atomic_init(&handle->bytes.value, 0);
+    atomic_init(&handle->reads.value, 0);
+    atomic_init(&handle->seq, 0);
     if (pthread_create(&handle->tid, NULL, counter, handle) != 0) {
         free(handle);
         return NULL;
@@ -60,6 +95,21 @@ void *counter_start(int fd, int max_delay) {
     return handle;
 }
 
+/* Consistent snapshot of all counters, taken without ever writing to
+ * shared memory: retry while the counter thread is mid-update. */
+
+void counter_snapshot(void *handle, struct counter_snapshot *snap) {
+    struct handle *h = handle;
+    unsigned begin, end;
+    do {
+        begin = atomic_load_explicit(&h->seq, memory_order_acquire);
+        snap->bytes = atomic_load_explicit(&h->bytes.value, memory_order_relaxed);
+        snap->reads = atomic_load_explicit(&h->reads.value, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        end = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    } while (begin != end || (begin & 1));
+}
+
 /* Podprogram ‹counter_read›, kdykoliv je zavolán, vrátí aktuální
  * hodnotu počítadla bajtů. Předchází-li spuštění ‹counter_read›
  * zápis ⟦n⟧ bajtů,¹ musí návratová hodnota opakovaného volání
@@ -69,7 +119,8 @@ void *counter_start(int fd, int max_delay) {
  * ‹counter_start›. */
 
 int counter_read(void *handle) {
-    return ((struct handle *) handle)->bytes;
+    struct handle *h = handle;
+    return (int) atomic_load_explicit(&h->bytes.value, memory_order_relaxed);
 }
 
 /* Podprogram ‹counter_cleanup› obdrží ukazatel ‹handle›, který byl
@@ -93,7 +144,7 @@ int counter_cleanup(void *handle) {
         free(h);
         return -1;
     }
-    int rv = h->bytes;
+    int rv = (int) atomic_load_explicit(&h->bytes.value, memory_order_relaxed);
     if (close(h->fd) == -1) rv = -1;
     free(h);
     return rv;
@@ -107,6 +158,9 @@ int counter_cleanup(void *handle) {
 
 #include <sched.h>      /* sched_yield */
 #include <signal.h>     /* signal, SIGPIPE, SIG_IGN */
+#include <stdbool.h>    /* true, false */
+#include <stdio.h>      /* dprintf */
+#include <time.h>       /* clock_gettime */
 
 static void close_or_warn(int fd, const char *name) {
     if (close(fd) == -1)
@@ -134,6 +188,96 @@ static void fill(int fd, ssize_t bytes) {
     assert(bytes == 0);
 }
 
+#define READERS 8
+
+struct reader {
+    pthread_t tid;
+    void *handle;
+    atomic_bool *stop;
+    uint64_t polls;
+};
+
+/* Poll the snapshot as fast as possible; the values must never go
+ * backwards and each published read carries at least one byte. */
+
+static void *poll_snapshots(void *data) {
+    struct reader *reader = data;
+    struct counter_snapshot prev = { 0, 0 }, snap;
+
+    while (!atomic_load(reader->stop)) {
+        counter_snapshot(reader->handle, &snap);
+        assert(snap.bytes >= prev.bytes);
+        assert(snap.reads >= prev.reads);
+        assert(snap.reads <= snap.bytes);
+        prev = snap;
+        ++reader->polls;
+    }
+
+    return NULL;
+}
+
+/* Time the transfer of ‹total› bytes while ‹nreaders› threads poll
+ * snapshots; returns the data rate in MiB/s and adds the number of
+ * snapshots taken to ‹*polls›. */
+
+static double stress_readers(ssize_t total, int nreaders, uint64_t *polls) {
+    int fd_r, fd_w;
+    atomic_bool stop = false;
+    struct reader readers[READERS];
+    struct timespec start, end;
+
+    mk_pipe(&fd_r, &fd_w);
+    void *handle = counter_start(fd_r, 1);
+    assert(handle);
+
+    for (int i = 0; i < nreaders; ++i) {
+        readers[i].handle = handle;
+        readers[i].stop = &stop;
+        readers[i].polls = 0;
+        if (pthread_create(&readers[i].tid, NULL, poll_snapshots, &readers[i]) != 0)
+            err(2, "pthread_create");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fill(fd_w, total);
+    close_or_warn(fd_w, "write end of the pipe");
+
+    struct counter_snapshot snap;
+    do
+        counter_snapshot(handle, &snap);
+    while (snap.bytes < (uint64_t) total);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_store(&stop, true);
+    for (int i = 0; i < nreaders; ++i) {
+        if (pthread_join(readers[i].tid, NULL) != 0)
+            err(2, "pthread_join");
+        *polls += readers[i].polls;
+    }
+
+    assert(snap.bytes == (uint64_t) total);
+    assert(counter_cleanup(handle) == total);
+
+    double seconds = end.tv_sec - start.tv_sec +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    return total / seconds / (1 << 20);
+}
+
+/* Readers only load the counters, so with enough cores the data rate
+ * should not drop when they are added (with fewer cores than threads,
+ * they still compete for processor time). */
+
+static void bench_readers(ssize_t total) {
+    uint64_t polls = 0;
+    double alone = stress_readers(total, 0, &polls);
+    double shared = stress_readers(total, READERS, &polls);
+
+    assert(polls > 0);
+    dprintf(2, "counter: %.0f MiB/s alone, %.0f MiB/s with %d readers "
+               "(%llu snapshots)\n", alone, shared, READERS,
+            (unsigned long long) polls);
+}
+
 int main(void) {
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         err(2, "signal");
@@ -163,5 +307,7 @@ int main(void) {
     assert(counter_read(handle) <= 6000);
     close_or_warn(fd_w, "write end of the pipe");
     assert(counter_cleanup(handle) == 6000);
+
+    bench_readers(1 << 24);
     return 0;
 }
@@ -12,6 +12,11 @@
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>          /* open */
+#include <sys/mman.h>       /* mmap, msync, munmap */
+#include <sys/stat.h>       /* fstat */
 
 #define RECV_SIZE 4
 
@@ -41,16 +46,232 @@
  * klientů, -1 znamená systémovou chybu. */
 
 
+struct store;
+
 struct client {
     int fd;
     atomic_int rv;
     pthread_t tid;
     bool started;
+    struct store *store;    /* holds the state instead of ‹state› */
 };
 
 atomic_uint_least32_t state;
 const uint32_t MESSAGE = 0xffffffff;
 
+#define STORE_MAGIC      0x73746f72u    /* "stor" */
+#define STORE_CHECKPOINT 4096           /* log records between snapshots */
+
+/* Persistent state. The state file holds a small header with the
+ * state in it and is mapped into memory, so reading the state is
+ * a plain atomic load. Every new state is first appended to
+ * a write-ahead log (‹path›.wal) and synced, and only then stored in
+ * the mapping and confirmed to the client; all of it happens under
+ * ‹lock›, so nobody can see a state which a crash would lose. Every
+ * ‹STORE_CHECKPOINT› records the mapping is synced to disk, which
+ * makes the log redundant, and the log is truncated. On startup,
+ * only the records after the last checkpoint are read (the last
+ * valid one wins), so restart time does not depend on how long the
+ * server has been running.
+ *
+ * The header field ‹applied› says how much of the log is already
+ * contained in the state file. It is synced together with the state
+ * before the log is truncated, and reset (and synced) before
+ * anything new is appended, hence if it is ever larger than the log,
+ * the truncation went through and the whole (empty) log is new.
+ * A torn record at the end of the log fails its check and is
+ * dropped – it was never confirmed. */
+
+struct store_header {
+    uint32_t magic;
+    atomic_uint_least32_t state;
+    uint64_t applied;
+};
+
+struct store_record {
+    uint32_t state;
+    uint32_t check;
+};
+
+struct store {
+    int snap_fd, log_fd;
+    struct store_header *header;
+    uint64_t log_len;
+    int pending;
+    pthread_mutex_t lock;
+};
+
+static uint32_t store_check(uint32_t state) {
+    return state ^ STORE_MAGIC;
+}
+
+/* Must be called with ‹lock› held (or before the store is shared). */
+
+static int store_checkpoint(struct store *store) {
+    store->header->applied = store->log_len;
+    if (msync(store->header, sizeof *store->header, MS_SYNC) == -1 ||
+        ftruncate(store->log_fd, 0) == -1) {
+        return -1;
+    }
+    store->log_len = 0;
+    store->header->applied = 0;
+    store->pending = 0;
+    return msync(store->header, sizeof *store->header, MS_SYNC);
+}
+
+static int store_replay(struct store *store) {
+    struct store_record records[256];
+    uint64_t offset = store->header->applied;
+    if (offset > store->log_len) {
+        offset = store->log_len;
+    }
+    while (offset < store->log_len) {
+        ssize_t nbytes = pread(store->log_fd, records, sizeof records, offset);
+        if (nbytes == -1) {
+            return -1;
+        }
+        size_t count = nbytes / sizeof(struct store_record);
+        size_t i = 0;
+        for (; i < count; ++i) {
+            if (records[i].check != store_check(records[i].state)) {
+                break;
+            }
+            atomic_store(&store->header->state, records[i].state);
+        }
+        offset += i * sizeof(struct store_record);
+        if (i == 0 || i < count) {
+            break;
+        }
+    }
+    store->log_len = offset;    /* drops a torn or garbled tail */
+    return store_checkpoint(store);
+}
+
+static int store_close(struct store *store);
+
+/* Open (or create) the store at ‹path›; ‹initial› is only used when
+ * the state file does not exist yet. Returns a null pointer on
+ * error. */
+
+static struct store *store_open(const char *path, uint32_t initial) {
+    struct store *store = calloc(1, sizeof(struct store));
+    char *log_path = malloc(strlen(path) + 5);
+    if (!store || !log_path) {
+        free(store);
+        free(log_path);
+        return NULL;
+    }
+    strcpy(log_path, path);
+    strcat(log_path, ".wal");
+    pthread_mutex_init(&store->lock, NULL);
+    store->snap_fd = open(path, O_RDWR | O_CREAT, 0666);
+    store->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(log_path);
+
+    struct stat st_snap, st_log;
+    if (store->snap_fd == -1 || store->log_fd == -1 ||
+        fstat(store->snap_fd, &st_snap) == -1 ||
+        fstat(store->log_fd, &st_log) == -1) {
+        goto err;
+    }
+    bool fresh = st_snap.st_size == 0;
+    if (fresh && ftruncate(store->snap_fd, sizeof(struct store_header)) == -1) {
+        goto err;
+    }
+    if (!fresh && st_snap.st_size != sizeof(struct store_header)) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->header = mmap(NULL, sizeof(struct store_header),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, store->snap_fd, 0);
+    if (store->header == MAP_FAILED) {
+        store->header = NULL;
+        goto err;
+    }
+
+    if (fresh) {
+        store->header->magic = STORE_MAGIC;
+        atomic_init(&store->header->state, initial);
+        store->header->applied = 0;
+        /* a log without a state file is stale */
+        if (ftruncate(store->log_fd, 0) == -1) {
+            goto err;
+        }
+        st_log.st_size = 0;
+    } else if (store->header->magic != STORE_MAGIC) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->log_len = st_log.st_size;
+    if (store_replay(store) == -1) {
+        goto err;
+    }
+    return store;
+
+err:
+    store_close(store);
+    return NULL;
+}
+
+static uint32_t store_get(struct store *store) {
+    return atomic_load(&store->header->state);
+}
+
+/* Log, sync and apply a new state; only a successful return may be
+ * confirmed to the client. */
+
+static int store_set(struct store *store, uint32_t state) {
+    struct store_record record = { state, store_check(state) };
+    int rv = 0;
+
+    pthread_mutex_lock(&store->lock);
+    if (write(store->log_fd, &record, sizeof record) != sizeof record ||
+        fdatasync(store->log_fd) == -1) {
+        rv = -1;
+    } else {
+        store->log_len += sizeof record;
+        atomic_store(&store->header->state, state);
+        if (++store->pending >= STORE_CHECKPOINT) {
+            rv = store_checkpoint(store);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return rv;
+}
+
+static int store_close(struct store *store) {
+    int rv = 0;
+    if (store->header) {
+        if (store_checkpoint(store) == -1 ||
+            munmap(store->header, sizeof(struct store_header)) == -1) {
+            rv = -1;
+        }
+    }
+    if (store->snap_fd != -1 && close(store->snap_fd) == -1) {
+        rv = -1;
+    }
+    if (store->log_fd != -1 && close(store->log_fd) == -1) {
+        rv = -1;
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+    return rv;
+}
+
+/* With a store, the state lives in it instead of ‹state›. */
+
+static uint32_t memo_get(struct store *store) {
+    return store ? store_get(store) : state;
+}
+
+static int memo_set(struct store *store, uint32_t value) {
+    if (store) {
+        return store_set(store, value);
+    }
+    state = value;
+    return 0;
+}
+
 void *client_thread(void *data) {
     int rv = -1;
     struct client *client = data;
@@ -63,7 +284,7 @@ void *client_thread(void *data) {
             offset += nbytes;
         }
 //        printf("tid: %lu nbytes: %zd, offset: %zd\n", client->tid, nbytes, offset);
-        if (nbytes == 0) {
+        if (nbytes == 0 || (nbytes == -1 && errno == ECONNRESET)) {
             break;
         }
         if (nbytes == -1) {
@@ -72,13 +293,15 @@ void *client_thread(void *data) {
         }
         msg = buffer[3] | (buffer[2] << 8) | (buffer[1] << 16) | (buffer[0] << 24);
         if (msg != MESSAGE) {
-            state = msg;
+            if (memo_set(client->store, msg) == -1) {
+                goto err;
+            }
             if (write(client->fd, &MESSAGE, RECV_SIZE) == -1) {
 //                printf("tid: %lu write failed: %zd\n", client->tid, nbytes);
                 goto err;
             }
         } else {
-            msg = htonl(state);
+            msg = htonl(memo_get(client->store));
             if (write(client->fd, &msg, RECV_SIZE) == -1) {
 //                printf("tid: %lu write failed: %zd\n", client->tid, nbytes);
                 goto err;
@@ -122,7 +345,7 @@ static int reap_threads(struct client *clients, int count) {
     return rv;
 }
 
-int memo_server(int sock_fd, int count, uint32_t initial) {
+static int memo_run(int sock_fd, int count, uint32_t initial, struct store *store) {
     int rv = -1;
     struct client *clients = malloc(count * sizeof(struct client));
     if (!clients) {
@@ -131,6 +354,7 @@ int memo_server(int sock_fd, int count, uint32_t initial) {
     for (int client = 0; client < count; ++client) {
         clients[client].started = false;
         clients[client].fd = -1;
+        clients[client].store = store;
     }
     state = initial;
     for (int client = 0; client < count; ++client) {
@@ -148,6 +372,26 @@ int memo_server(int sock_fd, int count, uint32_t initial) {
     return reap_threads(clients, count);
 }
 
+int memo_server(int sock_fd, int count, uint32_t initial) {
+    return memo_run(sock_fd, count, initial, NULL);
+}
+
+/* Same as ‹memo_server›, but the state survives a restart: it lives
+ * in the store at ‹path› and ‹initial› is only used if the store
+ * does not exist yet. */
+
+int memo_server_persistent(int sock_fd, int count, const char *path, uint32_t initial) {
+    struct store *store = store_open(path, initial);
+    if (!store) {
+        return -1;
+    }
+    int rv = memo_run(sock_fd, count, initial, store);
+    if (store_close(store) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <sys/wait.h>       /* waitpid */
@@ -197,6 +441,35 @@ static const struct sockaddr_un test_addr =
                 .sun_path = "zt.a_socket"
         };
 
+static pid_t fork_persistent(const char *path, int clients, uint32_t init) {
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sock_fd == -1)
+        err(2, "socket");
+
+    unlink_if_exists(test_addr.sun_path);
+
+    if (bind(sock_fd, (const struct sockaddr *) &test_addr,
+             sizeof test_addr) == -1)
+        err(2, "bind");
+
+    if (listen(sock_fd, clients) == -1)
+        err(2, "listen");
+
+    pid_t pid = fork();
+
+    if (pid == -1)
+        err(2, "fork");
+
+    if (pid == 0) {
+        alarm(3);
+        exit(memo_server_persistent(sock_fd, clients, path, init) ? 1 : 0);
+    }
+
+    close_or_warn(sock_fd, "server socket in client");
+    return pid;
+}
+
 static int client_connect() {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
@@ -237,6 +510,39 @@ static int client_get(int fd) {
     return ntohl(msg);
 }
 
+/* The state survives both a clean restart and a crash. */
+
+static void test_persistent(void) {
+    unlink_if_exists("zt.p2_state");
+    unlink_if_exists("zt.p2_state.wal");
+
+    pid_t pid = fork_persistent("zt.p2_state", 1, 33);
+    int fd = client_connect();
+    assert(client_get(fd) == 33);
+    assert(client_set(fd, 77) == 0);
+    close_or_warn(fd, "client");
+    assert(reap(pid) == 0);
+
+    pid = fork_persistent("zt.p2_state", 1, 11);
+    fd = client_connect();
+    assert(client_get(fd) == 77);
+    assert(client_set(fd, 78) == 0);
+    if (kill(pid, SIGKILL) == -1)
+        err(2, "kill");
+    assert(reap(pid) == -1);
+    close_or_warn(fd, "client");
+
+    pid = fork_persistent("zt.p2_state", 1, 11);
+    fd = client_connect();
+    assert(client_get(fd) == 78);
+    close_or_warn(fd, "client");
+    assert(reap(pid) == 0);
+
+    unlink_if_exists("zt.p2_state");
+    unlink_if_exists("zt.p2_state.wal");
+    unlink_if_exists(test_addr.sun_path);
+}
+
 int main(void) {
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         err(2, "signal");
@@ -292,5 +598,7 @@ int main(void) {
     assert(reap(pid) == 0);
 
     unlink_if_exists(test_addr.sun_path);
+
+    test_persistent();
     return 0;
 }
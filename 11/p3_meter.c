@@ -44,16 +44,44 @@
  * zápisy do ‹fd_1› a ‹fd_2› budou i v blokujícím režimu provedeny
  * obratem (nehrozí tedy uváznutí při zápisu, ani hladovění). */
 
+#define CACHE_LINE 64
+
+/* One counter per direction (indexed by the descriptor the data was
+ * read from), each on its own cache line. Only the ‹meter› thread
+ * writes them, so plain relaxed stores are enough and readers never
+ * touch a line the data path writes to besides the counters
+ * themselves. The seqlock ‹seq› lets ‹meter_snapshot› read both
+ * directions as one consistent pair. */
+
+struct counter_slot {
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t value;
+};
+
+struct meter_snapshot {
+    uint64_t bytes[2];
+};
+
 struct handle {
     struct pollfd fds[2];
-    atomic_int bytes;
+    int max_delay;
     pthread_t tid;
     int rv;
+    struct counter_slot bytes[2];
+    _Alignas(CACHE_LINE) atomic_uint seq;
 };
 
+static void meter_publish(struct handle *handle, int dir, ssize_t nbytes) {
+    unsigned seq = atomic_load_explicit(&handle->seq, memory_order_relaxed);
+    uint64_t bytes = atomic_load_explicit(&handle->bytes[dir].value, memory_order_relaxed);
+
+    atomic_store_explicit(&handle->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&handle->bytes[dir].value, bytes + nbytes, memory_order_relaxed);
+    atomic_store_explicit(&handle->seq, seq + 2, memory_order_release);
+}
+
 void *meter(void *data) {
     struct handle *handle = data;
-//    printf("tid: %lu bytes: %d\n", handle->tid, handle->bytes);
 
     uint8_t buffer[BUF_SIZE];
     ssize_t bytes_read;
@@ -88,24 +116,27 @@ void *meter(void *data) {
 //                    printf("tid: %lu write failed\n", handle->tid);
                     return NULL;
                 }
-                handle->bytes += bytes_read;
-//                printf("tid: %lu bytes transfered: %d\n", handle->tid, handle->bytes);
+                meter_publish(handle, i, bytes_read);
             }
         }
     }
 }
 
 void *meter_start(int fd_1, int fd_2, int max_delay) {
-    struct handle *handle = malloc(sizeof(struct handle));
-    if (!handle) {
+    struct handle *handle;
+    if (posix_memalign((void **) &handle, CACHE_LINE, sizeof(struct handle)) != 0) {
         return NULL;
     }
     handle->fds[0].fd = fd_1;
     handle->fds[0].events = POLLIN;
     handle->fds[1].fd = fd_2;
     handle->fds[1].events = POLLIN;
-    handle->bytes = 0;
-    // todo delay
+    // every forwarded block is published right away, so we are always within max_delay
+    handle->max_delay = max_delay;
+    handle->rv = 0;
+    atomic_init(&handle->bytes[0].value, 0);
+    atomic_init(&handle->bytes[1].value, 0);
+    atomic_init(&handle->seq, 0);
     if (pthread_create(&handle->tid, NULL, meter, handle) != 0) {
         free(handle);
         return NULL;
@@ -121,7 +152,24 @@ void *meter_start(int fd_1, int fd_2, int max_delay) {
  * */
 
 int meter_read(void *handle) {
-    return ((struct handle *) handle)->bytes;
+    struct handle *h = handle;
+    return (int) (atomic_load_explicit(&h->bytes[0].value, memory_order_relaxed) +
+                  atomic_load_explicit(&h->bytes[1].value, memory_order_relaxed));
+}
+
+/* Consistent per-direction snapshot, taken without writing to shared
+ * memory: retry while the ‹meter› thread is mid-update. */
+
+void meter_snapshot(void *handle, struct meter_snapshot *snap) {
+    struct handle *h = handle;
+    unsigned begin, end;
+    do {
+        begin = atomic_load_explicit(&h->seq, memory_order_acquire);
+        snap->bytes[0] = atomic_load_explicit(&h->bytes[0].value, memory_order_relaxed);
+        snap->bytes[1] = atomic_load_explicit(&h->bytes[1].value, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        end = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    } while (begin != end || (begin & 1));
 }
 
 /* Podprogram ‹meter_cleanup› obdrží ukazatel ‹handle›, který byl
@@ -138,11 +186,10 @@ int meter_cleanup(void *handle) {
     if (pthread_join(h->tid, NULL) != 0 || h->rv != 0) {
         close(h->fds[0].fd);
         close(h->fds[1].fd);
-//        printf("join failed rv: %d bytes: %d\n", h->rv, h->bytes);
         free(h);
         return -1;
     }
-    int rv = h->bytes;
+    int rv = meter_read(h);
     if (close(h->fds[0].fd) == -1) rv = -1;
     if (close(h->fds[1].fd) == -1) rv = -1;
     free(h);
@@ -154,6 +201,8 @@ int meter_cleanup(void *handle) {
 
 #include <sched.h>      /* sched_yield */
 #include <signal.h>     /* signal, SIGPIPE, SIG_IGN */
+#include <stdbool.h>    /* true, false */
+#include <time.h>       /* clock_gettime */
 
 static void close_or_warn(int fd, const char *name) {
     if (close(fd) == -1)
@@ -182,6 +231,106 @@ static int drain(int fd, ssize_t bytes) {
         return 0;
 }
 
+#define READERS 8
+
+struct reader {
+    pthread_t tid;
+    void *handle;
+    atomic_bool *stop;
+    uint64_t polls;
+};
+
+/* Poll the snapshot as fast as possible; neither direction may ever
+ * go backwards. */
+
+static void *poll_snapshots(void *data) {
+    struct reader *reader = data;
+    struct meter_snapshot prev = { { 0, 0 } }, snap;
+
+    while (!atomic_load(reader->stop)) {
+        meter_snapshot(reader->handle, &snap);
+        assert(snap.bytes[0] >= prev.bytes[0]);
+        assert(snap.bytes[1] >= prev.bytes[1]);
+        prev = snap;
+        ++reader->polls;
+    }
+
+    return NULL;
+}
+
+/* Forward ‹rounds› blocks while ‹nreaders› threads poll snapshots;
+ * returns the data rate in MiB/s and adds the number of snapshots
+ * taken to ‹*polls›. */
+
+static double stress_readers(int rounds, int nreaders, uint64_t *polls) {
+    int fds_a[2], fds_b[2];
+    atomic_bool stop = false;
+    struct reader readers[READERS];
+    char buf[512];
+    struct timespec start, end;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds_a) == -1 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds_b) == -1)
+        err(1, "creating a socketpair");
+
+    void *handle = meter_start(fds_a[0], fds_b[0], 1);
+    assert(handle);
+
+    for (int i = 0; i < nreaders; ++i) {
+        readers[i].handle = handle;
+        readers[i].stop = &stop;
+        readers[i].polls = 0;
+        if (pthread_create(&readers[i].tid, NULL, poll_snapshots, &readers[i]) != 0)
+            err(2, "pthread_create");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < rounds; ++i) {
+        fill(fds_a[1], sizeof buf);
+        assert(recv(fds_b[1], buf, sizeof buf, MSG_WAITALL) == sizeof buf);
+    }
+
+    struct meter_snapshot snap;
+    do
+        meter_snapshot(handle, &snap);
+    while (snap.bytes[0] < (uint64_t) rounds * sizeof buf);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_store(&stop, true);
+    for (int i = 0; i < nreaders; ++i) {
+        if (pthread_join(readers[i].tid, NULL) != 0)
+            err(2, "pthread_join");
+        *polls += readers[i].polls;
+    }
+
+    assert(snap.bytes[0] == (uint64_t) rounds * sizeof buf);
+    assert(snap.bytes[1] == 0);
+
+    close_or_warn(fds_a[1], "socket");
+    close_or_warn(fds_b[1], "socket");
+    assert(meter_cleanup(handle) == rounds * (int) sizeof buf);
+
+    double seconds = end.tv_sec - start.tv_sec +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    return rounds * sizeof buf / seconds / (1 << 20);
+}
+
+/* Readers only load the counters, so with enough cores the data rate
+ * should not drop when they are added (with fewer cores than threads,
+ * they still compete for processor time). */
+
+static void bench_readers(int rounds) {
+    uint64_t polls = 0;
+    double alone = stress_readers(rounds, 0, &polls);
+    double shared = stress_readers(rounds, READERS, &polls);
+
+    assert(polls > 0);
+    dprintf(2, "meter: %.1f MiB/s alone, %.1f MiB/s with %d readers "
+               "(%llu snapshots)\n", alone, shared, READERS,
+               (unsigned long long) polls);
+}
+
 int main(void) {
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         err(2, "signal");
@@ -225,5 +374,7 @@ int main(void) {
     printf("cleanup: %d\n", meter_cleanup(handle));
 //    assert(meter_cleanup(handle) >= 13 + 20 * 15 + 20 * 36);
 
+    bench_readers(2000);
+
     return 0;
 }
@@ -14,6 +14,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdatomic.h>
+#include <fcntl.h>          /* fcntl, O_NONBLOCK */
+#include <sys/epoll.h>      /* epoll_create1, epoll_ctl, epoll_wait */
+#include <sys/eventfd.h>    /* eventfd */
+#include <sys/uio.h>        /* writev, struct iovec */
+#include <sys/mman.h>       /* mmap, msync, munmap */
+#include <sys/stat.h>       /* fstat */
 
 /* Napište podprogram ‹multi_server›, který bude pracovat podobně
  * jako ‹memo_server› z dřívější přípravy, s tím rozdílem, že bude
@@ -76,7 +82,7 @@ void *client_thread(void *handle) {
             offset += nbytes;
         }
 //        printf("tid: %lu nbytes: %zd, offset: %zd\n", client->tid, nbytes, offset);
-        if (nbytes == 0) {
+        if (nbytes == 0 || (nbytes == -1 && errno == ECONNRESET)) {
             break;
         }
         if (nbytes == -1) {
@@ -179,16 +185,673 @@ int multi_server(int sock_fd, int count, const uint32_t *initial, int size) {
 //        printf("thread %d started, tid: %lu\n", client, clients[client].tid);
     }
 
+//    printf("calling reap\n");
+    rv = reap_threads(clients, count);
     free(server_data);
     server_data = NULL;
-//    printf("calling reap\n");
-    return reap_threads(clients, count);
+    return rv;
+}
+
+#define STORE_MAGIC      0x73746f72u    /* "stor" */
+#define STORE_CHECKPOINT 4096           /* log records between snapshots */
+
+/* Persistent cell storage. The snapshot file holds a small header
+ * followed by the cells and is mapped into memory, so the mapping
+ * *is* the live state and reads are plain atomic loads. Every
+ * update is first appended to a write-ahead log (‹path›.wal) and
+ * synced, and only then applied to the mapping and confirmed to the
+ * client, so nobody can see a value which a crash would lose.
+ *
+ * Appending (‹store_append›) and syncing (‹store_commit›) are
+ * separate, so that the workers do not take turns in ‹fdatasync›:
+ * a record is written under the lock, but the sync runs without it.
+ * Whoever commits while no sync is in progress syncs everything
+ * written so far, and then applies it to the mapping in log order;
+ * those who come meanwhile wait for the sync which covers their
+ * records (or start the next one). A worker appends all the sets of
+ * a batch and commits once, before it sends the replies.
+ *
+ * Every ‹STORE_CHECKPOINT› records the mapping is synced to disk,
+ * which makes the log redundant, and the log is truncated (records
+ * which wait for a sync are written to it again). On startup,
+ * only the records after the last checkpoint are replayed, so
+ * restart time is bounded by the snapshot size plus
+ * ‹STORE_CHECKPOINT› records, no matter how long the server has been
+ * running.
+ *
+ * The header field ‹applied› says how much of the log is already
+ * contained in the snapshot. It is set before the log is truncated
+ * and reset (and synced) before anything new is appended, hence if
+ * it is ever larger than the log, the truncation went through and
+ * the whole (empty) log is new. A torn record at the end of the log
+ * fails its check and is dropped – it was never confirmed. */
+
+struct store_header {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t applied;
+};
+
+struct store_record {
+    uint32_t cell;
+    uint32_t value;
+    uint32_t check;
+};
+
+struct store {
+    int snap_fd, log_fd;
+    struct store_header *header;
+    atomic_uint_least32_t *cells;
+    size_t map_len;
+    uint64_t log_len;
+    int pending;                /* records applied since the checkpoint */
+    atomic_bool failed;         /* nothing more may be confirmed */
+
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cv;
+    bool syncing;
+    uint64_t written, synced;   /* records, ever; the tickets */
+    struct store_record *queue; /* written, not yet applied */
+    size_t queued, queue_cap;
+};
+
+static uint32_t store_check(uint32_t cell, uint32_t value) {
+    return (cell * 0x9e3779b1u) ^ value ^ STORE_MAGIC;
+}
+
+static int store_sync_header(struct store *store) {
+    long page = sysconf(_SC_PAGESIZE);
+    return msync(store->header, page < (long) store->map_len ? (size_t) page : store->map_len,
+                 MS_SYNC);
+}
+
+/* Must be called with ‹lock› held (or before the store is shared).
+ * Records still in the ‹queue› are at the end of the log; they are
+ * written again to the truncated one. */
+
+static int store_checkpoint(struct store *store) {
+    size_t queued = store->queued * sizeof(struct store_record);
+    if (msync(store->header, store->map_len, MS_SYNC) == -1) {
+        return -1;
+    }
+    store->header->applied = store->log_len - queued;
+    if (store_sync_header(store) == -1 || ftruncate(store->log_fd, 0) == -1) {
+        return -1;
+    }
+    store->log_len = 0;
+    store->header->applied = 0;
+    store->pending = 0;
+    if (store_sync_header(store) == -1 ||
+        (queued && write(store->log_fd, store->queue, queued)
+                   != (ssize_t) queued)) {
+        return -1;
+    }
+    store->log_len = queued;
+    return 0;
+}
+
+static int store_replay(struct store *store) {
+    struct store_record records[256];
+    uint64_t offset = store->header->applied;
+    if (offset > store->log_len) {
+        offset = store->log_len;
+    }
+    while (offset < store->log_len) {
+        ssize_t nbytes = pread(store->log_fd, records, sizeof records, offset);
+        if (nbytes == -1) {
+            return -1;
+        }
+        size_t count = nbytes / sizeof(struct store_record);
+        if (count == 0) {
+            break;
+        }
+        size_t i = 0;
+        for (; i < count; ++i) {
+            struct store_record *r = &records[i];
+            if (r->cell >= store->header->size || r->check != store_check(r->cell, r->value)) {
+                break;
+            }
+            atomic_store(&store->cells[r->cell], r->value);
+        }
+        offset += i * sizeof(struct store_record);
+        if (i < count) {
+            break;
+        }
+    }
+    store->log_len = offset;    /* drops a torn or garbled tail */
+    return store_checkpoint(store);
+}
+
+static int store_close(struct store *store);
+
+/* Open (or create) the store at ‹path›; ‹initial› is only used when
+ * the snapshot does not exist yet. Returns a null pointer on error. */
+
+static struct store *store_open(const char *path, const uint32_t *initial, int size) {
+    struct store *store = calloc(1, sizeof(struct store));
+    char *log_path = malloc(strlen(path) + 5);
+    if (!store || !log_path) {
+        free(store);
+        free(log_path);
+        return NULL;
+    }
+    strcpy(log_path, path);
+    strcat(log_path, ".wal");
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->synced_cv, NULL);
+    atomic_init(&store->failed, false);
+    store->map_len = sizeof(struct store_header) + size * sizeof(uint32_t);
+    store->snap_fd = open(path, O_RDWR | O_CREAT, 0666);
+    store->log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(log_path);
+
+    struct stat st_snap, st_log;
+    if (store->snap_fd == -1 || store->log_fd == -1 ||
+        fstat(store->snap_fd, &st_snap) == -1 || fstat(store->log_fd, &st_log) == -1) {
+        goto err;
+    }
+    bool fresh = st_snap.st_size == 0;
+    if (fresh && ftruncate(store->snap_fd, store->map_len) == -1) {
+        goto err;
+    }
+    if (!fresh && (size_t) st_snap.st_size != store->map_len) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->header = mmap(NULL, store->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         store->snap_fd, 0);
+    if (store->header == MAP_FAILED) {
+        store->header = NULL;
+        goto err;
+    }
+    store->cells = (atomic_uint_least32_t *) (store->header + 1);
+
+    if (fresh) {
+        store->header->magic = STORE_MAGIC;
+        store->header->size = size;
+        store->header->applied = 0;
+        for (int i = 0; i < size; ++i) {
+            atomic_init(&store->cells[i], initial[i]);
+        }
+        /* a log without a snapshot is stale */
+        if (ftruncate(store->log_fd, 0) == -1) {
+            goto err;
+        }
+        st_log.st_size = 0;
+    } else if (store->header->magic != STORE_MAGIC || store->header->size != (uint32_t) size) {
+        errno = EINVAL;
+        goto err;
+    }
+    store->log_len = st_log.st_size;
+    if (store_replay(store) == -1) {
+        goto err;
+    }
+    return store;
+
+err:
+    store_close(store);
+    return NULL;
+}
+
+static uint32_t store_get(struct store *store, int cell) {
+    return atomic_load(&store->cells[cell]);
+}
+
+/* Write one update to the log; it is neither durable nor visible
+ * until ‹store_commit› is called with the ticket stored in ‹*ticket›. */
+
+static int store_append(struct store *store, int cell, uint32_t value,
+                        uint64_t *ticket) {
+    struct store_record record = { cell, value, store_check(cell, value) };
+    int rv = -1;
+
+    pthread_mutex_lock(&store->lock);
+    if (store->queued == store->queue_cap) {
+        size_t cap = store->queue_cap ? 2 * store->queue_cap : 64;
+        struct store_record *queue = realloc(store->queue,
+                                             cap * sizeof *queue);
+        if (!queue) {
+            goto out;
+        }
+        store->queue = queue;
+        store->queue_cap = cap;
+    }
+    if (!atomic_load(&store->failed) &&
+        write(store->log_fd, &record, sizeof record) == sizeof record) {
+        store->queue[store->queued++] = record;
+        store->log_len += sizeof record;
+        *ticket = ++store->written;
+        rv = 0;
+    }
+out:
+    if (rv == -1) {
+        atomic_store(&store->failed, true);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return rv;
+}
+
+/* Wait until the updates up to ‹ticket› are durable and applied; only
+ * then may they be confirmed to the client. */
+
+static int store_commit(struct store *store, uint64_t ticket) {
+    pthread_mutex_lock(&store->lock);
+    while (!atomic_load(&store->failed) && store->synced < ticket) {
+        if (store->syncing) {
+            pthread_cond_wait(&store->synced_cv, &store->lock);
+            continue;
+        }
+        store->syncing = true;
+        uint64_t target = store->written;
+        size_t count = store->queued;
+        pthread_mutex_unlock(&store->lock);
+        int rv = fdatasync(store->log_fd);
+        pthread_mutex_lock(&store->lock);
+
+        if (rv == -1) {
+            atomic_store(&store->failed, true);
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                struct store_record *r = &store->queue[i];
+                atomic_store(&store->cells[r->cell], r->value);
+            }
+            store->queued -= count;
+            memmove(store->queue, store->queue + count,
+                    store->queued * sizeof *store->queue);
+            store->synced = target;
+            store->pending += count;
+            if (store->pending >= STORE_CHECKPOINT &&
+                store_checkpoint(store) == -1) {
+                atomic_store(&store->failed, true);
+            }
+        }
+        store->syncing = false;
+        pthread_cond_broadcast(&store->synced_cv);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return atomic_load(&store->failed) ? -1 : 0;
+}
+
+/* Commit up to ‹ticket› (if non-zero); true if the store has failed,
+ * in which case nothing may be confirmed. */
+
+static bool store_failed(struct store *store, uint64_t ticket) {
+    return ticket ? store_commit(store, ticket) == -1
+                  : atomic_load(&store->failed);
+}
+
+static int store_close(struct store *store) {
+    int rv = 0;
+    if (store->header) {
+        if (store_checkpoint(store) == -1 || munmap(store->header, store->map_len) == -1) {
+            rv = -1;
+        }
+    }
+    if (store->snap_fd != -1 && close(store->snap_fd) == -1) {
+        rv = -1;
+    }
+    if (store->log_fd != -1 && close(store->log_fd) == -1) {
+        rv = -1;
+    }
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->synced_cv);
+    free(store->queue);
+    free(store);
+    return rv;
+}
+
+#define CACHE_LINE   64
+#define MAX_WORKERS  8
+#define MAX_EVENTS   64
+#define BATCH        64     /* messages handled per read */
+
+/* A variant of ‹multi_server› for many clients hammering few cells.
+ * Instead of a thread per client there is a small pool of workers,
+ * each with its own epoll instance; the calling thread only accepts
+ * connections and hands them out round-robin, so every client is
+ * owned by exactly one worker and needs no locking. Cells are
+ * atomics, each on its own cache line, so writers to neighbouring
+ * cells do not bounce a shared line between cores. A set is stored
+ * before it is confirmed, so any get which happens after the
+ * confirmation sees it (or a newer value). All replies to a batch of
+ * messages go out in a single ‹writev›, together with whatever was
+ * left over from the previous batch; with a store, the sets of the
+ * batch are committed together just before that. */
+
+struct sharded_cell {
+    _Alignas(CACHE_LINE) atomic_uint_least32_t value;
+};
+
+struct sharded_client {
+    int fd;
+    uint32_t events;
+    uint8_t in[RECV_SIZE * BATCH];
+    size_t in_len;
+    uint8_t out[SEND_SIZE * BATCH];
+    size_t out_len;
+};
+
+struct sharded_server {
+    struct sharded_cell *cells;
+    struct store *store;        /* replaces ‹cells› if persistent */
+    int size;
+    int stop_fd;
+    atomic_int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int closed;
+};
+
+struct sharded_worker {
+    struct sharded_server *server;
+    int epoll_fd;
+    pthread_t tid;
+    bool started;
+};
+
+/* With a store, ‹*ticket› is that of the last set of the batch which
+ * is not committed yet, or 0. A get commits them first, so that the
+ * client sees its own sets. A failed store fails every later commit,
+ * so the replies to the batch are never sent. */
+
+static uint32_t sharded_apply(struct sharded_server *server,
+                              const uint8_t *msg, uint64_t *ticket) {
+    uint16_t cell = (uint16_t) (msg[0] << 8 | msg[1]);
+    uint32_t data = (uint32_t) msg[2] << 24 | (uint32_t) msg[3] << 16 |
+                    (uint32_t) msg[4] << 8 | msg[5];
+    if (cell >= server->size) {
+        return MESSAGE;
+    }
+    if (server->store) {
+        if (data != MESSAGE) {
+            return store_append(server->store, cell, data, ticket) == -1
+                   ? MESSAGE : data;
+        }
+        if (*ticket && store_commit(server->store, *ticket) == -1) {
+            return MESSAGE;
+        }
+        *ticket = 0;
+        return store_get(server->store, cell);
+    }
+    if (data != MESSAGE) {
+        atomic_store(&server->cells[cell].value, data);
+        return data;
+    }
+    return atomic_load(&server->cells[cell].value);
+}
+
+static int sharded_close(struct sharded_worker *worker, struct sharded_client *client) {
+    struct sharded_server *server = worker->server;
+    int rv = 0;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1 ||
+        close(client->fd) == -1) {
+        rv = -1;
+    }
+    free(client);
+    pthread_mutex_lock(&server->lock);
+    ++server->closed;
+    pthread_cond_signal(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+    return rv;
+}
+
+/* Send the leftover from the last round plus ‹reply›; whatever does
+ * not fit is kept and we wait for ‹EPOLLOUT› before reading more.
+ * A client which hung up without reading its replies is only the end
+ * of that client, hence ‹EPIPE› and ‹ECONNRESET› return 1 (just like
+ * end of input in ‹sharded_serve›) instead of failing the server. */
+
+static int sharded_send(struct sharded_worker *worker, struct sharded_client *client,
+                        uint8_t *reply, size_t len) {
+    struct iovec iov[2] = {
+            { .iov_base = client->out, .iov_len = client->out_len },
+            { .iov_base = reply, .iov_len = len }
+    };
+    size_t total = client->out_len + len;
+    if (total == 0) {
+        return 0;
+    }
+    ssize_t nbytes = writev(client->fd, iov, 2);
+    if (nbytes == -1) {
+        if (errno == EPIPE || errno == ECONNRESET) {
+            return 1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        nbytes = 0;
+    }
+    size_t sent = nbytes;
+    if (sent < client->out_len) {
+        memmove(client->out, client->out + sent, client->out_len - sent);
+        client->out_len -= sent;
+        memcpy(client->out + client->out_len, reply, len);
+        client->out_len += len;
+    } else {
+        sent -= client->out_len;
+        client->out_len = len - sent;
+        memmove(client->out, reply + sent, client->out_len);
+    }
+
+    uint32_t events = client->out_len > 0 ? EPOLLOUT : EPOLLIN;
+    if (events == client->events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = client };
+    client->events = events;
+    return epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
 }
 
+/* Returns 1 once the client has hung up. */
+
+static int sharded_serve(struct sharded_worker *worker, struct sharded_client *client) {
+    uint8_t reply[SEND_SIZE * BATCH];
+    size_t reply_len = 0;
+
+    ssize_t nbytes = read(client->fd, client->in + client->in_len,
+                          sizeof client->in - client->in_len);
+    if (nbytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return errno == ECONNRESET ? 1 : -1;
+    }
+    if (nbytes == 0) {
+        return 1;
+    }
+    client->in_len += nbytes;
+
+    struct sharded_server *server = worker->server;
+    uint64_t ticket = 0;
+    size_t offset = 0;
+    for (; client->in_len - offset >= RECV_SIZE; offset += RECV_SIZE) {
+        uint32_t value = sharded_apply(server, client->in + offset, &ticket);
+        for (int i = 0; i < SEND_SIZE; ++i) {
+            reply[reply_len++] = value >> (24 - 8 * i);
+        }
+    }
+    client->in_len -= offset;
+    memmove(client->in, client->in + offset, client->in_len);
+    if (server->store && store_failed(server->store, ticket)) {
+        return -1;
+    }
+    return sharded_send(worker, client, reply, reply_len);
+}
+
+static void *sharded_worker(void *arg) {
+    struct sharded_worker *worker = arg;
+    struct sharded_server *server = worker->server;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            atomic_store(&server->error, 1);
+            return NULL;
+        }
+        for (int i = 0; i < ready; ++i) {
+            struct sharded_client *client = events[i].data.ptr;
+            if (!client) {
+                return NULL;
+            }
+            int rv = client->out_len > 0
+                     ? sharded_send(worker, client, NULL, 0)
+                     : sharded_serve(worker, client);
+            if (rv == -1) {
+                atomic_store(&server->error, 1);
+            }
+            if (rv != 0 && sharded_close(worker, client) == -1) {
+                atomic_store(&server->error, 1);
+            }
+        }
+    }
+}
+
+static int sharded_add(struct sharded_worker *worker, int fd) {
+    struct sharded_client *client = malloc(sizeof(struct sharded_client));
+    if (!client) {
+        return -1;
+    }
+    client->fd = fd;
+    client->events = EPOLLIN;
+    client->in_len = 0;
+    client->out_len = 0;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = client };
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        free(client);
+        return -1;
+    }
+    return 0;
+}
+
+static int online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        return 1;
+    }
+    return n > MAX_WORKERS ? MAX_WORKERS : (int) n;
+}
+
+static int sharded_run(int sock_fd, int count, struct sharded_server *srv) {
+    struct sharded_server server = *srv;
+    struct sharded_worker workers[MAX_WORKERS];
+    int nworkers = online_cpus();
+    int accepted = 0;
+    int rv = -1;
+
+    atomic_init(&server.error, 0);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.changed, NULL);
+    server.stop_fd = eventfd(0, 0);
+
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i].server = &server;
+        workers[i].started = false;
+        workers[i].epoll_fd = epoll_create1(0);
+    }
+    if (server.stop_fd == -1) {
+        goto out;
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (workers[i].epoll_fd == -1 ||
+            epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, server.stop_fd, &ev) == -1 ||
+            pthread_create(&workers[i].tid, NULL, sharded_worker, &workers[i]) != 0) {
+            goto out;
+        }
+        workers[i].started = true;
+    }
+
+    rv = 0;
+    for (; accepted < count; ++accepted) {
+        int fd = accept(sock_fd, NULL, NULL);
+        if (fd == -1) {
+            rv = -1;
+            break;
+        }
+        if (sharded_add(&workers[accepted % nworkers], fd) == -1) {
+            close(fd);
+            rv = -1;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&server.lock);
+    while (server.closed < accepted)
+        pthread_cond_wait(&server.changed, &server.lock);
+    pthread_mutex_unlock(&server.lock);
+
+out:
+    if (server.stop_fd != -1) {
+        const uint64_t one = 1;
+        if (write(server.stop_fd, &one, sizeof one) == -1) {
+            rv = -1;
+        }
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        if (workers[i].started && pthread_join(workers[i].tid, NULL) != 0) {
+            rv = -1;
+        }
+        if (workers[i].epoll_fd != -1 && close(workers[i].epoll_fd) == -1) {
+            rv = -1;
+        }
+    }
+    if (server.stop_fd != -1 && close(server.stop_fd) == -1) {
+        rv = -1;
+    }
+    if (atomic_load(&server.error)) {
+        rv = -1;
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.changed);
+    return rv;
+}
+
+int multi_server_sharded(int sock_fd, int count, const uint32_t *initial, int size) {
+    struct sharded_server server = { .size = size, .store = NULL };
+    if (posix_memalign((void **) &server.cells, CACHE_LINE,
+                       (size > 0 ? size : 1) * sizeof(struct sharded_cell)) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < size; ++i) {
+        atomic_init(&server.cells[i].value, initial[i]);
+    }
+    int rv = sharded_run(sock_fd, count, &server);
+    free(server.cells);
+    return rv;
+}
+
+/* Like ‹multi_server_sharded›, but the cells survive a restart: they
+ * live in the store at ‹path› and ‹initial› is only used if the store
+ * does not exist yet. A set is confirmed only once it is durable. */
+
+int multi_server_persistent(int sock_fd, int count, const char *path,
+                            const uint32_t *initial, int size) {
+    struct sharded_server server = { .size = size, .cells = NULL };
+    if (!(server.store = store_open(path, initial, size))) {
+        return -1;
+    }
+    int rv = sharded_run(sock_fd, count, &server);
+    if (store_close(server.store) == -1) {
+        rv = -1;
+    }
+    return rv;
+}
+
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <sys/wait.h>       /* waitpid */
 #include <signal.h>         /* signal, SIG_IGN, SIGPIPE */
+#include <math.h>           /* pow */
+#include <time.h>           /* clock_gettime */
 
 static void close_or_warn(int fd, const char *name) {
     if (close(fd) == -1)
@@ -212,7 +875,9 @@ static int reap(pid_t pid) {
         return -1;
 }
 
-static pid_t fork_server(int sock_fd, int clients,
+typedef int (*server_fn)(int, int, const uint32_t *, int);
+
+static pid_t fork_server(server_fn server, int sock_fd, int clients,
                          uint32_t *init, int size) {
     pid_t pid = fork();
 
@@ -221,7 +886,7 @@ static pid_t fork_server(int sock_fd, int clients,
 
     if (pid == 0) {
         alarm(3);
-        exit(multi_server(sock_fd, clients, init, size) ? 1 : 0);
+        exit(server(sock_fd, clients, init, size) ? 1 : 0);
     }
 
     close_or_warn(sock_fd, "server socket in client");
@@ -293,13 +958,7 @@ static int client_get(int fd, uint16_t idx) {
     return ntohl(reply);
 }
 
-int main(void) {
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-        err(2, "signal");
-
-    char buffer[4];
-    uint32_t init[2] = {33, 44};
-
+static int listen_at_test_addr(int backlog) {
     unlink_if_exists(test_addr.sun_path);
 
     int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -311,10 +970,19 @@ int main(void) {
              sizeof test_addr) == -1)
         err(2, "bind");
 
-    if (listen(sock_fd, 3) == -1)
+    if (listen(sock_fd, backlog) == -1)
         err(2, "listen");
 
-    pid_t pid = fork_server(sock_fd, 3, init, 2);
+    return sock_fd;
+}
+
+static void test_basic(server_fn server) {
+    char buffer[4];
+    uint32_t init[2] = {33, 44};
+
+    int sock_fd = listen_at_test_addr(3);
+
+    pid_t pid = fork_server(server, sock_fd, 3, init, 2);
 
     int c1 = client_connect();
     int c2 = client_connect();
@@ -353,5 +1021,243 @@ int main(void) {
     assert(reap(pid) == 0);
 
     unlink_if_exists(test_addr.sun_path);
+}
+
+#define CELLS        1024
+#define WRITERS      4
+#define OPERATIONS   2000
+
+/* Contention test: several clients (each in its own process) mix
+ * sets and gets on cells picked either uniformly or from a Zipf
+ * distribution, which piles most of the traffic onto a few hot
+ * cells. Every value written carries its cell index in the upper
+ * half, so a reply from the wrong cell is caught, and each set must
+ * be confirmed with the value that was sent. */
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void zipf_table(double *cdf, int n, double s) {
+    double total = 0;
+    for (int i = 0; i < n; ++i)
+        total += 1 / pow(i + 1, s);
+    double acc = 0;
+    for (int i = 0; i < n; ++i)
+        cdf[i] = (acc += 1 / pow(i + 1, s) / total);
+}
+
+static int pick_cell(const double *cdf, uint32_t *state) {
+    if (!cdf)
+        return next_random(state) % CELLS;
+
+    double u = (next_random(state) & 0xffffff) / (double) 0x1000000;
+    int lo = 0, hi = CELLS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void contention_client(const double *cdf, uint32_t seed) {
+    int fd = client_connect();
+    assert(fd != -1);
+
+    for (int i = 0; i < OPERATIONS; ++i) {
+        int cell = pick_cell(cdf, &seed);
+        if (next_random(&seed) % 4 == 0) {
+            uint32_t val = (uint32_t) cell << 16 | (next_random(&seed) & 0x7fff);
+            assert(client_set(fd, cell, val) == 0);
+        } else {
+            uint32_t val = client_get(fd, cell);
+            assert(val >> 16 == (uint32_t) cell);
+        }
+    }
+
+    close_or_warn(fd, "contention client");
+}
+
+/* Runs the contention test against ‹server› and returns the time it
+ * took all the clients to finish, in seconds. */
+
+static double test_contention(server_fn server, const double *cdf) {
+    uint32_t init[CELLS];
+    pid_t writers[WRITERS];
+    struct timespec start, end;
+
+    for (int i = 0; i < CELLS; ++i)
+        init[i] = (uint32_t) i << 16;
+
+    int sock_fd = listen_at_test_addr(WRITERS);
+    pid_t pid = fork_server(server, sock_fd, WRITERS, init, CELLS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < WRITERS; ++i) {
+        if ((writers[i] = fork()) == -1)
+            err(2, "fork");
+
+        if (writers[i] == 0) {
+            contention_client(cdf, 7 * i + 1);
+            exit(0);
+        }
+    }
+
+    for (int i = 0; i < WRITERS; ++i)
+        assert(reap(writers[i]) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(reap(pid) == 0);
+    unlink_if_exists(test_addr.sun_path);
+
+    return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* The sharded server with a fresh store, so that its sets are synced
+ * concurrently by several workers. */
+
+static int persistent_server(int sock_fd, int count,
+                             const uint32_t *initial, int size) {
+    unlink_if_exists("zt.p4_bench");
+    unlink_if_exists("zt.p4_bench.wal");
+    int rv = multi_server_persistent(sock_fd, count, "zt.p4_bench",
+                                     initial, size);
+    unlink_if_exists("zt.p4_bench");
+    unlink_if_exists("zt.p4_bench.wal");
+    return rv;
+}
+
+/* Compare the thread-per-client server with the sharded one (with
+ * and without a store), under both distributions. The times include
+ * the clients themselves and depend on the number of cores and on
+ * the disk, so they are only reported. */
+
+static void bench_contention(const double *zipf) {
+    const char *name[2] = { "uniform", "zipf" };
+    const double *cdf[2] = { NULL, zipf };
+
+    for (int i = 0; i < 2; ++i) {
+        double threads = test_contention(multi_server, cdf[i]);
+        double sharded = test_contention(multi_server_sharded, cdf[i]);
+        double persistent = test_contention(persistent_server, cdf[i]);
+        dprintf(2, "contention (%s): %.3f s thread per client, "
+                   "%.3f s sharded, %.3f s sharded with a store\n",
+                   name[i], threads, sharded, persistent);
+    }
+}
+
+/* A client which sends a batch of requests and hangs up without
+ * reading the replies must not take the server down with it. */
+
+static void test_hangup(server_fn server) {
+    uint8_t msgs[RECV_SIZE * BATCH] = { 0 };
+    uint32_t init[1] = { 5 };
+
+    int sock_fd = listen_at_test_addr(2);
+    pid_t pid = fork_server(server, sock_fd, 2, init, 1);
+
+    int c1 = client_connect();
+    assert(c1 != -1);
+    assert(send(c1, msgs, sizeof msgs, 0) == sizeof msgs);
+    close_or_warn(c1, "c1");
+
+    int c2 = client_connect();
+    assert(c2 != -1);
+    assert(client_set(c2, 0, 9) == 0);
+    assert(client_get(c2, 0) == 9);
+    close_or_warn(c2, "c2");
+
+    assert(reap(pid) == 0);
+    unlink_if_exists(test_addr.sun_path);
+}
+
+static pid_t fork_persistent(const char *path, int clients,
+                             uint32_t *init, int size) {
+    int sock_fd = listen_at_test_addr(clients);
+    pid_t pid = fork();
+
+    if (pid == -1)
+        err(2, "fork");
+
+    if (pid == 0) {
+        alarm(5);
+        exit(multi_server_persistent(sock_fd, clients, path, init, size) ? 1 : 0);
+    }
+
+    close_or_warn(sock_fd, "server socket in client");
+    return pid;
+}
+
+/* State survives a clean restart as well as a crash (which leaves
+ * the records since the last checkpoint in the log, and possibly a
+ * torn record at its end). */
+
+static void test_persistent(void) {
+    const char *path = "zt.p4_state";
+    uint32_t init[3] = {1, 2, 3}, other[3] = {7, 7, 7};
+    struct stat st;
+
+    unlink_if_exists(path);
+    unlink_if_exists("zt.p4_state.wal");
+
+    pid_t pid = fork_persistent(path, 1, init, 3);
+    int fd = client_connect();
+    assert(client_get(fd, 0) == 1);
+    assert(client_set(fd, 1, 20) == 0);
+    close_or_warn(fd, "client");
+    assert(reap(pid) == 0);
+
+    pid = fork_persistent(path, 1, other, 3);
+    fd = client_connect();
+    assert(client_get(fd, 0) == 1);
+    assert(client_get(fd, 1) == 20);
+    for (int i = 0; i < 5000; ++i)
+        assert(client_set(fd, 2, i) == 0);
+
+    if (kill(pid, SIGKILL) == -1)
+        err(2, "kill");
+    assert(reap(pid) == -1);
+    close_or_warn(fd, "client");
+
+    assert(stat("zt.p4_state.wal", &st) == 0);
+    assert(st.st_size == (5000 - 4096) * 12);
+
+    int log_fd = open("zt.p4_state.wal", O_WRONLY | O_APPEND);
+    assert(log_fd != -1);
+    assert(write(log_fd, "\1\2\3\4\5", 5) == 5);
+    close_or_warn(log_fd, "log");
+
+    pid = fork_persistent(path, 1, other, 3);
+    fd = client_connect();
+    assert(client_get(fd, 1) == 20);
+    assert(client_get(fd, 2) == 4999);
+    close_or_warn(fd, "client");
+    assert(reap(pid) == 0);
+
+    unlink_if_exists(path);
+    unlink_if_exists("zt.p4_state.wal");
+    unlink_if_exists(test_addr.sun_path);
+}
+
+int main(void) {
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        err(2, "signal");
+
+    static double zipf[CELLS];
+    zipf_table(zipf, CELLS, 1.1);
+
+    test_basic(multi_server);
+    test_basic(multi_server_sharded);
+
+    test_hangup(multi_server_sharded);
+    bench_contention(zipf);
+
+    test_persistent();
     return 0;
+
+    // cflags: -lm
 }
@@ -1,9 +1,12 @@
 #define _POSIX_C_SOURCE 200809L
 
-#include <unistd.h>     /* alarm */
+#include <unistd.h>     /* alarm, sysconf */
+#include <time.h>       /* nanosleep */
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
 
 /* Tématem této přípravy budou asynchronní výpočty – Vaším úkolem
  * bude naprogramovat pomocný podprogram ‹gather›, který obdrží:
@@ -18,51 +21,393 @@
  * uloží na odpovídající index pole ‹results›. Výsledkem bude 0
  * proběhne-li vše úspěšně, jinak -1. */
 
-struct handle {
+#define GATHER_CHUNK   64
+#define GATHER_THREADS 64
+#define CACHE_LINE     64
+
+/* Instead of a thread per input, the inputs are processed by a pool
+ * of long-lived workers. Each worker owns a deque of indices – since
+ * the work is a contiguous array, the deque is simply a half-open
+ * range ‹[lo, hi)›. The owner takes chunks from the front, an idle
+ * worker steals the back half of somebody else's range. A job is
+ * done once every worker has found nothing left to take or steal. */
+
+struct gather_deque {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    int lo, hi;
+};
+
+struct gather_pool {
+    int workers;
+    pthread_t *tids;
+    struct gather_deque *deques;
+
+    pthread_mutex_t run_lock;   /* serializes gather_pool_run callers */
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    unsigned generation;
+    int active;
+    bool shutdown;
+
     uint64_t (*func)(uint64_t);
+    uint64_t *inputs;
+    uint64_t *results;
+};
 
-    uint64_t input;
-    uint64_t *result;
+struct gather_worker {
+    struct gather_pool *pool;
+    int id;
 };
 
-void *thread_func(void *arg) {
-    struct handle *info = (struct handle *) arg;
-    *(info->result) = (info->func)(info->input);
-    return NULL;
+static bool take_own(struct gather_deque *deque, int *lo, int *hi) {
+    pthread_mutex_lock(&deque->lock);
+    int len = deque->hi - deque->lo;
+    int take = (len + 7) / 8;
+    if (take > GATHER_CHUNK)
+        take = GATHER_CHUNK;
+    *lo = deque->lo;
+    *hi = deque->lo += take;
+    pthread_mutex_unlock(&deque->lock);
+    return take > 0;
 }
 
-int gather(uint64_t ( *func )(uint64_t), uint64_t *inputs, uint64_t *results, int count) {
-    pthread_t threads[count];
-    struct handle handle[count];
-    for (int i = 0; i < count; ++i) {
-        handle[i].func = func;
-        handle[i].input = inputs[i];
-        handle[i].result = &results[i];
-        if (pthread_create(&threads[i], NULL, thread_func, &handle[i]) != 0) {
-            return -1;
+static bool steal(struct gather_pool *pool, int self) {
+    for (int i = 1; i < pool->workers; ++i) {
+        struct gather_deque *victim = &pool->deques[(self + i) % pool->workers];
+        int lo, hi;
+
+        pthread_mutex_lock(&victim->lock);
+        hi = victim->hi;
+        lo = victim->lo + (victim->hi - victim->lo) / 2;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (lo < hi) {
+            struct gather_deque *own = &pool->deques[self];
+            pthread_mutex_lock(&own->lock);
+            own->lo = lo;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_job(struct gather_pool *pool, int self) {
+    int lo, hi;
+    for (;;) {
+        if (take_own(&pool->deques[self], &lo, &hi)) {
+            for (int i = lo; i < hi; ++i)
+                pool->results[i] = pool->func(pool->inputs[i]);
+        } else if (!steal(pool, self)) {
+            return;
+        }
+    }
+}
+
+static void *gather_worker(void *arg) {
+    struct gather_worker *worker = arg;
+    struct gather_pool *pool = worker->pool;
+    int self = worker->id;
+    free(worker);
+
+    unsigned seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
         }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_job(pool, self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
     }
-    for (int i = 0; i < count; ++i) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            return -1;
+}
+
+static int online_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+void gather_pool_destroy(struct gather_pool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workers; ++i) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    for (int i = 0; i < pool->workers; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->deques);
+    free(pool->tids);
+    free(pool);
+}
+
+/* Create a pool of ‹workers› threads which can be reused by any
+ * number of ‹gather_pool_run› calls; ‹workers ≤ 0› means one per
+ * online CPU, which is the right choice for CPU-bound functions.
+ * Returns a null pointer on failure. */
+
+struct gather_pool *gather_pool_create(int workers) {
+    if (workers <= 0) {
+        workers = online_cpus();
+    }
+    struct gather_pool *pool = calloc(1, sizeof(struct gather_pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->tids = malloc(workers * sizeof(pthread_t));
+    if (!pool->tids ||
+        posix_memalign((void **) &pool->deques, CACHE_LINE,
+                       workers * sizeof(struct gather_deque)) != 0) {
+        free(pool->tids);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < workers; ++i) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].lo = pool->deques[i].hi = 0;
+    }
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (; pool->workers < workers; ++pool->workers) {
+        struct gather_worker *worker = malloc(sizeof(struct gather_worker));
+        if (!worker) {
+            break;
         }
+        worker->pool = pool;
+        worker->id = pool->workers;
+        if (pthread_create(&pool->tids[pool->workers], NULL, gather_worker, worker) != 0) {
+            free(worker);
+            break;
+        }
+    }
+    if (pool->workers < workers) {
+        gather_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* Run ‹func› on every input using the workers of ‹pool›; returns
+ * once all results are stored. The inputs are initially split into
+ * one contiguous range per worker, load imbalance is then evened out
+ * by stealing. */
+
+int gather_pool_run(struct gather_pool *pool, uint64_t ( *func )(uint64_t),
+                    uint64_t *inputs, uint64_t *results, int count) {
+    if (!pool || count < 0) {
+        return -1;
     }
+    if (count == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->inputs = inputs;
+    pool->results = results;
+    for (int i = 0; i < pool->workers; ++i) {
+        pool->deques[i].lo = (int) ((int64_t) count * i / pool->workers);
+        pool->deques[i].hi = (int) ((int64_t) count * (i + 1) / pool->workers);
+    }
+    pool->active = pool->workers;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->active > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
     return 0;
 }
 
+/* A one-shot pool: ‹func› may block (as ‹slowpoke› below does), so
+ * we still give every input its own worker for small counts, but
+ * never start more than ‹GATHER_THREADS› (or one per CPU, if there
+ * are more CPUs). */
+
+int gather(uint64_t ( *func )(uint64_t), uint64_t *inputs, uint64_t *results, int count) {
+    if (count <= 0) {
+        return count == 0 ? 0 : -1;
+    }
+    int workers = online_cpus();
+    if (workers < GATHER_THREADS) {
+        workers = GATHER_THREADS;
+    }
+    if (workers > count) {
+        workers = count;
+    }
+    struct gather_pool *pool = gather_pool_create(workers);
+    if (!pool) {
+        return -1;
+    }
+    int rv = gather_pool_run(pool, func, inputs, results, count);
+    gather_pool_destroy(pool);
+    return rv;
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
+#include <stdio.h>      /* dprintf */
+#include <time.h>       /* clock_gettime */
+
 uint64_t slowpoke(uint64_t val) {
     sleep(5);
     return val * 13;
 }
 
+uint64_t square(uint64_t val) {
+    return val * val;
+}
+
+uint64_t nap(uint64_t val) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000 * 1000 };
+    nanosleep(&ts, NULL);
+    return val + 1;
+}
+
+#define MANY 100000
+
+static void check_many(struct gather_pool *pool, uint64_t *inputs,
+                       uint64_t *results) {
+    for (int i = 0; i < MANY; ++i) {
+        inputs[i] = i;
+        results[i] = 0;
+    }
+
+    if (pool)
+        assert(gather_pool_run(pool, square, inputs, results, MANY) == 0);
+    else
+        assert(gather(square, inputs, results, MANY) == 0);
+
+    for (int i = 0; i < MANY; ++i)
+        assert(results[i] == (uint64_t) i * i);
+}
+
+/* The original ‹gather›, with a thread per input, for comparison. */
+
+struct handle {
+    uint64_t (*func)(uint64_t);
+    uint64_t input;
+    uint64_t *result;
+};
+
+static void *thread_func(void *arg) {
+    struct handle *info = arg;
+    *info->result = info->func(info->input);
+    return NULL;
+}
+
+static int gather_threads(uint64_t (*func)(uint64_t), uint64_t *inputs,
+                          uint64_t *results, int count) {
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    struct handle *handles = malloc(count * sizeof(struct handle));
+    int started = 0, rv = threads && handles ? 0 : -1;
+
+    for (; rv == 0 && started < count; ++started) {
+        handles[started] = (struct handle) { func, inputs[started],
+                                             &results[started] };
+        if (pthread_create(&threads[started], NULL, thread_func,
+                           &handles[started]) != 0) {
+            rv = -1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; ++i)
+        if (pthread_join(threads[i], NULL) != 0)
+            rv = -1;
+
+    free(threads);
+    free(handles);
+    return rv;
+}
+
+enum { BY_THREADS, BY_GATHER, BY_POOL };
+
+static double timed(int how, struct gather_pool *pool,
+                    uint64_t (*func)(uint64_t), uint64_t *inputs,
+                    uint64_t *results, int count) {
+    struct timespec start, end;
+    int rv;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (how == BY_THREADS)
+        rv = gather_threads(func, inputs, results, count);
+    else if (how == BY_GATHER)
+        rv = gather(func, inputs, results, count);
+    else
+        rv = gather_pool_run(pool, func, inputs, results, count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(rv == 0);
+    return (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/* Tiny CPU-bound functions are dominated by the cost of starting
+ * threads; short blocking ones by how many of them can wait at once. */
+
+static void bench_gather(struct gather_pool *pool, const char *name,
+                         uint64_t (*func)(uint64_t), uint64_t *inputs,
+                         uint64_t *results, int count) {
+    double threads = timed(BY_THREADS, pool, func, inputs, results, count);
+    double once = timed(BY_GATHER, pool, func, inputs, results, count);
+    double reused = timed(BY_POOL, pool, func, inputs, results, count);
+
+    dprintf(2, "gather %s × %d: %.1f ms thread per input, "
+               "%.1f ms one-shot pool, %.1f ms reused pool\n",
+               name, count, threads, once, reused);
+}
+
 int main(void) {
     alarm(7);
 
+    static uint64_t many_in[MANY], many_out[MANY];
+
+    /* tiny CPU-bound functions: one pool reused across calls */
+    struct gather_pool *pool = gather_pool_create(0);
+    assert(pool);
+    check_many(pool, many_in, many_out);
+    check_many(pool, many_in, many_out);
+    check_many(NULL, many_in, many_out);
+
+    /* short blocking functions, far more of them than workers */
+    assert(gather_pool_run(pool, nap, many_in, many_out, 256) == 0);
+    for (int i = 0; i < 256; ++i)
+        assert(many_out[i] == (uint64_t) i + 1);
+
+    assert(gather_pool_run(pool, square, many_in, many_out, 0) == 0);
+
+    bench_gather(pool, "square", square, many_in, many_out, 1024);
+    bench_gather(pool, "nap", nap, many_in, many_out, 256);
+    gather_pool_destroy(pool);
+
     uint64_t inputs[8] = {1, 2, 3, 4, 5, 6, 7, 8},
             results[8];
 
+    alarm(7);
     assert(gather(slowpoke, inputs, results, 8) == 0);
 
     for (int i = 1; i <= 8; ++i)
@@ -7,6 +7,8 @@
 #include <stdlib.h>     /* free */
 #include <string.h>     /* strlen, memcmp */
 #include <stdbool.h>
+#include <limits.h>     /* INT_MAX */
+#include <sys/types.h>  /* off_t */
 
 /* Napište podprogram ‹read_trunc›, který přečte ze vstupu jeden
  * záznam (každý záznam je ukončen bajtem ‹delim›), až do maximální
@@ -28,105 +30,105 @@
 /* Strukturu ‹trunc_buffer› si můžete navrhnout dle vlastního
  * uvážení. Nesmí ale překročit velikost 512 bajtů. */
 
-#define BUF_SIZE 256
+/* The buffer is filled by whole reads and consumed from ‹start›
+ * to ‹end› – nothing is ever moved within it: a record is copied
+ * straight into ‹out› (in pieces, if it continues past the buffered
+ * data) and delimiters are found with ‹memchr›. Once ‹size› bytes are
+ * stored, the rest of a long record only needs to be skipped: from a
+ * seekable descriptor, that is done with large ‹pread›s into a
+ * temporary buffer and an ‹lseek› just past the delimiter, otherwise
+ * in reads of the (small) buffer in the structure. */
+
+#define SKIP_BLOCK ( 64 * 1024 )
+
 struct trunc_buffer {
-    char data[BUF_SIZE];
-    int length;
+    int start, end;
+    char data[512 - 2 * sizeof(int)];
 };
 
-//bool realloc_double(struct trunc_buffer *buf) {
-//    buf->capacity *= 2;
-//    char *tmp = realloc(buf->data, buf->capacity * sizeof(char));
-//    if (!tmp) {
-//        return false;
-//    }
-//    buf->data = tmp;
-//    return true;
-//}
-
-//struct trunc_buffer {
-//    char *memory;
-//    int allocd;
-//    int used;
-//};
-
-//int read_trunc(int fd, char delim, int size, char *out, struct trunc_buffer *buffer) {
-//    int totalBytesRead = 0;
-//    if (buffer->length > 0) {
-//        int copyLength = buffer->length;
-//        if (copyLength > size) {
-//            copyLength = size;
-//        }
-//
-//        memcpy(&out[totalBytesRead], buffer->data, copyLength);
-//        totalBytesRead += copyLength;
-//
-//        // Update the buffer
-//        buffer->length -= copyLength;
-//        memmove(buffer->data, &buffer->data[copyLength], buffer->length);
-//    }
-//
-//    while (totalBytesRead < size) {
-//        int bytesRead = read(fd, &out[totalBytesRead], size - totalBytesRead);
-//
-//        if (bytesRead == -1) {
-//            return -1; // Error reading from the file descriptor
-//        } else if (bytesRead == 0) {
-//            break; // End of file
-//        }
-//
-//        // Update totalBytesRead
-//        totalBytesRead += bytesRead;
-//
-//        // Check for delimiter in the newly read data
-//        for (int i = 0; i < bytesRead; ++i) {
-//            if (out[i] == delim) {
-//                // Save the remaining data after the delimiter in the buffer
-//                buffer->length = bytesRead - (i + 1);
-//                for (int j = 0; j < buffer->length; ++j) {
-//                    buffer->data[j] = out[i + 1 + j];
-//                }
-//                totalBytesRead = i + 1;
-//                break;
-//            }
-//        }
-//    }
-//
-//    return totalBytesRead;
-//}
+/* Skip to just past the next delimiter, starting at the current
+ * offset of ‹fd›, adding the bytes skipped to ‹*total›. Returns 1 if
+ * done (at the delimiter or at the end of file), 0 if ‹fd› cannot
+ * seek, -1 on error. */
+static int skip_seekable(int fd, char delim, long *total) {
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) {
+        return errno == ESPIPE ? 0 : -1;
+    }
+
+    char *block = malloc(SKIP_BLOCK);
+    ssize_t got;
+    int rv = -1;
+    if (!block) {
+        return -1;
+    }
+
+    while ((got = pread(fd, block, SKIP_BLOCK, offset)) > 0) {
+        char *found = memchr(block, delim, got);
+        if (found) {
+            got = found - block + 1;
+        }
+        offset += got;
+        *total += got;
+        if (found) {
+            break;
+        }
+    }
+    if (got != -1 && lseek(fd, offset, SEEK_SET) != -1) {
+        rv = 1;
+    }
+    free(block);
+    return rv;
+}
 
 int read_trunc(int fd, char delim, int size, char *out,
                struct trunc_buffer *buffer) {
+    long total = 0;
+    int stored = 0;
 
-    if (buffer->length == 0) {
-        buffer->length = read(fd, buffer->data, BUF_SIZE);
-        if (buffer->length == -1 || buffer->length == 0) {
-            return buffer->length;
+    for (;;) {
+        if (buffer->start == buffer->end) {
+            if (stored == size && total > 0) {
+                int skipped = skip_seekable(fd, delim, &total);
+                if (skipped == -1) {
+                    return -1;
+                }
+                if (skipped == 1) {
+                    break;
+                }
+            }
+
+            ssize_t got = read(fd, buffer->data, sizeof buffer->data);
+            if (got == -1) {
+                return -1;
+            }
+            buffer->start = 0;
+            buffer->end = got;
+            if (got == 0) {
+                break;
+            }
+        }
+
+        char *from = buffer->data + buffer->start;
+        char *found = memchr(from, delim, buffer->end - buffer->start);
+        int len = found ? found - from + 1 : buffer->end - buffer->start;
+        int copy = len < size - stored ? len : size - stored;
+
+        memcpy(out + stored, from, copy);
+        stored += copy;
+        total += len;
+        buffer->start += len;
+        if (found) {
+            break;
         }
     }
-    char *delim_p = strchr(buffer->data, delim);
-    if (delim_p && delim_p - buffer->data + 1 <= size) {
-        int transfered = delim_p - buffer->data + 1;
-        memcpy(out, buffer->data, transfered);
-        memmove(buffer->data, delim_p + 1, BUF_SIZE - transfered);
-        buffer->length -= transfered;
-        return transfered;
-    } else if (delim_p) {
-        int transfered = delim_p - buffer->data + 1;
-        memcpy(out, buffer->data, size);
-        memmove(buffer->data, delim_p + 1, BUF_SIZE - transfered);
-        buffer->length -= transfered;
-        return transfered;
-    } else {
-        buffer->length = 0;
-        memcpy(out, buffer->data, buffer->length <= size ? buffer->length : size);
-        return buffer->length;
-    }
+    return total > INT_MAX ? INT_MAX : total;
 }
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <fcntl.h>      /* openat */
+#include <sys/wait.h>   /* waitpid */
 
 static void close_or_warn(int fd, const char *name) {
     if (close(fd) == -1)
@@ -159,6 +161,83 @@ static int create_file(const char *data) {
     return fd;
 }
 
+/* Long records (longer than the buffer, and than a skip block),
+ * short ones, and a last one without a delimiter. */
+
+static const int long_sizes[] = { 100000, 3, 700, 0, 65536, 2 };
+#define LONG_COUNT 6
+
+static char *long_records(void) {
+    size_t total = 1;
+    for (int i = 0; i < LONG_COUNT; ++i)
+        total += long_sizes[i] + 1;
+
+    char *data = malloc(total + 3), *at = data;
+    if (!data)
+        err(2, "malloc");
+
+    for (int i = 0; i < LONG_COUNT; ++i) {
+        for (int j = 0; j < long_sizes[i]; ++j)
+            *at++ = 'a' + (i + j) % 26;
+        *at++ = '\n';
+    }
+    strcpy(at, "end");
+    return data;
+}
+
+static void check_long(int fd) {
+    struct trunc_buffer *tbuf = calloc(1, 512);
+    char rbuf[1000];
+
+    for (int i = 0; i < LONG_COUNT; ++i) {
+        int size = i % 2 ? 1000 : 10;
+        int expect = long_sizes[i] < size ? long_sizes[i] : size;
+
+        assert(read_trunc(fd, '\n', size, rbuf, tbuf) == long_sizes[i] + 1);
+        for (int j = 0; j < expect; ++j)
+            assert(rbuf[j] == 'a' + (i + j) % 26);
+        if (long_sizes[i] < size)
+            assert(rbuf[long_sizes[i]] == '\n');
+    }
+
+    assert(read_trunc(fd, '\n', 2, rbuf, tbuf) == 3);
+    assert(memcmp(rbuf, "en", 2) == 0);
+    assert(read_trunc(fd, '\n', 2, rbuf, tbuf) == 0);
+    free(tbuf);
+}
+
+static void test_long(void) {
+    char *data = long_records();
+    int fd = create_file(data);
+
+    check_long(fd);
+    close_or_warn(fd, "zt.r3_split.txt");
+
+    int fds[2];
+    if (pipe(fds) == -1)
+        err(2, "pipe");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        err(2, "fork");
+
+    if (pid == 0) {
+        close_or_warn(fds[0], "reader end of a pipe");
+        if (write(fds[1], data, strlen(data)) != (ssize_t) strlen(data))
+            err(2, "writing into a pipe");
+        exit(0);
+    }
+
+    close_or_warn(fds[1], "writer end of a pipe");
+    check_long(fds[0]);
+    close_or_warn(fds[0], "reader end of a pipe");
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    free(data);
+}
+
 int main() {
     int fd;
 
@@ -177,5 +256,7 @@ int main() {
 
     free(tbuf);
     close(fd);
+
+    test_long();
     return 0;
 }
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         /* DT_* */
 
 #include <unistd.h>     /* read, write, unlinkat, … */
 #include <fcntl.h>      /* openat, O_* */
@@ -9,6 +10,9 @@
 #include <err.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdlib.h>     /* malloc, realloc, free */
+#include <stdatomic.h>
+#include <pthread.h>
 #include <stdio.h>
 
 /* Naprogramujte proceduru ‹find›, která obdrží:
@@ -33,55 +37,316 @@ bool ends_with(const char *str, const char *suffix) {
     return strcmp(str + (str_len - suffix_len), suffix) == 0;
 }
 
-int count_suffix_rec(int root_fd, int *count, const char *suffix) {
-    if (root_fd == -1)
-        return -1;
+#define WALK_MAX_WORKERS 16
+#define WALK_FD_BUDGET   64     /* open directory descriptors, in total */
+
+/* Counting names needs no visitor and no ‹fstatat› (except on file
+ * systems which do not report entry types), so the walker does the
+ * matching itself, from several threads at once. Each worker has a
+ * deque of directories still to be read; it works depth-first at one
+ * end and idle workers steal from the other. Directories in a deque
+ * keep their descriptor only while fewer than ‹WALK_FD_BUDGET› are
+ * open and are otherwise reopened by path. ‹walk_tree› returns the
+ * number of entries (other than ‹.› and ‹..›) whose name ends with
+ * ‹suffix›, or -1 on a system error. */
+
+struct walk_item {
+    int fd;                     /* -1 if it has to be reopened */
+    char *path;                 /* relative to the root */
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    int head, tail, cap;
+};
+
+struct walk {
+    int root_fd;
+    const char *suffix;
+    atomic_int count;
+    int nworkers;
+    struct walk_deque deques[WALK_MAX_WORKERS];
+
+    atomic_int pending;         /* queued or being processed */
+    atomic_int queued;
+    atomic_int idle;
+    atomic_int fds;
+    atomic_int rv;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct walk_worker {
+    struct walk *walk;
+    int id;
+    pthread_t tid;
+};
+
+static void walk_wake(struct walk *w, bool all) {
+    if (atomic_load(&w->idle) > 0 || all) {
+        pthread_mutex_lock(&w->lock);
+        if (all) {
+            pthread_cond_broadcast(&w->wake);
+        } else {
+            pthread_cond_signal(&w->wake);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static int walk_push(struct walk *w, int id, struct walk_item item) {
+    struct walk_deque *d = &w->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        int live = d->tail - d->head;
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    live * sizeof(struct walk_item));
+        }
+        if (live == d->cap) {
+            int cap = d->cap ? 2 * d->cap : 64;
+            struct walk_item *items = realloc(d->items,
+                                              cap * sizeof(struct walk_item));
+            if (!items) {
+                pthread_mutex_unlock(&d->lock);
+                return -1;
+            }
+            d->items = items;
+            d->cap = cap;
+        }
+        d->head = 0;
+        d->tail = live;
+    }
+    d->items[d->tail++] = item;
+    atomic_fetch_add(&w->pending, 1);
+    atomic_fetch_add(&w->queued, 1);
+    pthread_mutex_unlock(&d->lock);
+    walk_wake(w, false);
+    return 0;
+}
+
+static bool walk_take(struct walk *w, int id, bool steal,
+                      struct walk_item *item) {
+    struct walk_deque *d = &w->deques[id];
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *item = steal ? d->items[d->head++] : d->items[--d->tail];
+        atomic_fetch_sub(&w->queued, 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static char *walk_join(const char *dir, const char *name) {
+    size_t dlen = strlen(dir);
+    char *path = malloc(dlen + strlen(name) + 2);
+    if (path) {
+        memcpy(path, dir, dlen);
+        path[dlen] = '/';
+        strcpy(path + dlen + 1, name);
+    }
+    return path;
+}
+
+static void walk_fail(struct walk *w, int rv) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&w->rv, &expected, rv);
+}
 
-    DIR *dir = fdopendir(root_fd);
+static int walk_dir(struct walk *w, int id, struct walk_item *item) {
+    int fd = item->fd;
+    if (fd == -1) {
+        fd = openat(w->root_fd, item->path, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            return -1;
+        }
+        atomic_fetch_add(&w->fds, 1);
+    }
+    DIR *dir = fdopendir(fd);
     if (!dir) {
-        close(root_fd);
+        close(fd);
+        atomic_fetch_sub(&w->fds, 1);
         return -1;
     }
 
-    int rv = -1;
+    /* the root descriptor is shared with the caller (through ‹dup›),
+     * so its position is not necessarily at the start */
     rewinddir(dir);
-    struct dirent *ptr;
+
+    int rv = 0;
+    struct dirent *ent;
     struct stat st;
-    while ((ptr = readdir(dir))) {
-        if (strcmp(ptr->d_name, ".") == 0 ||
-            strcmp(ptr->d_name, "..") == 0)
+    while (rv == 0 && atomic_load(&w->rv) == 0 &&
+           (errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+            strcmp(ent->d_name, "..") == 0) {
             continue;
+        }
+        if (ends_with(ent->d_name, w->suffix)) {
+            atomic_fetch_add(&w->count, 1);
+        }
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                rv = -1;
+                break;
+            }
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) {
+            continue;
+        }
+
+        struct walk_item sub = { .fd = -1 };
+        if (!(sub.path = walk_join(item->path, ent->d_name))) {
+            rv = -1;
+            break;
+        }
+        if (atomic_fetch_add(&w->fds, 1) < WALK_FD_BUDGET) {
+            sub.fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY);
+        }
+        if (sub.fd == -1) {
+            atomic_fetch_sub(&w->fds, 1);
+        }
+        if (walk_push(w, id, sub) == -1) {
+            if (sub.fd != -1) {
+                close(sub.fd);
+                atomic_fetch_sub(&w->fds, 1);
+            }
+            free(sub.path);
+            rv = -1;
+        }
+    }
+    if (rv == 0 && errno != 0) {
+        rv = -1;
+    }
+    closedir(dir);
+    atomic_fetch_sub(&w->fds, 1);
+    return rv;
+}
 
-        if (fstatat(root_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1)
-            goto out;
-
-        if (ends_with(ptr->d_name, suffix)) ++*count;
+static void walk_done(struct walk *w, struct walk_item *item) {
+    free(item->path);
+    if (atomic_fetch_sub(&w->pending, 1) == 1) {
+        walk_wake(w, true);
+    }
+}
 
-        if (!S_ISDIR(st.st_mode))
+static void *walk_worker(void *arg) {
+    struct walk_worker *worker = arg;
+    struct walk *w = worker->walk;
+    struct walk_item item;
+
+    for (;;) {
+        bool found = walk_take(w, worker->id, false, &item);
+        for (int i = 1; !found && i < w->nworkers; ++i) {
+            found = walk_take(w, (worker->id + i) % w->nworkers, true, &item);
+        }
+        if (found) {
+            if (atomic_load(&w->rv) != 0) {
+                if (item.fd != -1) {
+                    close(item.fd);
+                    atomic_fetch_sub(&w->fds, 1);
+                }
+            } else {
+                int rv = walk_dir(w, worker->id, &item);
+                if (rv != 0) {
+                    walk_fail(w, rv);
+                }
+            }
+            walk_done(w, &item);
             continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        atomic_fetch_add(&w->idle, 1);
+        while (atomic_load(&w->queued) == 0 && atomic_load(&w->pending) > 0) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        atomic_fetch_sub(&w->idle, 1);
+        bool finished = atomic_load(&w->pending) == 0;
+        pthread_mutex_unlock(&w->lock);
+        if (finished) {
+            return NULL;
+        }
+    }
+}
 
-        int sub_fd = openat(root_fd, ptr->d_name,
-                            O_DIRECTORY | O_RDONLY);
+static int walk_tree(int root_fd, const char *suffix) {
+    struct walk w = { .root_fd = root_fd, .suffix = suffix };
+    struct walk_worker workers[WALK_MAX_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-        if (count_suffix_rec(sub_fd, count, suffix) == -1)
-            goto out;
+    /* directory reads mostly wait for I/O, so use more threads than CPUs */
+    w.nworkers = cpus > 0 ? 2 * (int) cpus : 2;
+    if (w.nworkers > WALK_MAX_WORKERS) {
+        w.nworkers = WALK_MAX_WORKERS;
+    }
+    atomic_init(&w.pending, 0);
+    atomic_init(&w.queued, 0);
+    atomic_init(&w.idle, 0);
+    atomic_init(&w.fds, 0);
+    atomic_init(&w.rv, 0);
+    atomic_init(&w.count, 0);
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.wake, NULL);
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+        w.deques[i].items = NULL;
+        w.deques[i].head = w.deques[i].tail = w.deques[i].cap = 0;
     }
 
-    rv = 0;
-    out:
-    closedir(dir);
+    struct walk_item root = { .fd = dup(root_fd), .path = malloc(2) };
+    if (root.fd == -1 || !root.path) {
+        if (root.fd != -1) {
+            close(root.fd);
+        }
+        free(root.path);
+        walk_fail(&w, -1);
+    } else {
+        strcpy(root.path, ".");
+        atomic_fetch_add(&w.fds, 1);
+        if (walk_push(&w, 0, root) == -1) {
+            close(root.fd);
+            free(root.path);
+            walk_fail(&w, -1);
+        }
+    }
 
-    return rv;
+    int started = 0;
+    for (; atomic_load(&w.rv) == 0 && started < w.nworkers; ++started) {
+        workers[started].walk = &w;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].tid, NULL,
+                           walk_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started == 0 && atomic_load(&w.pending) > 0) {
+        /* could not start any thread, walk on our own */
+        workers[0].walk = &w;
+        workers[0].id = 0;
+        w.nworkers = 1;
+        walk_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    for (int i = 0; i < w.nworkers; ++i) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].items);
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.wake);
+    return atomic_load(&w.rv) ? -1 : atomic_load(&w.count);
 }
 
 int count_suffix(int root_fd, const char *suffix) {
-    int count = 0;
-
-    if (count_suffix_rec(dup(root_fd), &count, suffix) == -1)
-        return -1;
-
-    return count;
+    return walk_tree(root_fd, suffix);
 }
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
@@ -147,6 +412,21 @@ int main() {
     assert(count_suffix(work_fd, "txt") == 1);
     assert(count_suffix(work_fd, "csv") == 3);
 
+    /* more directories than the walker keeps open at once */
+    char name[16];
+    int wide_fd = mkdir_or_die(work_fd, "wide");
+    for (int i = 0; i < 200; ++i) {
+        snprintf(name, sizeof name, "d%d", i);
+        int fd = mkdir_or_die(wide_fd, name);
+        write_file(fd, "data.csv", "");
+        close_or_warn(fd, name);
+    }
+    assert(count_suffix(work_fd, "txt") == 1);
+    assert(count_suffix(work_fd, "csv") == 203);
+    assert(count_suffix(wide_fd, "csv") == 200);
+    assert(count_suffix(-1, "csv") == -1);
+    close_or_warn(wide_fd, "zt.p5_root/wide");
+
     close_or_warn(subd_fd, "zt.p5_root/subdir");
     close_or_warn(work_fd, "zt.p5_root");
 
@@ -1,9 +1,17 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE     /* copy_file_range */
 
 #include <unistd.h>     /* read, write, unlinkat, … */
 #include <fcntl.h>      /* openat, O_* */
 #include <sys/stat.h>   /* fstat, struct stat */
 #include <string.h>     /* memcmp, strlen */
+#include <dirent.h>     /* DIR, fdopendir, readdir, … */
+#include <stdlib.h>     /* calloc, realloc, free */
+#include <stdio.h>      /* snprintf */
+#include <stdint.h>     /* uint64_t */
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <errno.h>
 #include <err.h>
 #include <assert.h>
@@ -50,6 +58,474 @@ int dup_links( int root_fd );
  *   podprogramu vrátit nastavení pracovní složky do původního
  *   stavu. */
 
+/* An open-addressing hash set of (dev, ino) pairs. The table has
+ * a power-of-two size, is kept at most half full and uses linear
+ * probing, so a lookup usually touches a single cache line. A slot
+ * with both fields zero is free; the (0, 0) pair itself, should it
+ * ever come up, is remembered in ‹has_zero› instead. An all-zero
+ * ‹struct inode_set› is a valid empty set. */
+
+struct inode_key
+{
+    dev_t dev;
+    ino_t ino;
+};
+
+struct inode_set
+{
+    struct inode_key *slots;
+    size_t count, capacity;
+    bool has_zero;
+};
+
+static size_t inode_hash( dev_t dev, ino_t ino )
+{
+    uint64_t d = ( uint64_t ) dev;
+    uint64_t x = ( uint64_t ) ino ^ ( d << 32 | d >> 32 );
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static struct inode_key *inode_slot( struct inode_key *slots, size_t capacity,
+                                     dev_t dev, ino_t ino )
+{
+    size_t i = inode_hash( dev, ino ) & ( capacity - 1 );
+    while ( ( slots[ i ].dev != 0 || slots[ i ].ino != 0 ) &&
+            ( slots[ i ].dev != dev || slots[ i ].ino != ino ) )
+        i = ( i + 1 ) & ( capacity - 1 );
+    return &slots[ i ];
+}
+
+static bool inode_set_grow( struct inode_set *set )
+{
+    size_t capacity = set->capacity ? 2 * set->capacity : 64;
+    struct inode_key *slots = calloc( capacity, sizeof( struct inode_key ) );
+    if ( !slots )
+        return false;
+    for ( size_t i = 0; i < set->capacity; ++i )
+    {
+        struct inode_key *key = &set->slots[ i ];
+        if ( key->dev != 0 || key->ino != 0 )
+            *inode_slot( slots, capacity, key->dev, key->ino ) = *key;
+    }
+    free( set->slots );
+    set->slots = slots;
+    set->capacity = capacity;
+    return true;
+}
+
+/* Returns 1 if the pair was added, 0 if it was already present and
+ * -1 if memory could not be allocated. */
+int inode_set_add( struct inode_set *set, dev_t dev, ino_t ino )
+{
+    if ( dev == 0 && ino == 0 )
+    {
+        if ( set->has_zero )
+            return 0;
+        set->has_zero = true;
+        ++set->count;
+        return 1;
+    }
+    if ( 2 * ( set->count + 1 ) > set->capacity && !inode_set_grow( set ) )
+        return -1;
+    struct inode_key *slot = inode_slot( set->slots, set->capacity, dev, ino );
+    if ( slot->ino == ino && slot->dev == dev )
+        return 0;
+    slot->dev = dev;
+    slot->ino = ino;
+    ++set->count;
+    return 1;
+}
+
+void inode_set_free( struct inode_set *set )
+{
+    free( set->slots );
+    set->slots = NULL;
+    set->count = set->capacity = 0;
+    set->has_zero = false;
+}
+
+/* The first link found to a multiply-linked i-node is kept as it
+ * is, and its (dev, ino) pair goes into a hash set. Every further
+ * link to the same i-node is replaced by a copy: the content is
+ * written to a new temporary file in the same directory, which is
+ * then renamed over the link. The rename is atomic, so the tree is
+ * consistent after each step; if anything fails before it, removing
+ * the temporary file is enough (and if even that fails, the result
+ * is -2). Instead of ‹fchdir› and ‹mkstemp›, the temporary file is
+ * created with ‹openat› and ‹O_EXCL›, which does not touch the
+ * working directory of the process. */
+
+/* Copy the rest of ‹src_fd› into ‹dst_fd›. As long as it works,
+ * ‹copy_file_range› is used: the data then does not pass through
+ * user space at all, and file systems which support it (Btrfs, XFS,
+ * NFS, …) share the extents instead of copying them. If the file
+ * system cannot do that (e.g. ‹EXDEV› on older kernels, or
+ * ‹EOPNOTSUPP›), the rest is copied with ‹read› and ‹write›; so is
+ * anything beyond ‹size› should the file have grown meanwhile. */
+
+static int dup_copy( int src_fd, int dst_fd, off_t size )
+{
+    char buffer[ 65536 ];
+    ssize_t nread;
+
+    while ( size > 0 )
+    {
+        ssize_t copied = copy_file_range( src_fd, NULL, dst_fd, NULL,
+                                          size, 0 );
+        if ( copied == -1 && ( errno == EXDEV || errno == ENOSYS ||
+                               errno == EINVAL || errno == EOPNOTSUPP ) )
+            break;
+        if ( copied == -1 )
+            return -1;
+        if ( copied == 0 )
+            break;
+        size -= copied;
+    }
+
+    while ( ( nread = read( src_fd, buffer, sizeof buffer ) ) > 0 )
+        for ( ssize_t done = 0, nwritten; done < nread; done += nwritten )
+            if ( ( nwritten = write( dst_fd, buffer + done,
+                                     nread - done ) ) == -1 )
+                return -1;
+
+    return nread == 0 ? 0 : -1;
+}
+
+/* Create a new file with an unused name (stored into ‹name›) in
+ * ‹dir_fd›; returns its descriptor or -1. */
+
+static int dup_temp( int dir_fd, char *name, size_t size, mode_t mode )
+{
+    static atomic_uint counter;
+
+    for ( int attempt = 0; attempt < 100; ++attempt )
+    {
+        snprintf( name, size, ".dup_links.%d.%u", getpid(),
+                  atomic_fetch_add( &counter, 1 ) );
+        int fd = openat( dir_fd, name, O_CREAT | O_EXCL | O_WRONLY, mode );
+
+        if ( fd != -1 || errno != EEXIST )
+            return fd;
+    }
+
+    return -1;
+}
+
+static int dup_split( int dir_fd, const char *name, const struct stat *st )
+{
+    char temp[ 64 ];
+    int rv = -1;
+    int src_fd = openat( dir_fd, name, O_RDONLY );
+
+    if ( src_fd == -1 )
+        return -1;
+
+    int dst_fd = dup_temp( dir_fd, temp, sizeof temp, st->st_mode & 07777 );
+
+    if ( dst_fd == -1 )
+        goto out;
+
+    bool copied = fchmod( dst_fd, st->st_mode & 07777 ) == 0 &&
+                  dup_copy( src_fd, dst_fd, st->st_size ) == 0;
+
+    if ( close( dst_fd ) == -1 )
+        copied = false;
+
+    if ( copied && renameat( dir_fd, temp, dir_fd, name ) == 0 )
+        rv = 0;
+    else if ( unlinkat( dir_fd, temp, 0 ) == -1 )
+        rv = -2;
+out:
+    close( src_fd );
+    return rv;
+}
+
+/* The splits themselves are independent of each other – each of them
+ * only reads its source and replaces one link – so they are handed
+ * over to a pool of ‹DUP_WORKERS› threads, while the tree is still
+ * being walked. Each job keeps its directory open through a shared,
+ * reference-counted descriptor; since the queue is bounded, so is the
+ * number of open directories. The first failure stops the walk (no
+ * more jobs are queued), the jobs already queued are dropped, and the
+ * worst result is reported once all workers finish. */
+
+#define DUP_WORKERS 8
+#define DUP_QUEUE   64
+
+struct dup_dir
+{
+    int fd;
+    atomic_int refs;
+};
+
+struct dup_job
+{
+    struct dup_dir *dir;
+    char *name;
+    struct stat st;
+};
+
+struct dup_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct dup_job jobs[ DUP_QUEUE ];
+    int head, count;
+    bool closed;
+
+    atomic_int created;
+    atomic_int rv;              /* 0, -1 or -2 */
+    pthread_t threads[ DUP_WORKERS ];
+    int nthreads;
+};
+
+static void dup_dir_put( struct dup_dir *dir )
+{
+    if ( atomic_fetch_sub( &dir->refs, 1 ) == 1 )
+    {
+        close( dir->fd );
+        free( dir );
+    }
+}
+
+static void dup_fail( struct dup_pool *pool, int rv )
+{
+    int seen = atomic_load( &pool->rv );
+
+    /* keep the worst result: -2 beats -1 beats 0 */
+    while ( rv < seen &&
+            !atomic_compare_exchange_weak( &pool->rv, &seen, rv ) )
+        continue;
+}
+
+static void *dup_worker( void *arg )
+{
+    struct dup_pool *pool = arg;
+    struct dup_job job;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock( &pool->lock );
+        while ( pool->count == 0 && !pool->closed )
+            pthread_cond_wait( &pool->not_empty, &pool->lock );
+
+        if ( pool->count == 0 )
+        {
+            pthread_mutex_unlock( &pool->lock );
+            return NULL;
+        }
+
+        job = pool->jobs[ pool->head ];
+        pool->head = ( pool->head + 1 ) % DUP_QUEUE;
+        -- pool->count;
+        pthread_cond_signal( &pool->not_full );
+        pthread_mutex_unlock( &pool->lock );
+
+        if ( atomic_load( &pool->rv ) == 0 )
+        {
+            int rv = dup_split( job.dir->fd, job.name, &job.st );
+
+            if ( rv == 0 )
+                atomic_fetch_add( &pool->created, 1 );
+            else
+                dup_fail( pool, rv );
+        }
+
+        free( job.name );
+        dup_dir_put( job.dir );
+    }
+}
+
+/* Queue a split of ‹name› in ‹dir›, or do it right away if there are
+ * no workers. Returns -1 if the walk should stop. */
+
+static int dup_submit( struct dup_pool *pool, struct dup_dir *dir,
+                       const char *name, const struct stat *st )
+{
+    if ( pool->nthreads == 0 )
+    {
+        int rv = dup_split( dir->fd, name, st );
+
+        if ( rv == 0 )
+            atomic_fetch_add( &pool->created, 1 );
+        else
+            dup_fail( pool, rv );
+
+        return rv == 0 ? 0 : -1;
+    }
+
+    struct dup_job job = { .dir = dir, .name = strdup( name ), .st = *st };
+
+    if ( !job.name )
+    {
+        dup_fail( pool, -1 );
+        return -1;
+    }
+
+    atomic_fetch_add( &dir->refs, 1 );
+    pthread_mutex_lock( &pool->lock );
+    while ( pool->count == DUP_QUEUE )
+        pthread_cond_wait( &pool->not_full, &pool->lock );
+    pool->jobs[ ( pool->head + pool->count ) % DUP_QUEUE ] = job;
+    ++ pool->count;
+    pthread_cond_signal( &pool->not_empty );
+    pthread_mutex_unlock( &pool->lock );
+
+    return atomic_load( &pool->rv ) == 0 ? 0 : -1;
+}
+
+static int dup_links_rec( int dir_fd, struct inode_set *seen,
+                          struct dup_pool *pool )
+{
+    DIR *dir = fdopendir( dir_fd );
+    struct dup_dir *shared = NULL;
+    char **names = NULL;
+    int count = 0, capacity = 0, rv = -1;
+    struct dirent *ent;
+    struct stat st;
+
+    if ( !dir )
+    {
+        close( dir_fd );
+        return -1;
+    }
+
+    /* Read the whole directory first, so that temporary files and
+     * renames do not show up while it is being read. */
+
+    rewinddir( dir );
+    errno = 0;
+
+    while ( ( ent = readdir( dir ) ) )
+    {
+        if ( strcmp( ent->d_name, "." ) == 0 ||
+             strcmp( ent->d_name, ".." ) == 0 )
+            continue;
+
+        if ( count == capacity )
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            char **bigger = realloc( names, capacity * sizeof( char * ) );
+
+            if ( !bigger )
+                goto out;
+            names = bigger;
+        }
+
+        if ( !( names[ count ] = strdup( ent->d_name ) ) )
+            goto out;
+        ++ count;
+    }
+
+    if ( errno != 0 )
+        goto out;
+
+    /* The descriptor shared with the jobs, which may outlive this
+     * call; the reference held here is dropped at the end. */
+
+    if ( !( shared = malloc( sizeof( struct dup_dir ) ) ) )
+        goto out;
+    if ( ( shared->fd = dup( dir_fd ) ) == -1 )
+    {
+        free( shared );
+        shared = NULL;
+        goto out;
+    }
+    atomic_init( &shared->refs, 1 );
+
+    for ( int i = 0; i < count; ++i )
+    {
+        if ( fstatat( dir_fd, names[ i ], &st, AT_SYMLINK_NOFOLLOW ) == -1 )
+            goto out;
+
+        if ( S_ISDIR( st.st_mode ) )
+        {
+            int sub_fd = openat( dir_fd, names[ i ], O_RDONLY | O_DIRECTORY );
+            int sub_rv = sub_fd == -1 ? -1 :
+                         dup_links_rec( sub_fd, seen, pool );
+
+            if ( sub_rv != 0 )
+            {
+                rv = sub_rv;
+                goto out;
+            }
+        }
+
+        if ( !S_ISREG( st.st_mode ) || st.st_nlink == 1 )
+            continue;
+
+        int added = inode_set_add( seen, st.st_dev, st.st_ino );
+
+        if ( added == -1 )
+            goto out;
+        if ( added == 1 )
+            continue;       /* the first link is kept */
+
+        if ( dup_submit( pool, shared, names[ i ], &st ) != 0 )
+        {
+            rv = 1;         /* the pool has the result */
+            goto out;
+        }
+    }
+
+    rv = 0;
+out:
+    if ( shared )
+        dup_dir_put( shared );
+    for ( int i = 0; i < count; ++i )
+        free( names[ i ] );
+    free( names );
+    closedir( dir );
+    return rv;
+}
+
+int dup_links( int root_fd )
+{
+    struct inode_set seen = { 0 };
+    struct dup_pool pool = { .head = 0 };
+    int fd = dup( root_fd );
+
+    if ( fd == -1 )
+        return -1;
+
+    pthread_mutex_init( &pool.lock, NULL );
+    pthread_cond_init( &pool.not_empty, NULL );
+    pthread_cond_init( &pool.not_full, NULL );
+    atomic_init( &pool.created, 0 );
+    atomic_init( &pool.rv, 0 );
+
+    /* if no thread can be started, the splits are done by the walk */
+    while ( pool.nthreads < DUP_WORKERS &&
+            pthread_create( &pool.threads[ pool.nthreads ], NULL,
+                            dup_worker, &pool ) == 0 )
+        ++ pool.nthreads;
+
+    int rv = dup_links_rec( fd, &seen, &pool );
+
+    if ( rv < 0 )
+        dup_fail( &pool, rv );
+
+    pthread_mutex_lock( &pool.lock );
+    pool.closed = true;
+    pthread_cond_broadcast( &pool.not_empty );
+    pthread_mutex_unlock( &pool.lock );
+
+    for ( int i = 0; i < pool.nthreads; ++i )
+        pthread_join( pool.threads[ i ], NULL );
+
+    pthread_mutex_destroy( &pool.lock );
+    pthread_cond_destroy( &pool.not_empty );
+    pthread_cond_destroy( &pool.not_full );
+    inode_set_free( &seen );
+
+    rv = atomic_load( &pool.rv );
+    return rv == 0 ? atomic_load( &pool.created ) : rv;
+}
+
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 static void unlink_if_exists( int dir, const char *name )
@@ -149,6 +625,85 @@ int main()
     assert( check_file( work_fd, "baz", "x" ) );
     assert( check_file( work_fd, "bar", "y" ) );
 
+    /* three links to one file, in two directories */
+    write_file( sub_fd, "big", "" );
+    if ( linkat( sub_fd, "big", work_fd, "big_1", 0 ) == -1 ||
+         linkat( sub_fd, "big", sub_fd, "big_2", 0 ) == -1 )
+        err( 1, "linking big" );
+
+    assert( dup_links( work_fd ) == 2 );
+    assert( check_file( sub_fd, "big", "" ) );
+    assert( check_file( sub_fd, "big_2", "" ) );
+    assert( check_file( work_fd, "big_1", "" ) );
+    assert( dup_links( work_fd ) == 0 );
+    assert( dup_links( -1 ) == -1 );
+
+    unlink_if_exists( sub_fd, "big_2" );
+    unlink_if_exists( work_fd, "big_1" );
+
+    /* many shared i-nodes, split in parallel */
+    char name[ 32 ], content[ 32 ];
+    int many_fd = mkdir_or_die( work_fd, "many" );
+
+    for ( int i = 0; i < 100; ++i )
+    {
+        snprintf( name, sizeof name, "file_%d", i );
+        snprintf( content, sizeof content, "content %d", i );
+        write_file( many_fd, name, content );
+        for ( int j = 1; j <= 2; ++j )
+        {
+            char link[ 40 ];
+            snprintf( link, sizeof link, "%s.%d", name, j );
+            int at = j == 1 ? many_fd : sub_fd;
+            unlink_if_exists( at, link );
+            if ( linkat( many_fd, name, at, link, 0 ) == -1 )
+                err( 1, "linking %s", link );
+        }
+    }
+
+    /* larger than a single ‹read› in the fallback */
+    int large_fd = create_file( many_fd, "large" );
+    char block[ 4096 ];
+    memset( block, 'z', sizeof block );
+    for ( int i = 0; i < 256; ++i )
+        if ( write( large_fd, block, sizeof block ) == -1 )
+            err( 2, "writing large" );
+    close_or_warn( large_fd, "large" );
+    unlink_if_exists( sub_fd, "large" );
+    if ( linkat( many_fd, "large", sub_fd, "large", 0 ) == -1 )
+        err( 1, "linking large" );
+
+    assert( dup_links( work_fd ) == 201 );
+
+    for ( int i = 0; i < 100; ++i )
+    {
+        char link[ 40 ];
+        snprintf( name, sizeof name, "file_%d", i );
+        snprintf( content, sizeof content, "content %d", i );
+        assert( check_file( many_fd, name, content ) );
+        snprintf( link, sizeof link, "%s.1", name );
+        assert( check_file( many_fd, link, content ) );
+        unlink_if_exists( many_fd, link );
+        snprintf( link, sizeof link, "%s.2", name );
+        assert( check_file( sub_fd, link, content ) );
+        unlink_if_exists( sub_fd, link );
+        unlink_if_exists( many_fd, name );
+    }
+
+    struct stat st_1, st_2;
+    if ( fstatat( many_fd, "large", &st_1, 0 ) == -1 ||
+         fstatat( sub_fd, "large", &st_2, 0 ) == -1 )
+        err( 2, "stat-ing large" );
+    assert( st_1.st_nlink == 1 && st_2.st_nlink == 1 );
+    assert( st_1.st_ino != st_2.st_ino );
+    assert( st_1.st_size == 256 * 4096 && st_2.st_size == 256 * 4096 );
+
+    unlink_if_exists( many_fd, "large" );
+    unlink_if_exists( sub_fd, "large" );
+    close_or_warn( many_fd, "zt.a_root/many" );
+    if ( unlinkat( work_fd, "many", AT_REMOVEDIR ) == -1 )
+        err( 2, "removing many" );
+
     close_or_warn( sub_fd, "zt.a_root/subdir" );
     close_or_warn( work_fd, "zt.a_root" );
 
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE        /* syscall, DT_* */
 
 #include <stddef.h>     /* NULL */
 #include <stdlib.h>
@@ -9,6 +10,8 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>     /* uint64_t */
+#include <sys/syscall.h> /* SYS_getdents64 */
 
 /* Souborové systémy bývají organizovány jako hierarchie souborů
  * a složek. Vaším úkolem je naprogramovat procedury pro vyjádření
@@ -145,47 +148,135 @@ void tree_free(struct node *tree) {
     free(tree);
 }
 
+/* Both trees below read directories as raw ‹getdents64› records,
+ * ‹DIRB_BATCH› bytes per call; ‹dirb_type› falls back to ‹fstatat›
+ * where the file system leaves the type ‹DT_UNKNOWN›. */
+
+#define DIRB_BATCH (64 * 1024)
+
+struct dirb_entry {             /* the kernel's ‹struct linux_dirent64› */
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct dir_batch {
+    int fd;
+    char *buf;
+    long len, pos;
+};
+
+/* Borrows and rewinds ‹dir_fd›. */
+int dirb_open(struct dir_batch *d, int dir_fd) {
+    d->len = d->pos = 0;
+    d->buf = NULL;
+    if ((d->fd = dup(dir_fd)) == -1) {
+        return -1;
+    }
+    if (lseek(d->fd, 0, SEEK_SET) == -1 || !(d->buf = malloc(DIRB_BATCH))) {
+        close(d->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Null at the end (‹errno› is then 0) or on error. */
+const struct dirb_entry *dirb_next(struct dir_batch *d) {
+    if (d->pos >= d->len) {
+        long bytes = syscall(SYS_getdents64, d->fd, d->buf, DIRB_BATCH);
+        if (bytes <= 0) {
+            if (bytes == 0) {
+                errno = 0;
+            }
+            return NULL;
+        }
+        d->len = bytes;
+        d->pos = 0;
+    }
+    const struct dirb_entry *ent = (const void *) (d->buf + d->pos);
+    d->pos += ent->reclen;
+    return ent;
+}
+
+int dirb_type(struct dir_batch *d, const struct dirb_entry *ent) {
+    struct stat st;
+    if (ent->type != DT_UNKNOWN) {
+        return ent->type;
+    }
+    if (fstatat(d->fd, ent->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+    return S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR :
+           S_ISLNK(st.st_mode) ? DT_LNK : S_ISSOCK(st.st_mode) ? DT_SOCK :
+           S_ISFIFO(st.st_mode) ? DT_FIFO : S_ISCHR(st.st_mode) ? DT_CHR :
+           DT_BLK;
+}
+
+void dirb_close(struct dir_batch *d) {
+    free(d->buf);
+    close(d->fd);
+}
+
+enum file_type get_dirent_type(int type) {
+    switch (type) {
+        case DT_REG:
+            return t_regular;
+        case DT_DIR:
+            return t_directory;
+        case DT_SOCK:
+            return t_socket;
+        case DT_LNK:
+            return t_symlink;
+        default:
+            return t_other;
+    }
+}
+
 int tree_create_rec(int root_fd, struct node *node) {
     if (root_fd == -1) {
         node->error = errno;
         return -1;
     }
 
-    int rv = -1;
-    DIR *dir = fdopendir(root_fd);
-    if (!dir) {
+    struct dir_batch dir;
+    if (dirb_open(&dir, root_fd) == -1) {
         node->error = errno;
-        goto out;
+        close(root_fd);
+        return -1;
     }
+    close(root_fd);
 
-    rewinddir(dir);
-    struct dirent *ptr;
-    struct stat st;
+    int rv;
+    const struct dirb_entry *ent;
     bool error = false;
     bool directory = true;
-    while ((ptr = readdir(dir))) {
-        if (strcmp(ptr->d_name, ".") == 0 ||
-            strcmp(ptr->d_name, "..") == 0) {
+    while ((ent = dirb_next(&dir))) {
+        if (strcmp(ent->name, ".") == 0 ||
+            strcmp(ent->name, "..") == 0) {
             continue;
         }
 
-        if (fstatat(root_fd, ptr->d_name, &st,
-                    AT_SYMLINK_NOFOLLOW) == -1) {
-            if (!append_node(&node, ptr->d_name, t_other, errno, directory)) {
+        int type = dirb_type(&dir, ent);
+        if (type == -1) {
+            if (!append_node(&node, ent->name, t_other, errno, directory)) {
                 rv = -2;
                 goto out;
             }
+            directory = false;
+            error = true;
             continue;
         }
-        if (!append_node(&node, ptr->d_name, get_file_type(st.st_mode), 0, directory)) {
+        if (!append_node(&node, ent->name, get_dirent_type(type), 0, directory)) {
             rv = -2;
             goto out;
         }
         directory = false;
-        if (!S_ISDIR(st.st_mode)) {
+        if (type != DT_DIR) {
             continue;
         }
-        int sub_fd = openat(root_fd, ptr->d_name,
+        int sub_fd = openat(dir.fd, ent->name,
                             O_DIRECTORY | O_RDONLY);
         rv = tree_create_rec(sub_fd, node);
         if (rv == -2) {
@@ -195,12 +286,13 @@ int tree_create_rec(int root_fd, struct node *node) {
             error = true;
         }
     }
+    if (errno != 0) {
+        error = true;
+    }
 
     rv = error ? -1 : 0;
     out:
-    if (dir) {
-        closedir(dir);
-    }
+    dirb_close(&dir);
     return rv;
 }
 
@@ -227,6 +319,194 @@ int tree_create(int at, const char *root_name, struct node **out) {
     return rv;
 }
 
+/* Besides the linked ‹node› tree, a subtree can be captured as
+ * a snapshot, which needs just two allocations however large the
+ * tree is: all entries live in one array and all names in one
+ * character buffer (entries refer to their names by offset, so
+ * that both can grow with ‹realloc›). The children of a directory
+ * are always stored next to each other – a directory is read
+ * completely before any of its subdirectories – and the directory
+ * only records where they start and how many there are. Entry 0 is
+ * the root. Freeing the snapshot is two calls to ‹free›.
+ *
+ * The results of ‹tree_snapshot_create› are the same as those of
+ * ‹tree_create›, including ‹error› of the entries which could not
+ * be read. ‹tree_snapshot_to_nodes› converts a snapshot into the
+ * ‹node› layout. */
+
+struct snap_entry {
+    size_t name;                /* offset into ‹names› */
+    enum file_type type;
+    int error;
+    size_t first, count;        /* children, for directories */
+};
+
+struct tree_snapshot {
+    struct snap_entry *entries;
+    size_t count, capacity;
+    char *names;
+    size_t names_used, names_capacity;
+};
+
+const char *snapshot_name(const struct tree_snapshot *snap,
+                          const struct snap_entry *entry) {
+    return snap->names + entry->name;
+}
+
+void tree_snapshot_free(struct tree_snapshot *snap) {
+    free(snap->entries);
+    free(snap->names);
+    memset(snap, 0, sizeof(struct tree_snapshot));
+}
+
+static bool snap_reserve(void **buf, size_t *capacity, size_t needed,
+                         size_t item) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t bigger = *capacity ? *capacity : 1024;
+    while (bigger < needed) {
+        bigger *= 2;
+    }
+    void *tmp = realloc(*buf, bigger * item);
+    if (!tmp) {
+        return false;
+    }
+    *buf = tmp;
+    *capacity = bigger;
+    return true;
+}
+
+/* Returns the index of the new entry, or -1 if out of memory. */
+static ssize_t snap_append(struct tree_snapshot *snap, const char *name,
+                           enum file_type type, int error) {
+    size_t len = strlen(name) + 1;
+    if (!snap_reserve((void **) &snap->entries, &snap->capacity,
+                      snap->count + 1, sizeof(struct snap_entry)) ||
+        !snap_reserve((void **) &snap->names, &snap->names_capacity,
+                      snap->names_used + len, 1)) {
+        return -1;
+    }
+    memcpy(snap->names + snap->names_used, name, len);
+    snap->entries[snap->count] = (struct snap_entry) {
+        .name = snap->names_used, .type = type, .error = error,
+    };
+    snap->names_used += len;
+    return snap->count++;
+}
+
+/* Read the directory ‹dir_fd› (borrowed) into the children of entry
+ * ‹index›, then recurse into its subdirectories. Entries are only
+ * ever referred to by index, since the array may move. */
+static int snap_read(struct tree_snapshot *snap, int dir_fd, size_t index) {
+    struct dir_batch dir;
+    const struct dirb_entry *ent;
+    bool error = false;
+
+    if (dirb_open(&dir, dir_fd) == -1) {
+        snap->entries[index].error = errno;
+        return -1;
+    }
+
+    size_t first = snap->count;
+    while ((ent = dirb_next(&dir))) {
+        if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+            continue;
+        }
+        int type = dirb_type(&dir, ent);
+        int rv = type == -1
+                 ? snap_append(snap, ent->name, t_other, errno)
+                 : snap_append(snap, ent->name, get_dirent_type(type), 0);
+        if (rv == -1) {
+            dirb_close(&dir);
+            return -2;
+        }
+        error = error || type == -1;
+    }
+    if (errno != 0) {
+        snap->entries[index].error = errno;
+        error = true;
+    }
+    snap->entries[index].first = first;
+    snap->entries[index].count = snap->count - first;
+
+    for (size_t i = first; i < first + snap->entries[index].count; ++i) {
+        if (snap->entries[i].type != t_directory) {
+            continue;
+        }
+        int sub_fd = openat(dir.fd, snapshot_name(snap, &snap->entries[i]),
+                            O_DIRECTORY | O_RDONLY);
+        if (sub_fd == -1) {
+            snap->entries[i].error = errno;
+            error = true;
+            continue;
+        }
+        int rv = snap_read(snap, sub_fd, i);
+        close(sub_fd);
+        if (rv == -2) {
+            dirb_close(&dir);
+            return -2;
+        }
+        error = error || rv == -1;
+    }
+
+    dirb_close(&dir);
+    return error ? -1 : 0;
+}
+
+int tree_snapshot_create(int at, const char *root_name,
+                         struct tree_snapshot *out) {
+    memset(out, 0, sizeof(struct tree_snapshot));
+    if (snap_append(out, root_name, t_directory, 0) == -1) {
+        tree_snapshot_free(out);
+        return -2;
+    }
+
+    int fd = openat(at, root_name, O_DIRECTORY | O_RDONLY);
+    if (fd == -1) {
+        out->entries[0].error = errno;
+        return -1;
+    }
+    int rv = snap_read(out, fd, 0);
+    close(fd);
+    if (rv == -2) {
+        tree_snapshot_free(out);
+    }
+    return rv;
+}
+
+static struct node *snap_to_nodes(const struct tree_snapshot *snap,
+                                  size_t index) {
+    const struct snap_entry *entry = &snap->entries[index];
+    struct node *node = malloc(sizeof(struct node));
+    if (!node) {
+        return NULL;
+    }
+    if (!set_node(node, snapshot_name(snap, entry), entry->type,
+                  entry->error, NULL, NULL)) {
+        free(node);
+        return NULL;
+    }
+
+    struct node **link = &node->dir;
+    for (size_t i = entry->first; i < entry->first + entry->count; ++i) {
+        if (!(*link = snap_to_nodes(snap, i))) {
+            tree_free(node);
+            return NULL;
+        }
+        link = &(*link)->next;
+    }
+    return node;
+}
+
+/* Returns 0, or -2 (with ‹*out› set to a null pointer) if out of
+ * memory. */
+int tree_snapshot_to_nodes(const struct tree_snapshot *snap,
+                           struct node **out) {
+    *out = snap->count ? snap_to_nodes(snap, 0) : NULL;
+    return *out ? 0 : -2;
+}
+
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
 #include <assert.h>     /* assert */
@@ -278,6 +558,22 @@ static int create_dir(int at, const char *dir) {
     return open_dir_at(at, dir);
 }
 
+static void check_same(const struct tree_snapshot *snap, size_t index,
+                       const struct node *node) {
+    const struct snap_entry *entry = &snap->entries[index];
+    assert(strcmp(snapshot_name(snap, entry), node->name) == 0);
+    assert(entry->type == node->type);
+    assert(entry->error == node->error);
+
+    const struct node *child = node->dir;
+    for (size_t i = entry->first; i < entry->first + entry->count; ++i) {
+        assert(child != NULL);
+        check_same(snap, i, child);
+        child = child->next;
+    }
+    assert(child == NULL);
+}
+
 int main(void) {
     unlink_if_exists(AT_FDCWD, "zt.b_root/folder/file_b");
     rmdir_if_exists(AT_FDCWD, "zt.b_root/folder");
@@ -329,6 +625,25 @@ int main(void) {
 
     tree_free(tree);
 
+    struct tree_snapshot snap;
+    assert(tree_snapshot_create(AT_FDCWD, "zt.b_root", &snap) == 0);
+    assert(snap.count == 4);
+    assert(snap.entries[0].first == 1);
+    assert(snap.entries[0].count == 2);
+    assert(tree_create(AT_FDCWD, "zt.b_root", &tree) == 0);
+    check_same(&snap, 0, tree);
+    tree_free(tree);
+
+    assert(tree_snapshot_to_nodes(&snap, &tree) == 0);
+    check_same(&snap, 0, tree);
+    tree_free(tree);
+    tree_snapshot_free(&snap);
+
+    assert(tree_snapshot_create(AT_FDCWD, "zt.b_nonexistent", &snap) == -1);
+    assert(snap.count == 1);
+    assert(snap.entries[0].error == ENOENT);
+    tree_snapshot_free(&snap);
+
     close_or_warn(root, "zt.b_root");
 
     unlink_if_exists(AT_FDCWD, "zt.b_root/folder/file_b");
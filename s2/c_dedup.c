@@ -41,7 +41,582 @@
  * selhání považujeme za trvalé (nelze jej zvrátit opakovaným
  * voláním se stejnými parametry). */
 
-int dedup( int root_fd, int attic_fd );
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define EDGE_SIZE    4096       /* bytes hashed at each end of a file */
+#define BLOCK_SIZE   (1 << 16)
+#define MAX_READERS  16
+#define TMP_NAME     ".dedup.tmp"
+
+/* Comparing files pairwise does not scale, so candidates are
+ * narrowed down in stages, each much cheaper per file than the next:
+ *
+ *  1. a single walk with ‹fstatat› collects every link; links are
+ *     then sorted by (dev, ino), so that each inode – however many
+ *     hard links it already has – is considered (and read) only once,
+ *  2. inodes are grouped by (dev, size); a unique size means unique
+ *     content,
+ *  3. the rest get a hash of their first and last ‹EDGE_SIZE› bytes
+ *     (for small files, this covers the whole file),
+ *  4. inodes which still collide get a full hash, computed by a pool
+ *     of reader threads,
+ *  5. only inodes with equal full hashes are compared byte by byte
+ *     (via ‹mmap›) before they are linked together.
+ *
+ * Each stage records how many files and bytes it processed and how
+ * long it took, see ‹struct dedup_stats› and ‹dedup_report›. */
+
+struct dedup_stage {
+    long files;
+    long long bytes;
+    double seconds;
+};
+
+struct dedup_stats {
+    struct dedup_stage walk, size, partial, full, compare, link;
+};
+
+struct dd_link {
+    char *path;                 /* relative to ‹root_fd› */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+};
+
+struct dd_inode {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int first, count;           /* range in the sorted link array */
+    uint64_t partial, full;
+    int keep;                   /* index of the inode whose content we keep */
+};
+
+struct dd_state {
+    int root_fd;
+    struct dd_link *links;
+    int nlinks, cap;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3u;
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) {
+        h = (h ^ data[i]) * 0x100000001b3u;
+    }
+    return h;
+}
+
+static int add_link(struct dd_state *st, char *path, const struct stat *sb) {
+    if (st->nlinks == st->cap) {
+        int cap = st->cap ? 2 * st->cap : 64;
+        struct dd_link *links = realloc(st->links, cap * sizeof(struct dd_link));
+        if (!links) {
+            return -1;
+        }
+        st->links = links;
+        st->cap = cap;
+    }
+    struct dd_link *link = &st->links[st->nlinks++];
+    link->path = path;
+    link->dev = sb->st_dev;
+    link->ino = sb->st_ino;
+    link->size = sb->st_size;
+    return 0;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = dir ? strlen(dir) : 0;
+    char *path = malloc(dlen + strlen(name) + 2);
+    if (!path) {
+        return NULL;
+    }
+    if (dir) {
+        memcpy(path, dir, dlen);
+        path[dlen++] = '/';
+    }
+    strcpy(path + dlen, name);
+    return path;
+}
+
+/* Stage 1: collect all regular files below ‹dir_fd› (which is closed). */
+
+static int walk(struct dd_state *st, int dir_fd, const char *prefix) {
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -1;
+    }
+    int rv = 0;
+    struct dirent *ent;
+    struct stat sb;
+    while ((errno = 0, ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+            strcmp(ent->d_name, TMP_NAME) == 0) {
+            continue;
+        }
+        if (fstatat(dir_fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+            rv = -1;
+            break;
+        }
+        if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode)) {
+            continue;
+        }
+        char *path = join_path(prefix, ent->d_name);
+        if (!path) {
+            rv = -1;
+            break;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            if (add_link(st, path, &sb) == -1) {
+                free(path);
+                rv = -1;
+                break;
+            }
+            continue;
+        }
+        int sub_fd = openat(dir_fd, ent->d_name, O_RDONLY | O_DIRECTORY);
+        rv = sub_fd == -1 ? -1 : walk(st, sub_fd, path);
+        free(path);
+        if (rv == -1) {
+            break;
+        }
+    }
+    if (errno != 0) {
+        rv = -1;
+    }
+    closedir(dir);
+    return rv;
+}
+
+static int cmp_link(const void *a, const void *b) {
+    const struct dd_link *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static int cmp_inode(const void *a, const void *b) {
+    const struct dd_inode *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->partial != y->partial) {
+        return x->partial < y->partial ? -1 : 1;
+    }
+    if (x->full != y->full) {
+        return x->full < y->full ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static bool same_key(const struct dd_inode *x, const struct dd_inode *y) {
+    return x->dev == y->dev && x->size == y->size &&
+           x->partial == y->partial && x->full == y->full;
+}
+
+/* Mark inodes which share their key with a neighbour (the array is
+ * sorted by key); returns how many there are, others get ‹keep = -2›. */
+
+static int mark_candidates(struct dd_inode *inodes, int count) {
+    int candidates = 0;
+    for (int i = 0; i < count; ++i) {
+        bool dup = (i > 0 && same_key(&inodes[i - 1], &inodes[i])) ||
+                   (i + 1 < count && same_key(&inodes[i], &inodes[i + 1]));
+        inodes[i].keep = dup ? -1 : -2;
+        candidates += dup;
+    }
+    return candidates;
+}
+
+/* Drop inodes which are not candidates any more, keeping the order. */
+
+static int compact(struct dd_inode *inodes, int count) {
+    int out = 0;
+    for (int i = 0; i < count; ++i) {
+        if (inodes[i].keep != -2) {
+            inodes[out++] = inodes[i];
+        }
+    }
+    return out;
+}
+
+static int open_inode(struct dd_state *st, const struct dd_inode *inode) {
+    return openat(st->root_fd, st->links[inode->first].path, O_RDONLY);
+}
+
+/* Stage 3: hash of the first and last ‹EDGE_SIZE› bytes. */
+
+static int partial_hash(struct dd_state *st, struct dd_inode *inode, long long *bytes) {
+    uint8_t buffer[2 * EDGE_SIZE];
+    int fd = open_inode(st, inode);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t head = inode->size < EDGE_SIZE ? (size_t) inode->size : EDGE_SIZE;
+    off_t tail_off = inode->size - EDGE_SIZE;
+    if (tail_off < (off_t) head) {
+        tail_off = head;
+    }
+    size_t tail = inode->size - tail_off;
+    ssize_t a = pread(fd, buffer, head, 0);
+    ssize_t b = tail ? pread(fd, buffer + head, tail, tail_off) : 0;
+    close(fd);
+    if (a != (ssize_t) head || b != (ssize_t) tail) {
+        return -1;
+    }
+    inode->partial = hash_bytes(inode->size, buffer, head + tail);
+    *bytes += head + tail;
+    return 0;
+}
+
+/* Stage 4: full hashes, computed by a pool of readers which take the
+ * next inode from a shared counter. Small files were already hashed
+ * whole in stage 3. */
+
+struct dd_readers {
+    struct dd_state *st;
+    struct dd_inode *inodes;
+    int count;
+    int next;
+    int error;
+    long long bytes;
+    pthread_mutex_t lock;
+};
+
+static int full_hash(struct dd_state *st, struct dd_inode *inode, uint8_t *buffer) {
+    int fd = open_inode(st, inode);
+    if (fd == -1) {
+        return -1;
+    }
+    uint64_t h = inode->size;
+    ssize_t nbytes;
+    while ((nbytes = read(fd, buffer, BLOCK_SIZE)) > 0) {
+        h = hash_bytes(h, buffer, nbytes);
+    }
+    close(fd);
+    inode->full = h;
+    return nbytes == -1 ? -1 : 0;
+}
+
+static void *reader(void *arg) {
+    struct dd_readers *r = arg;
+    uint8_t *buffer = malloc(BLOCK_SIZE);
+    long long bytes = 0;
+    int error = buffer ? 0 : -1;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        int i = r->error ? r->count : r->next++;
+        pthread_mutex_unlock(&r->lock);
+        if (i >= r->count || error) {
+            break;
+        }
+        struct dd_inode *inode = &r->inodes[i];
+        if (inode->size <= 2 * EDGE_SIZE) {
+            inode->full = inode->partial;
+            continue;
+        }
+        if (full_hash(r->st, inode, buffer) == -1) {
+            error = -1;
+        }
+        bytes += inode->size;
+    }
+    pthread_mutex_lock(&r->lock);
+    r->bytes += bytes;
+    if (error) {
+        r->error = -1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    free(buffer);
+    return NULL;
+}
+
+static int hash_all(struct dd_state *st, struct dd_inode *inodes, int count, long long *bytes) {
+    struct dd_readers r = { .st = st, .inodes = inodes, .count = count };
+    pthread_t tids[MAX_READERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nreaders = cpus > 0 ? 2 * (int) cpus : 2;
+    if (nreaders > MAX_READERS) {
+        nreaders = MAX_READERS;
+    }
+    if (nreaders > count) {
+        nreaders = count;
+    }
+    pthread_mutex_init(&r.lock, NULL);
+    int started = 0;
+    for (; started < nreaders; ++started) {
+        if (pthread_create(&tids[started], NULL, reader, &r) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        reader(&r);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_mutex_destroy(&r.lock);
+    *bytes += r.bytes;
+    return r.error;
+}
+
+/* Stage 5: byte comparison; returns 1 if equal, 0 if not, -1 on error. */
+
+static int same_content(struct dd_state *st, const struct dd_inode *a, const struct dd_inode *b) {
+    if (a->size == 0) {
+        return 1;
+    }
+    int rv = -1;
+    int fd_a = open_inode(st, a), fd_b = open_inode(st, b);
+    void *map_a = MAP_FAILED, *map_b = MAP_FAILED;
+    if (fd_a == -1 || fd_b == -1) {
+        goto out;
+    }
+    map_a = mmap(NULL, a->size, PROT_READ, MAP_PRIVATE, fd_a, 0);
+    map_b = mmap(NULL, b->size, PROT_READ, MAP_PRIVATE, fd_b, 0);
+    if (map_a == MAP_FAILED || map_b == MAP_FAILED) {
+        goto out;
+    }
+    rv = memcmp(map_a, map_b, a->size) == 0;
+out:
+    if (map_a != MAP_FAILED) {
+        munmap(map_a, a->size);
+    }
+    if (map_b != MAP_FAILED) {
+        munmap(map_b, b->size);
+    }
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    return rv;
+}
+
+/* Point every link of ‹dup› at the content of ‹keep›. The attic
+ * gets a link named after the replaced inode first; each link in the
+ * tree is then swapped atomically (link to a temporary name in the
+ * same directory, then rename over the old link), so every name in
+ * the tree points to the same content at all times. Returns -2 if
+ * a temporary link could not be cleaned up. */
+
+static int replace(struct dd_state *st, int attic_fd,
+                   const struct dd_inode *keep, const struct dd_inode *dup) {
+    const char *src = st->links[keep->first].path;
+    char name[32];
+    snprintf(name, sizeof name, "%llu", (unsigned long long) dup->ino);
+    if (linkat(st->root_fd, src, attic_fd, name, 0) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    for (int i = dup->first; i < dup->first + dup->count; ++i) {
+        char *path = st->links[i].path;
+        char *slash = strrchr(path, '/');
+        char *tmp = NULL;
+        if (slash) {
+            *slash = '\0';
+            tmp = join_path(path, TMP_NAME);
+            *slash = '/';
+        } else {
+            tmp = join_path(NULL, TMP_NAME);
+        }
+        if (!tmp) {
+            return -1;
+        }
+        int rv = 0;
+        if (linkat(st->root_fd, src, st->root_fd, tmp, 0) == -1) {
+            rv = -1;
+        } else if (renameat(st->root_fd, tmp, st->root_fd, path) == -1) {
+            rv = unlinkat(st->root_fd, tmp, 0) == -1 ? -2 : -1;
+        }
+        free(tmp);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
+
+int dedup_stats(int root_fd, int attic_fd, struct dedup_stats *stats) {
+    struct dedup_stats local;
+    struct dd_state st = { .root_fd = root_fd };
+    struct dd_inode *inodes = NULL;
+    int count = 0, rv = -1;
+    double t;
+
+    if (!stats) {
+        stats = &local;
+    }
+    memset(stats, 0, sizeof *stats);
+
+    t = now();
+    int dir_fd = openat(root_fd, ".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || walk(&st, dir_fd, NULL) == -1) {
+        goto out;
+    }
+    stats->walk.files = st.nlinks;
+    stats->walk.seconds = now() - t;
+
+    /* group links into inodes */
+    t = now();
+    qsort(st.links, st.nlinks, sizeof(struct dd_link), cmp_link);
+    inodes = malloc((st.nlinks ? st.nlinks : 1) * sizeof(struct dd_inode));
+    if (!inodes) {
+        goto out;
+    }
+    for (int i = 0; i < st.nlinks; ++i) {
+        if (count > 0 && inodes[count - 1].dev == st.links[i].dev &&
+            inodes[count - 1].ino == st.links[i].ino) {
+            ++inodes[count - 1].count;
+            continue;
+        }
+        struct dd_inode *inode = &inodes[count++];
+        inode->dev = st.links[i].dev;
+        inode->ino = st.links[i].ino;
+        inode->size = st.links[i].size;
+        inode->first = i;
+        inode->count = 1;
+        inode->partial = inode->full = 0;
+    }
+    stats->size.files = count;
+    qsort(inodes, count, sizeof(struct dd_inode), cmp_inode);
+    mark_candidates(inodes, count);
+    count = compact(inodes, count);
+    stats->size.seconds = now() - t;
+
+    t = now();
+    stats->partial.files = count;
+    for (int i = 0; i < count; ++i) {
+        if (partial_hash(&st, &inodes[i], &stats->partial.bytes) == -1) {
+            goto out;
+        }
+    }
+    qsort(inodes, count, sizeof(struct dd_inode), cmp_inode);
+    mark_candidates(inodes, count);
+    count = compact(inodes, count);
+    stats->partial.seconds = now() - t;
+
+    t = now();
+    stats->full.files = count;
+    if (count > 0 && hash_all(&st, inodes, count, &stats->full.bytes) == -1) {
+        goto out;
+    }
+    qsort(inodes, count, sizeof(struct dd_inode), cmp_inode);
+    mark_candidates(inodes, count);
+    count = compact(inodes, count);
+    stats->full.seconds = now() - t;
+
+    /* within a run of equal keys, compare against a representative;
+     * inodes which differ (hash collisions) start their own group */
+    t = now();
+    stats->compare.files = count;
+    for (int i = 0; i < count; ) {
+        int end = i + 1;
+        while (end < count && same_key(&inodes[i], &inodes[end])) {
+            ++end;
+        }
+        for (int r = i; r < end; ++r) {
+            if (inodes[r].keep != -1) {
+                continue;
+            }
+            inodes[r].keep = r;
+            for (int j = r + 1; j < end; ++j) {
+                if (inodes[j].keep != -1) {
+                    continue;
+                }
+                int same = same_content(&st, &inodes[r], &inodes[j]);
+                if (same == -1) {
+                    goto out;
+                }
+                stats->compare.bytes += inodes[j].size;
+                if (same) {
+                    inodes[j].keep = r;
+                }
+            }
+        }
+        i = end;
+    }
+    stats->compare.seconds = now() - t;
+
+    t = now();
+    rv = 0;
+    for (int i = 0; i < count; ++i) {
+        if (inodes[i].keep == i) {
+            continue;
+        }
+        int r = replace(&st, attic_fd, &inodes[inodes[i].keep], &inodes[i]);
+        if (r != 0) {
+            rv = r;
+            break;
+        }
+        ++stats->link.files;
+        stats->link.bytes += inodes[i].size;
+    }
+    stats->link.seconds = now() - t;
+
+out:
+    for (int i = 0; i < st.nlinks; ++i) {
+        free(st.links[i].path);
+    }
+    free(st.links);
+    free(inodes);
+    return rv;
+}
+
+int dedup(int root_fd, int attic_fd) {
+    return dedup_stats(root_fd, attic_fd, NULL);
+}
+
+static void report_stage(FILE *out, const char *name,
+                         const struct dedup_stage *stage) {
+    double mib = stage->bytes / (1024.0 * 1024.0);
+    fprintf(out, "%-8s %10ld files %12.1f MiB %8.3f s",
+            name, stage->files, mib, stage->seconds);
+    if (stage->seconds > 0) {
+        fprintf(out, " %10.1f files/s %8.1f MiB/s",
+                stage->files / stage->seconds, mib / stage->seconds);
+    }
+    fputc('\n', out);
+}
+
+void dedup_report(const struct dedup_stats *stats, FILE *out) {
+    report_stage(out, "walk", &stats->walk);
+    report_stage(out, "size", &stats->size);
+    report_stage(out, "partial", &stats->partial);
+    report_stage(out, "full", &stats->full);
+    report_stage(out, "compare", &stats->compare);
+    report_stage(out, "link", &stats->link);
+}
 
 /* ┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄┄┄┄ následují testy ┄┄┄┄┄┄┄┄┄┄ %< ┄┄┄┄┄┄┄ */
 
@@ -136,6 +711,87 @@ static void unlink_files_from_if_exists( int wd, const char* path )
         err( 2, "closedir %s", path );
 }
 
+static void create_big( int at, const char *name, size_t size, char middle )
+{
+    int fd = openat( at, name, O_CREAT | O_TRUNC | O_WRONLY, 0666 );
+    if ( fd == -1 )
+        err( 2, "creating %s", name );
+
+    char block[ 1024 ];
+    for ( size_t off = 0; off < size; off += sizeof block )
+    {
+        memset( block, off > 8192 && off + 8192 < size ? middle : 'e', sizeof block );
+        if ( write( fd, block, sizeof block ) == -1 )
+            err( 2, "writing contents to %s", name );
+    }
+
+    close_or_warn( fd, name );
+}
+
+/* Larger files whose first and last 4 KiB agree but which differ in
+ * the middle must survive the partial hash; files which are already
+ * hard links of each other are read once; empty files are equal. */
+
+static void test_stages( void )
+{
+    unlink_files_from_if_exists( AT_FDCWD, "zt.c_attic" );
+    unlink_files_from_if_exists( AT_FDCWD, "zt.c_big" );
+    rmdir_if_exists( AT_FDCWD, "zt.c_big" );
+
+    int attic = open_dir_at( AT_FDCWD, "zt.c_attic" );
+    int root = create_dir( AT_FDCWD, "zt.c_big" );
+
+    create_big( root, "big_a", 64 * 1024, 'x' );
+    create_big( root, "big_b", 64 * 1024, 'x' );
+    create_big( root, "big_c", 64 * 1024, 'y' );
+    if ( linkat( root, "big_a", root, "big_a2", 0 ) == -1 )
+        err( 2, "linkat" );
+    create_file( root, "empty_1", "" );
+    create_file( root, "empty_2", "" );
+
+    struct dedup_stats stats;
+    assert( dedup_stats( root, attic, &stats ) == 0 );
+
+    assert( stats.walk.files == 6 );
+    assert( stats.size.files == 5 );
+    assert( stats.partial.files == 5 );
+    assert( stats.full.files == 5 );
+    assert( stats.full.bytes == 3 * 64 * 1024 );
+    assert( stats.compare.files == 4 );
+    assert( stats.link.files == 2 );
+
+    /* one line per stage, in the order in which they run */
+    char report[ 1024 ], *line = report;
+    FILE *out = fmemopen( report, sizeof report, "w" );
+    assert( out );
+    dedup_report( &stats, out );
+    assert( fclose( out ) == 0 );
+
+    const char *names[] = { "walk", "size", "partial", "full",
+                            "compare", "link" };
+    for ( int i = 0; i < 6; ++i )
+    {
+        assert( strncmp( line, names[ i ], strlen( names[ i ] ) ) == 0 );
+        assert( strstr( line, " files " ) );
+        assert( ( line = strchr( line, '\n' ) ) );
+        ++line;
+    }
+    assert( *line == '\0' );
+    assert( strstr( report, "   6 files " ) );
+
+    assert( inode_num( root, "big_a" ) == inode_num( root, "big_b" ) );
+    assert( inode_num( root, "big_a" ) == inode_num( root, "big_a2" ) );
+    assert( inode_num( root, "big_a" ) != inode_num( root, "big_c" ) );
+    assert( inode_num( root, "empty_1" ) == inode_num( root, "empty_2" ) );
+
+    close_or_warn( root, "big root" );
+    close_or_warn( attic, "attic" );
+
+    unlink_files_from_if_exists( AT_FDCWD, "zt.c_attic" );
+    unlink_files_from_if_exists( AT_FDCWD, "zt.c_big" );
+    rmdir_if_exists( AT_FDCWD, "zt.c_big" );
+}
+
 int main( void )
 {
     unlink_files_from_if_exists( AT_FDCWD, "zt.c_attic" );
@@ -183,5 +839,7 @@ int main( void )
     unlink_if_exists( AT_FDCWD, "zt.c_data/same_a" );
     unlink_if_exists( AT_FDCWD, "zt.c_data/different_c" );
     rmdir_if_exists(  AT_FDCWD, "zt.c_data" );
+
+    test_stages();
     return 0;
 }